@@ -0,0 +1,1111 @@
+// Microbenchmarks for smallfolk_cpp
+// Prints one JSON object per line so the results can be collected and compared between builds.
+// Usage: smallfolk_bench [--quick] [filter]
+// --quick runs each benchmark for a shorter time, filter only runs benchmarks whose name contains it.
+// Build with -DCMAKE_BUILD_TYPE=Release, unoptimized results are marked with "optimized":false.
+#include "smallfolk.h"
+#include "smallfolk_lz.h"
+#include "smallfolk_log.h"
+#include "smallfolk_shared.h"
+#include <iostream> // std::cout
+#include <fstream> // std::ifstream
+#include <sstream> // std::ostringstream
+#include <chrono> // std::chrono
+#include <atomic> // std::atomic
+#include <functional> // std::function
+#include <cstdlib> // malloc, std::abort
+#include <cstdio> // std::remove
+#include <algorithm> // std::sort
+#include <thread> // std::thread
+#include <mutex> // std::mutex
+#ifdef __GLIBC__
+#include <malloc.h> // malloc_trim
+#endif
+
+namespace
+{
+    // heap usage of the whole program, counted by the operator new below
+    std::atomic<size_t> alloc_count(0);
+    std::atomic<size_t> alloc_bytes(0);
+    std::atomic<size_t> live_bytes(0);
+    std::atomic<size_t> peak_bytes(0);
+
+    // allocation header, keeps the returned memory aligned for any type
+    size_t const header = 16;
+
+    void * counted_alloc(size_t size)
+    {
+        size_t * p = static_cast<size_t*>(malloc(size + header));
+        if (!p)
+            std::abort(); // out of memory, also works in builds without exceptions
+        *p = size;
+        alloc_count.fetch_add(1, std::memory_order_relaxed);
+        alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+        size_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+        size_t peak = peak_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+        {
+        }
+        return reinterpret_cast<char*>(p) + header;
+    }
+
+    void counted_free(void * ptr)
+    {
+        if (!ptr)
+            return;
+        size_t * p = reinterpret_cast<size_t*>(static_cast<char*>(ptr) - header);
+        live_bytes.fetch_sub(*p, std::memory_order_relaxed);
+        free(p);
+    }
+}
+
+void * operator new(size_t size) { return counted_alloc(size); }
+void * operator new[](size_t size) { return counted_alloc(size); }
+void operator delete(void * ptr) noexcept { counted_free(ptr); }
+void operator delete[](void * ptr) noexcept { counted_free(ptr); }
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    double min_time = 0.2; // seconds per benchmark
+    std::string filter;
+    volatile size_t sink = 0; // keeps results from being optimized away
+
+    // deterministic random numbers so that every run uses the same data
+    struct Random
+    {
+        explicit Random(unsigned int seed) : state(seed) {}
+        unsigned int next()
+        {
+            state = state * 1103515245u + 12345u;
+            return (state >> 16) & 0x7FFF;
+        }
+        double real() { return next() / 32768.0; }
+        std::string word(size_t len)
+        {
+            std::string s;
+            for (size_t i = 0; i < len; ++i)
+                s += static_cast<char>('a' + next() % 26);
+            return s;
+        }
+        unsigned int state;
+    };
+
+    struct Result
+    {
+        size_t iterations;
+        double ns; // per operation
+        double allocs; // per operation
+        double alloc_bytes; // per operation
+    };
+
+    bool selected(std::string const & name)
+    {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    }
+
+    Result measure(std::function<void()> const & f)
+    {
+        f(); // warm up
+        Result r;
+        size_t count = alloc_count.load();
+        size_t bytes = alloc_bytes.load();
+        f();
+        r.allocs = static_cast<double>(alloc_count.load() - count);
+        r.alloc_bytes = static_cast<double>(alloc_bytes.load() - bytes);
+        size_t n = 1;
+        while (true)
+        {
+            Clock::time_point start = Clock::now();
+            for (size_t i = 0; i < n; ++i)
+                f();
+            double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            if (elapsed >= min_time || n >= (1u << 30))
+            {
+                r.iterations = n;
+                r.ns = elapsed * 1e9 / n;
+                return r;
+            }
+            // aim a bit above the minimum time with the next round
+            double scale = elapsed > 0 ? 1.5 * min_time / elapsed : 100;
+            n = static_cast<size_t>(n * (scale < 2 ? 2 : scale > 100 ? 100 : scale));
+        }
+    }
+
+    std::string json_escape(std::string const & s)
+    {
+        std::string out;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            out += c;
+        }
+        return out;
+    }
+
+    // extra is appended to the JSON object as is, for example ,"ratio":3.1
+    void report(std::string const & name, std::string const & corpus, Result const & r, size_t bytes = 0, std::string const & extra = std::string())
+    {
+        std::ostringstream out;
+        out << "{\"name\":\"" << json_escape(name) << "\",\"corpus\":\"" << json_escape(corpus) << "\"";
+        out << ",\"iterations\":" << r.iterations << ",\"ns_per_op\":" << r.ns;
+        if (bytes)
+            out << ",\"bytes\":" << bytes << ",\"mb_per_s\":" << bytes / r.ns * 1e3;
+        out << ",\"allocs_per_op\":" << r.allocs << ",\"alloc_bytes_per_op\":" << r.alloc_bytes;
+        out << extra << "}";
+        std::cout << out.str() << std::endl;
+    }
+
+    void run(std::string const & name, std::string const & corpus, std::function<void()> const & f, size_t bytes = 0, std::string const & extra = std::string())
+    {
+        if (!selected(name))
+            return;
+        report(name, corpus, measure(f), bytes, extra);
+    }
+
+    // records with nested tables, strings and numbers like a typical game state message
+    LuaVal realistic(Random & rnd)
+    {
+        LuaVal t(TTABLE);
+        for (unsigned int i = 1; i <= 1000; ++i)
+        {
+            LuaVal rec(TTABLE);
+            rec.set("id", i);
+            rec.set("name", "player" + rnd.word(6));
+            rec.set("pos", LuaVal({ rnd.real() * 1000, rnd.real() * 1000, rnd.real() * 100 }));
+            rec.set("hp", static_cast<int>(rnd.next() % 100));
+            rec.set("online", rnd.next() % 2 == 0);
+            LuaVal inventory(TTABLE);
+            for (unsigned int j = 1; j <= 5; ++j)
+                inventory.set(j, static_cast<int>(rnd.next() % 50000));
+            rec.set("inventory", inventory);
+            t.set(i, rec);
+        }
+        return t;
+    }
+
+    LuaVal deep(Random & rnd)
+    {
+        LuaVal t(TTABLE);
+        for (int i = 0; i < 200; ++i)
+        {
+            LuaVal outer(TTABLE);
+            outer.set("v", static_cast<int>(rnd.next()));
+            outer.set("next", t);
+            t = std::move(outer);
+        }
+        return t;
+    }
+
+    LuaVal wide(Random & rnd)
+    {
+        LuaVal t(TTABLE);
+        for (unsigned int i = 1; i <= 100000; ++i)
+            t.set(i, static_cast<int>(rnd.next()));
+        return t;
+    }
+
+    LuaVal strings(Random & rnd)
+    {
+        LuaVal t(TTABLE);
+        for (unsigned int i = 1; i <= 10000; ++i)
+        {
+            std::string s = rnd.word(10 + rnd.next() % 90);
+            s[rnd.next() % s.size()] = '"';
+            t.set(i, s);
+            t.set(rnd.word(8), rnd.word(16));
+        }
+        return t;
+    }
+
+    LuaVal numbers(Random & rnd)
+    {
+        LuaVal t(TTABLE);
+        for (unsigned int i = 1; i <= 50000; ++i)
+            t.set(i, (rnd.real() - 0.5) * 1e6);
+        for (unsigned int i = 0; i < 1000; ++i)
+            t.set(rnd.real() * 1e3, rnd.real());
+        return t;
+    }
+
+    struct Corpus
+    {
+        std::string name;
+        LuaVal value;
+    };
+
+    std::vector<Corpus> corpora()
+    {
+        Random rnd(42);
+        std::vector<Corpus> c;
+        c.push_back(Corpus{ "realistic", realistic(rnd) });
+        c.push_back(Corpus{ "deep", deep(rnd) });
+        c.push_back(Corpus{ "wide", wide(rnd) });
+        c.push_back(Corpus{ "strings", strings(rnd) });
+        c.push_back(Corpus{ "numbers", numbers(rnd) });
+        return c;
+    }
+
+    void bench_serialization(std::vector<Corpus> const & cs)
+    {
+        LuaVal::DumpOptions nocache;
+        LuaVal::DumpOptions cache;
+        cache.cache = true;
+        LuaVal::DumpOptions compress;
+        compress.compress = true;
+        for (Corpus const & c : cs)
+        {
+            std::string text = c.value.dumps(nocache);
+            std::string packed = SmallfolkLZ::compress(text.data(), text.size());
+            run("dumps", c.name, [&]() { sink += c.value.dumps(nocache).size(); }, text.size());
+            c.value.dumps(cache);
+            run("dumps_cached_unchanged", c.name, [&]() { sink += c.value.dumps(cache).size(); }, text.size());
+            run("loads", c.name, [&]() { sink += LuaVal::loads(text).istable(); }, text.size());
+            // the budget is counted on every loads, a limit only adds the comparisons
+            LuaVal::LoadOptions budget;
+            budget.max_memory = 2 * c.value.memory_usage();
+            run("loads_budget", c.name, [&]() { sink += LuaVal::loads(text, budget).istable(); }, text.size());
+            run("dumps_compressed", c.name, [&]() { sink += c.value.dumps(compress).size(); }, text.size());
+            run("loads_compressed", c.name, [&]() { sink += LuaVal::loads(packed).istable(); }, text.size());
+            std::ostringstream ratio;
+            ratio << ",\"compressed_bytes\":" << packed.size() << ",\"ratio\":" << static_cast<double>(text.size()) / packed.size();
+            run("lz_compress", c.name, [&]() { sink += SmallfolkLZ::compress(text.data(), text.size()).size(); }, text.size(), ratio.str());
+            std::string out;
+            run("lz_decompress", c.name, [&]() { SmallfolkLZ::decompress(packed.data(), packed.size(), out); sink += out.size(); }, text.size(), ratio.str());
+        }
+    }
+
+    // output size and speed of the dump styles against the default
+    void bench_styles(std::vector<Corpus> const & cs)
+    {
+        LuaVal::DumpOptions nocache;
+        LuaVal::DumpOptions minimal;
+        minimal.style = LuaVal::DumpOptions::MINIMAL;
+        LuaVal::DumpOptions pretty;
+        pretty.style = LuaVal::DumpOptions::PRETTY;
+        for (Corpus const & c : cs)
+        {
+            std::string text = c.value.dumps(nocache);
+            std::string small = c.value.dumps(minimal);
+            std::string packed = SmallfolkLZ::compress(text.data(), text.size());
+            std::string packed_small = SmallfolkLZ::compress(small.data(), small.size());
+            std::ostringstream size;
+            size << ",\"default_bytes\":" << text.size() << ",\"minimal_bytes\":" << small.size()
+                << ",\"ratio\":" << static_cast<double>(small.size()) / text.size()
+                << ",\"compressed_default_bytes\":" << packed.size() << ",\"compressed_minimal_bytes\":" << packed_small.size();
+            run("dumps_minimal", c.name, [&]() { sink += c.value.dumps(minimal).size(); }, small.size(), size.str());
+            run("loads_minimal", c.name, [&]() { sink += LuaVal::loads(small).istable(); }, small.size());
+            std::string text_pretty = c.value.dumps(pretty);
+            std::ostringstream pretty_size;
+            pretty_size << ",\"pretty_bytes\":" << text_pretty.size();
+            run("dumps_pretty", c.name, [&]() { sink += c.value.dumps(pretty).size(); }, text_pretty.size(), pretty_size.str());
+        }
+    }
+
+    // serializes in steps with a time or byte budget per step, the extra fields are the
+    // step latency percentiles, a game loop would run one step per frame
+    void bench_dumper(std::vector<Corpus> const & cs)
+    {
+        LuaVal::DumpOptions nocache;
+        for (Corpus const & c : cs)
+        {
+            size_t bytes = c.value.dumps(nocache).size();
+            auto slices = [&](std::function<bool(LuaDumper &)> const & step) {
+                std::vector<double> ns;
+                Clock::time_point end = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(min_time));
+                do
+                {
+                    LuaDumper dumper(c.value, nocache);
+                    bool done = false;
+                    while (!done)
+                    {
+                        Clock::time_point start = Clock::now();
+                        done = step(dumper);
+                        ns.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+                    }
+                } while (Clock::now() < end);
+                std::sort(ns.begin(), ns.end());
+                std::ostringstream out;
+                out << ",\"steps\":" << ns.size() << ",\"p50_ns\":" << ns[ns.size() / 2] << ",\"p99_ns\":" << ns[ns.size() * 99 / 100] << ",\"max_ns\":" << ns.back();
+                return out.str();
+            };
+            std::function<bool(LuaDumper &)> timed = [](LuaDumper & d) { return d.step_for(std::chrono::microseconds(100)); };
+            std::function<bool(LuaDumper &)> sized = [](LuaDumper & d) { return d.step(16384); };
+            auto whole = [&](std::function<bool(LuaDumper &)> const & step) {
+                LuaDumper dumper(c.value, nocache);
+                while (!step(dumper)) {}
+                sink += dumper.output().size();
+            };
+            if (selected("dumper_100us"))
+                report("dumper_100us", c.name, measure([&]() { whole(timed); }), bytes, slices(timed));
+            if (selected("dumper_16k"))
+                report("dumper_16k", c.name, measure([&]() { whole(sized); }), bytes, slices(sized));
+        }
+    }
+
+    // a message with a constant header and a few fields that change, built and serialized
+    // every time or formatted from a template
+    void bench_templates()
+    {
+        LuaVal header = { "move", 3, "eu-1" };
+        header.set("flags", LuaVal({ true, false, true }));
+        header.set("schema", "player_state");
+        auto build = [&](unsigned int id, double x, double y, std::string const & name) {
+            LuaVal m(TTABLE);
+            m.set("header", header);
+            m.set("id", id);
+            m.set("pos", LuaVal({ x, y }));
+            m.set("name", name);
+            return m;
+        };
+        LuaVal shape = build(0, 0, 0, "");
+        shape.set("id", LuaTemplate::hole(0));
+        shape.set("pos", LuaVal({ LuaTemplate::hole(1), LuaTemplate::hole(2) }));
+        shape.set("name", LuaTemplate::hole(3));
+        LuaTemplate tmpl(shape);
+        std::string name = "player123";
+        size_t bytes = build(7, 1.25, -3.5, name).dumps().size();
+        unsigned int id = 0;
+        run("message_build_and_dumps", "template", [&]() { sink += build(++id, 1.25, -3.5, name).dumps().size(); }, bytes);
+        run("message_template", "template", [&]() { sink += tmpl.dumps({ ++id, 1.25, -3.5, name }).size(); }, bytes);
+        std::string buffer;
+        run("message_template_reuse", "template", [&]() {
+            buffer.clear();
+            tmpl.dumps(buffer, { ++id, 1.25, -3.5, name });
+            sink += buffer.size();
+        }, bytes);
+        LuaTemplate constant(header);
+        run("constant_build_and_dumps", "template", [&]() { sink += LuaVal({ "move", 3, "eu-1" }).set("flags", LuaVal({ true, false, true })).set("schema", "player_state").dumps().size(); }, constant.dumps().size());
+        run("constant_template", "template", [&]() { sink += constant.dumps().size(); }, constant.dumps().size());
+    }
+
+    // reads a few fields of a message that carries a large payload, with loads and get or a query
+    void bench_queries(std::vector<Corpus> const & cs)
+    {
+        LuaVal message(TTABLE);
+        message.set("cmd", "route");
+        message.set("id", 12345);
+        message.set("args", LuaVal({ "eu-1", 7, true }));
+        message.set("payload", cs[0].value);
+        std::vector<LuaQuery::Path> paths = { { "cmd" }, { "id" }, { "args", 2 }, { "payload", 500, "name" } };
+        for (int size = 0; size < 2; ++size)
+        {
+            // the small message has a small payload instead
+            if (size == 0)
+                message.set("payload", LuaVal({ 1, 2, 3 }));
+            else
+                message.set("payload", cs[0].value);
+            if (size == 0)
+                paths.back() = { "payload", 2 };
+            else
+                paths.back() = { "payload", 500, "name" };
+            std::string text = message.dumps();
+            std::string corpus = size == 0 ? "small_message" : "large_message";
+            LuaQuery query(paths);
+            std::vector<LuaVal> found;
+            run("loads_and_get", corpus, [&]() {
+                LuaVal v = LuaVal::loads(text);
+                for (LuaQuery::Path const & path : paths)
+                {
+                    LuaVal const * at = &v;
+                    for (LuaVal const & k : path)
+                        at = at->istable() ? &at->get(k) : &LuaVal::nil;
+                    found.push_back(*at);
+                }
+                sink += found.size();
+                found.clear();
+            }, text.size());
+            run("query_find", corpus, [&]() { sink += query.find(text, found).code; }, text.size());
+            LuaQuery missing({ { "nothing" } });
+            run("query_skip_all", corpus, [&]() { sink += missing.find(text, found).code; }, text.size());
+        }
+    }
+
+    // the JSON of a loaded value, like a tree walk written for one application would make it
+    void walk_json(LuaVal const & v, std::string & out)
+    {
+        char arr[32];
+        switch (v.typetag())
+        {
+        case TBOOL:
+            out += v.boolean() ? "true" : "false";
+            break;
+        case TNUMBER:
+            out.append(arr, snprintf(arr, sizeof(arr), "%.17g", v.num()));
+            break;
+        case TSTRING:
+            out += '"';
+            out += json_escape(v.str());
+            out += '"';
+            break;
+        case TTABLE:
+        {
+            bool array = v.len() == v.tbl().size();
+            out += array ? '[' : '{';
+            bool first = true;
+            for (auto const & kv : v.pairs())
+            {
+                if (!first)
+                    out += ',';
+                first = false;
+                if (!array)
+                {
+                    out += '"';
+                    out += kv.first.isstring() ? json_escape(kv.first.str()) : kv.first.tostring();
+                    out += "\":";
+                }
+                walk_json(kv.second, out);
+            }
+            out += array ? ']' : '}';
+            break;
+        }
+        default:
+            out += "null";
+            break;
+        }
+    }
+
+    // converts each corpus to JSON and MessagePack and back, directly and through a loaded value
+    void bench_transcode(std::vector<Corpus> const & cs)
+    {
+        std::string out;
+        for (Corpus const & c : cs)
+        {
+            std::string text = c.value.dumps();
+            std::string json;
+            std::string packed;
+            LuaTranscode::to_json(text, json);
+            LuaTranscode::to_msgpack(text, packed);
+            run("to_json", c.name, [&]() { out.clear(); sink += LuaTranscode::to_json(text, out).code; }, text.size());
+            run("loads_and_walk_json", c.name, [&]() { out.clear(); walk_json(LuaVal::loads(text), out); sink += out.size(); }, text.size());
+            run("from_json", c.name, [&]() { out.clear(); sink += LuaTranscode::from_json(json, out).code; }, json.size());
+            run("to_msgpack", c.name, [&]() { out.clear(); sink += LuaTranscode::to_msgpack(text, out).code; }, text.size());
+            run("from_msgpack", c.name, [&]() { out.clear(); sink += LuaTranscode::from_msgpack(packed, out).code; }, packed.size());
+        }
+    }
+
+    void bench_cache()
+    {
+        // 1% of the leaf tables change between dumps
+        Random rnd(7);
+        LuaVal state(TTABLE);
+        for (unsigned int i = 1; i <= 100; ++i)
+        {
+            LuaVal group(TTABLE);
+            for (unsigned int j = 1; j <= 100; ++j)
+                group.set(j, LuaVal({ rnd.real(), "item", true }));
+            state.set(i, group);
+        }
+        LuaVal::DumpOptions nocache;
+        LuaVal::DumpOptions cache;
+        cache.cache = true;
+        size_t bytes = state.dumps(nocache).size();
+        unsigned int tick = 0;
+        auto mutate = [&]() {
+            for (int k = 0; k < 100; ++k)
+            {
+                ++tick;
+                state[1 + (tick * 37) % 100][1 + (tick * 61) % 100][1] = static_cast<int>(tick);
+            }
+        };
+        run("dumps_mutated_1pct_nocache", "grid100x100", [&]() { mutate(); sink += state.dumps(nocache).size(); }, bytes);
+        run("dumps_mutated_1pct_cache", "grid100x100", [&]() { mutate(); sink += state.dumps(cache).size(); }, bytes);
+        run("diff_mutated_1pct", "grid100x100", [&]() {
+            LuaVal before = state;
+            mutate();
+            sink += LuaVal::diff(before, state).dumps(nocache).size();
+        }, bytes);
+        run("copy_and_dumps_mutated_1pct", "grid100x100", [&]() {
+            LuaVal before = state;
+            mutate();
+            sink += state.dumps(nocache).size();
+        }, bytes);
+        LuaVal before = state;
+        mutate();
+        std::string delta = LuaVal::diff(before, state).dumps(nocache);
+        LuaVal base = before;
+        run("patch_1pct", "grid100x100", [&]() { LuaVal::patch(base, LuaVal::loads(delta)); sink += delta.size(); }, delta.size());
+
+        // comparing a tree with an equal copy, by serializing both and structurally
+        LuaVal copy = state;
+        run("equals_by_dumps", "grid100x100", [&]() { sink += state.dumps(nocache) == copy.dumps(nocache); }, bytes);
+        run("deep_equals", "grid100x100", [&]() { sink += state.deep_equals(copy); }, bytes);
+        run("content_hash_unchanged", "grid100x100", [&]() { sink += state.content_hash(); });
+        run("content_hash_mutated_1pct", "grid100x100", [&]() { mutate(); sink += state.content_hash(); });
+        run("copy_and_content_hash", "grid100x100", [&]() { LuaVal fresh = state; sink += fresh.content_hash(); });
+    }
+
+    // each table policy across table sizes, a lookup op is 4096 lookups of existing string and number keys
+    void bench_policies()
+    {
+        struct Policy
+        {
+            const char * name;
+            LuaTablePolicy policy;
+        };
+        Policy const policies[] = { { "auto", TABLE_AUTO }, { "hash", TABLE_HASH }, { "flat", TABLE_FLAT }, { "ordered", TABLE_ORDERED } };
+        size_t const sizes[] = { 4, 8, 16, 64, 1024, 65536 };
+        Random rnd(11);
+        for (size_t n : sizes)
+        {
+            std::vector<std::string> keys;
+            for (size_t i = 0; i < n; ++i)
+                keys.push_back(rnd.word(4 + rnd.next() % 12));
+            for (Policy const & p : policies)
+            {
+                std::string corpus = std::string(p.name) + std::to_string(n);
+                auto build = [&]() {
+                    LuaVal t = LuaVal::table(p.policy);
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        t.set(keys[i], static_cast<int>(i));
+                        t.set(static_cast<double>(i * 3), static_cast<int>(i));
+                    }
+                    return t;
+                };
+                run("policy_build", corpus, [&]() { sink += build().tbl().size(); });
+                LuaVal t = build();
+                LuaVal const & c = t;
+                run("policy_get_string", corpus, [&]() {
+                    for (size_t i = 0; i < 4096; ++i)
+                        sink += c.get(keys[i % n]).isnumber();
+                });
+                run("policy_get_number", corpus, [&]() {
+                    for (size_t i = 0; i < 4096; ++i)
+                        sink += c.get(static_cast<double>(i % n * 3)).isnumber();
+                });
+                run("policy_miss", corpus, [&]() {
+                    for (size_t i = 0; i < 4096; ++i)
+                        sink += c.has(static_cast<double>(i % n * 3 + 1));
+                });
+            }
+        }
+    }
+
+    void bench_table_ops()
+    {
+        LuaVal seq(TTABLE);
+        for (unsigned int i = 1; i <= 1000; ++i)
+            seq.set(i, static_cast<int>(i));
+        Random rnd(3);
+        LuaVal hash(TTABLE);
+        std::vector<std::string> keys;
+        for (unsigned int i = 0; i < 1000; ++i)
+        {
+            keys.push_back(rnd.word(12));
+            hash.set(keys.back(), static_cast<int>(i));
+        }
+        run("index_int", "seq1000", [&]() {
+            for (unsigned int i = 1; i <= 1000; ++i)
+                sink += seq[i].isnumber();
+        });
+        run("get_int", "seq1000", [&]() {
+            LuaVal const & c = seq;
+            for (unsigned int i = 1; i <= 1000; ++i)
+                sink += c.get(i).isnumber();
+        });
+        run("get_string", "hash1000", [&]() {
+            for (auto const & k : keys)
+                sink += hash.get(k).isnumber();
+        });
+        run("get_literal", "hash1000", [&]() {
+            for (int i = 0; i < 1000; ++i)
+                sink += hash.get("missing_key_literal").isnil();
+        });
+        hash.set("present_key_literal", true);
+        run("has_literal", "hash1000", [&]() {
+            for (int i = 0; i < 1000; ++i)
+                sink += hash.has("present_key_literal");
+        });
+        run("get_luaval_key", "hash1000", [&]() {
+            // the key conversion lookups paid before LuaKey
+            for (auto const & k : keys)
+                sink += hash.get(LuaVal(k)).isnumber();
+        });
+        run("find_double", "seq1000", [&]() {
+            for (unsigned int i = 1; i <= 1000; ++i)
+                sink += seq.find(i + 0.5) == nullptr;
+        });
+        run("len", "seq1000", [&]() { sink += seq.len(); });
+        run("ipairs", "seq1000", [&]() {
+            for (auto const & e : seq.ipairs())
+                sink += e.second.isnumber();
+        });
+        run("pairs", "hash1000", [&]() {
+            for (auto const & e : hash.pairs())
+                sink += e.second.isnumber();
+        });
+        run("insert_back", "seq1000", [&]() {
+            LuaVal t(TTABLE);
+            for (int i = 0; i < 1000; ++i)
+                t.insert(i);
+            sink += t.tbl().size();
+        });
+        run("insert_front", "seq100", [&]() {
+            LuaVal t(TTABLE);
+            for (int i = 0; i < 100; ++i)
+                t.insert(i, 1);
+            sink += t.tbl().size();
+        });
+        run("remove_back", "seq1000", [&]() {
+            LuaVal t = seq;
+            for (int i = 0; i < 1000; ++i)
+                t.remove();
+            sink += t.tbl().size();
+        });
+        run("remove_front", "seq100", [&]() {
+            LuaVal t(TTABLE);
+            for (unsigned int i = 1; i <= 100; ++i)
+                t.set(i, static_cast<int>(i));
+            for (int i = 0; i < 100; ++i)
+                t.remove(1);
+            sink += t.tbl().size();
+        });
+        run("mrg", "hash1000+seq1000", [&]() { sink += LuaVal::mrg(hash, seq).tbl().size(); });
+        auto build = [&](bool move) {
+            LuaVal t(TTABLE);
+            t.reserve(1000);
+            for (unsigned int i = 1; i <= 1000; ++i)
+            {
+                LuaVal rec(TTABLE);
+                rec.set("name", "a name that does not fit small strings");
+                rec.set("pos", LuaVal({ 1.0, 2.0, 3.0 }));
+                if (move)
+                    t.set(i, std::move(rec));
+                else
+                    t.set(i, rec);
+            }
+            sink += t.tbl().size();
+        };
+        run("build_copy", "records1000", [&]() { build(false); });
+        run("build_move", "records1000", [&]() { build(true); });
+        run("append_range_move", "seq1000", [&]() {
+            std::vector<LuaVal> values(1000, LuaVal("a string that does not fit small strings"));
+            LuaVal t(TTABLE);
+            t.reserve(1000);
+            t.append_range(std::move(values));
+            sink += t.tbl().size();
+        });
+    }
+
+    void bench_copy_move(std::vector<Corpus> const & cs)
+    {
+        for (Corpus const & c : cs)
+        {
+            run("copy", c.name, [&]() { LuaVal copy = c.value; sink += copy.istable(); });
+            LuaVal moving = c.value;
+            run("move", c.name, [&]() {
+                LuaVal moved = std::move(moving);
+                moving = std::move(moved);
+                sink += moving.istable();
+            });
+        }
+    }
+
+    void bench_memory(std::vector<Corpus> const & cs)
+    {
+        if (!selected("memory"))
+            return;
+        for (Corpus const & c : cs)
+        {
+            std::string text = c.value.dumps();
+            size_t live = live_bytes.load();
+            size_t count = alloc_count.load();
+            LuaVal loaded = LuaVal::loads(text);
+            // memory_usage counts the bytes tree_bytes counts and the LuaVal itself
+            std::cout << "{\"name\":\"memory\",\"corpus\":\"" << c.name << "\",\"text_bytes\":" << text.size()
+                << ",\"tree_bytes\":" << live_bytes.load() - live << ",\"tree_allocs\":" << alloc_count.load() - count
+                << ",\"memory_usage\":" << loaded.memory_usage() << ",\"sizeof_luaval\":" << sizeof(LuaVal) << "}" << std::endl;
+            run("memory_usage", c.name, [&]() { sink += loaded.memory_usage(); });
+        }
+    }
+
+    void bench_frozen(std::vector<Corpus> const & cs)
+    {
+        LuaVal const & t = cs[0].value;
+        LuaFrozen frozen = t.freeze();
+        run("freeze", cs[0].name, [&]() { sink += t.freeze().istable(); });
+        run("get_nested", "luaval", [&]() {
+            for (unsigned int i = 1; i <= 1000; ++i)
+                sink += t.get(i).get("pos").get(2).isnumber();
+        });
+        run("get_nested", "frozen", [&]() {
+            for (unsigned int i = 1; i <= 1000; ++i)
+                sink += frozen.get(i).get("pos").get(2).isnumber();
+        });
+        run("dumps", "frozen", [&]() { sink += frozen.dumps().size(); }, frozen.dumps().size());
+    }
+
+    // threads reading and writing records of 10000 keys, one in ten operations is a write,
+    // with a LuaSharedTable and with a LuaVal behind one mutex
+    void bench_shared()
+    {
+        unsigned int const keys = 10000;
+        auto record = [](unsigned int hp) { return LuaVal({ "player", hp, LuaVal({ 1.5, 2.5 }) }); };
+        LuaSharedTable shared(64);
+        LuaVal locked(TTABLE);
+        std::mutex lock;
+        for (unsigned int i = 1; i <= keys; ++i)
+        {
+            shared.set(i, record(i));
+            locked.set(i, record(i));
+        }
+        // runs op on each thread until min_time has passed, ns_per_op is the wall time per operation of all threads
+        auto contend = [&](unsigned int threads, std::function<size_t(Random &)> const & op) {
+            std::atomic<size_t> ops(0);
+            std::atomic<size_t> result(0);
+            size_t count = alloc_count.load();
+            size_t bytes = alloc_bytes.load();
+            Clock::time_point start = Clock::now();
+            Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(min_time));
+            std::vector<std::thread> running;
+            for (unsigned int t = 0; t < threads; ++t)
+            {
+                running.push_back(std::thread([&, t]() {
+                    Random rnd(t + 1);
+                    size_t n = 0;
+                    size_t r = 0;
+                    while (Clock::now() < end)
+                    {
+                        for (int i = 0; i < 64; ++i)
+                            r += op(rnd);
+                        n += 64;
+                    }
+                    ops += n;
+                    result += r;
+                }));
+            }
+            for (std::thread & t : running)
+                t.join();
+            double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            sink += result;
+            Result r;
+            r.iterations = ops;
+            r.ns = elapsed * 1e9 / r.iterations;
+            r.allocs = static_cast<double>(alloc_count.load() - count) / r.iterations;
+            r.alloc_bytes = static_cast<double>(alloc_bytes.load() - bytes) / r.iterations;
+            return r;
+        };
+        std::ostringstream hardware;
+        hardware << ",\"hardware_threads\":" << std::thread::hardware_concurrency();
+        for (unsigned int threads : { 1u, 2u, 4u, 8u })
+        {
+            std::ostringstream corpus;
+            corpus << threads << "_threads";
+            if (selected("shared_table_90_10"))
+            {
+                report("shared_table_90_10", corpus.str(), contend(threads, [&](Random & rnd) -> size_t {
+                    unsigned int k = 1 + (rnd.next() << 15 | rnd.next()) % keys;
+                    if (rnd.next() % 10 == 0)
+                    {
+                        shared.set(k, record(rnd.next()));
+                        return 0;
+                    }
+                    return static_cast<size_t>(shared.get(k).get(2).num());
+                }), 0, hardware.str());
+            }
+            if (selected("mutex_table_90_10"))
+            {
+                report("mutex_table_90_10", corpus.str(), contend(threads, [&](Random & rnd) -> size_t {
+                    unsigned int k = 1 + (rnd.next() << 15 | rnd.next()) % keys;
+                    if (rnd.next() % 10 == 0)
+                    {
+                        LuaVal v = record(rnd.next());
+                        std::lock_guard<std::mutex> guard(lock);
+                        locked.set(k, std::move(v));
+                        return 0;
+                    }
+                    std::lock_guard<std::mutex> guard(lock);
+                    return static_cast<size_t>(locked.get(k).get(2).num());
+                }), 0, hardware.str());
+            }
+        }
+        size_t bytes = shared.dumps().size();
+        run("shared_table_dumps", "10000_keys", [&]() { sink += shared.dumps().size(); }, bytes);
+        run("mutex_table_dumps", "10000_keys", [&]() {
+            std::lock_guard<std::mutex> guard(lock);
+            sink += locked.dumps().size();
+        }, bytes);
+    }
+
+    void bench_rejection()
+    {
+        // malformed messages like the ones hostile clients send
+        std::vector<std::string> junk = {
+            "{1,2,3", "{\"name\":\"abc", "GET / HTTP/1.1", "{1,2 3}", "{n:1}", "1.e5", "{\"hp\":-}", "",
+            "\x1bSFZ\x01\x05junk", "{{{{{{{{{{x}}}}}}}}}}",
+        };
+        size_t count = junk.size();
+        auto rate = [count](Result const & r) {
+            std::ostringstream out;
+            out << ",\"rejections_per_s\":" << count * 1e9 / r.ns;
+            return out.str();
+        };
+        auto bench = [&](std::string const & name, std::function<void()> const & f) {
+            if (!selected(name))
+                return;
+            Result r = measure(f);
+            report(name, "junk", r, 0, rate(r));
+        };
+        bench("reject_try_loads", [&]() {
+            LuaVal out(TNIL);
+            for (auto const & s : junk)
+                sink += static_cast<bool>(LuaVal::try_loads(s, out));
+        });
+        bench("reject_loads_errmsg", [&]() {
+            std::string err;
+            for (auto const & s : junk)
+                sink += LuaVal::loads(s, &err).isnil();
+        });
+#ifndef SMALLFOLK_NO_EXCEPTIONS
+        // what every rejection cost when the parser threw
+        bench("reject_throw_catch", [&]() {
+            for (size_t i = 0; i < junk.size(); ++i)
+            {
+                try
+                {
+                    throw smallfolk_exception("expect_object at %u was %c", static_cast<unsigned int>(i), '{');
+                }
+                catch (smallfolk_exception const & e)
+                {
+                    std::string err;
+                    err += e.what();
+                    sink += err.size();
+                }
+            }
+        });
+#endif
+    }
+
+    // peak heap use of f, only memory from operator new, memory mapped files do not count
+    size_t peak_heap(std::function<void()> const & f)
+    {
+        size_t live = live_bytes.load();
+        peak_bytes.store(live);
+        f();
+        return peak_bytes.load() - live;
+    }
+
+#ifdef __linux__
+    // a field of /proc/self/status in bytes, 0 if it is missing
+    size_t status_bytes(std::string const & name)
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+            if (line.compare(0, name.size(), name) == 0)
+                return static_cast<size_t>(std::strtoull(line.c_str() + name.size(), nullptr, 10)) * 1024;
+        return 0;
+    }
+#endif
+
+    // peak growth of the resident memory of the process while f runs, including mapped file pages
+    // and allocations that do not go through operator new, 0 where it can not be measured
+    // on Linux the peak is reset through /proc/self/clear_refs and read from VmHWM
+    size_t peak_rss(std::function<void()> const & f)
+    {
+#ifdef __linux__
+#ifdef __GLIBC__
+        malloc_trim(0); // free heap kept by malloc would hide the growth
+#endif
+        std::ofstream clear("/proc/self/clear_refs");
+        clear << "5";
+        clear.close();
+        size_t before = status_bytes("VmRSS:");
+        if (clear && before)
+        {
+            f();
+            size_t peak = status_bytes("VmHWM:");
+            return peak > before ? peak - before : 0;
+        }
+#endif
+        f();
+        return 0;
+    }
+
+    // the peak_heap_bytes and peak_rss_bytes fields of one run of f
+    std::string peak_memory(std::function<void()> const & f)
+    {
+        std::ostringstream out;
+        out << ",\"peak_heap_bytes\":" << peak_heap(f);
+        out << ",\"peak_rss_bytes\":" << peak_rss(f);
+        return out.str();
+    }
+
+    // a server loop: parse a message, handle it and discard it, with and without a LuaPool
+    // reports the latency percentiles of single messages besides the averages
+    void bench_pool(std::vector<Corpus> const & cs)
+    {
+        if (!selected("stream_heap") && !selected("stream_pool"))
+            return;
+        std::vector<std::string> messages;
+        LuaVal const & records = cs[0].value;
+        for (unsigned int i = 0; i + 20 <= records.len(); i += 20)
+        {
+            LuaVal msg(TTABLE);
+            for (unsigned int j = 1; j <= 20; ++j)
+                msg.set(j, records.get(i + j));
+            messages.push_back(msg.dumps());
+        }
+        auto stream = [&](std::string const & name, bool pooled) {
+            if (!selected(name))
+                return;
+            std::unique_ptr<LuaPool> pool(pooled ? new LuaPool() : nullptr);
+            auto handle = [&](std::string const & text) {
+                LuaVal msg = LuaVal::loads(text);
+                sink += msg.get(1).get_or("hp", 0);
+            };
+            for (std::string const & text : messages)
+                handle(text); // warm up
+            std::vector<double> latencies;
+            size_t count = alloc_count.load();
+            size_t bytes = alloc_bytes.load();
+            Clock::time_point begin = Clock::now();
+            while (latencies.size() < 1000 || std::chrono::duration<double>(Clock::now() - begin).count() < min_time)
+            {
+                for (std::string const & text : messages)
+                {
+                    Clock::time_point start = Clock::now();
+                    handle(text);
+                    latencies.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+                }
+            }
+            double total = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+            double n = static_cast<double>(latencies.size());
+            // the latencies vector itself allocates a little while growing
+            double allocs = (alloc_count.load() - count) / n;
+            double alloc_bytes_per_op = (alloc_bytes.load() - bytes) / n;
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [&](double p) { return latencies[static_cast<size_t>(p * (n - 1))]; };
+            std::cout << "{\"name\":\"" << name << "\",\"corpus\":\"messages20\",\"iterations\":" << latencies.size()
+                << ",\"ns_per_op\":" << total / n << ",\"p50_ns\":" << percentile(0.5) << ",\"p99_ns\":" << percentile(0.99)
+                << ",\"p999_ns\":" << percentile(0.999) << ",\"allocs_per_op\":" << allocs << ",\"alloc_bytes_per_op\":" << alloc_bytes_per_op << "}" << std::endl;
+        };
+        stream("stream_heap", false);
+        stream("stream_pool", true);
+    }
+
+    void bench_files(std::vector<Corpus> const & cs)
+    {
+        char const * path = "smallfolk_bench.tmp";
+        for (Corpus const & c : cs)
+        {
+            if (!c.value.save_file(path))
+                continue;
+            std::ifstream probe(path, std::ios::binary | std::ios::ate);
+            size_t bytes = static_cast<size_t>(probe.tellg());
+            auto read_loads = [&]() {
+                std::ifstream in(path, std::ios::binary);
+                std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                sink += LuaVal::loads(text).istable();
+            };
+            auto load_file = [&]() { sink += LuaVal::load_file(path).istable(); };
+            auto dumps_write = [&]() {
+                std::ofstream out(path, std::ios::binary);
+                std::string text = c.value.dumps();
+                out.write(text.data(), text.size());
+            };
+            auto save_file = [&]() { sink += c.value.save_file(path); };
+            run("read_and_loads", c.name, read_loads, bytes, peak_memory(read_loads));
+            run("load_file", c.name, load_file, bytes, peak_memory(load_file));
+            run("dumps_and_write", c.name, dumps_write, bytes, peak_memory(dumps_write));
+            run("save_file", c.name, save_file, bytes, peak_memory(save_file));
+        }
+        std::remove(path);
+    }
+
+    // appends the realistic records to a log in one batch or flushing each, and reads random records back
+    void bench_logs(std::vector<Corpus> const & cs)
+    {
+        char const * path = "smallfolk_bench.log";
+        std::string index_path = std::string(path) + ".idx";
+        LuaVal const & records = cs[0].value;
+        std::vector<std::string> texts;
+        size_t bytes = 0;
+        for (unsigned int i = 1; i <= records.len(); ++i)
+        {
+            texts.push_back(records.get(i).dumps());
+            bytes += texts.back().size();
+        }
+        auto append = [&](bool flush_each) {
+            std::remove(path);
+            std::remove(index_path.c_str());
+            SmallfolkLog::Writer writer;
+            writer.open(path);
+            for (std::string const & text : texts)
+            {
+                writer.append(text);
+                if (flush_each)
+                    writer.flush();
+            }
+            sink += writer.close();
+        };
+        run("log_append_batched", cs[0].name, [&]() { append(false); }, bytes);
+        run("log_append_flush_each", cs[0].name, [&]() { append(true); }, bytes);
+
+        // a log of 100 times the records, the reads mostly miss the read window
+        {
+            std::remove(path);
+            std::remove(index_path.c_str());
+            SmallfolkLog::Writer writer;
+            writer.open(path);
+            for (int i = 0; i < 100; ++i)
+                for (std::string const & text : texts)
+                    writer.append(text);
+            writer.close();
+        }
+        SmallfolkLog::Reader reader;
+        if (reader.open(path))
+        {
+            Random rnd(7);
+            std::string record;
+            size_t n = reader.size();
+            run("log_random_read", cs[0].name, [&]() { sink += reader.read((rnd.next() << 15 | rnd.next()) % n, record); }, bytes / texts.size());
+            run("log_random_get", cs[0].name, [&]() { sink += reader.get((rnd.next() << 15 | rnd.next()) % n).istable(); }, bytes / texts.size());
+        }
+        reader.close();
+        std::remove(path);
+        std::remove(index_path.c_str());
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--quick")
+            min_time = 0.02;
+        else
+            filter = arg;
+    }
+
+#if defined(__OPTIMIZE__) || (defined(_MSC_VER) && defined(NDEBUG))
+    bool optimized = true;
+#else
+    bool optimized = false;
+#endif
+    std::cout << "{\"name\":\"config\",\"optimized\":" << (optimized ? "true" : "false") << ",\"stats\":" << (LuaStats::enabled() ? "true" : "false") << ",\"min_time\":" << min_time << "}" << std::endl;
+
+    std::vector<Corpus> cs = corpora();
+    bench_serialization(cs);
+    bench_styles(cs);
+    bench_dumper(cs);
+    bench_templates();
+    bench_queries(cs);
+    bench_transcode(cs);
+    bench_cache();
+    bench_table_ops();
+    bench_policies();
+    bench_rejection();
+    bench_copy_move(cs);
+    bench_memory(cs);
+    bench_frozen(cs);
+    bench_shared();
+    bench_pool(cs);
+    bench_files(cs);
+    bench_logs(cs);
+    return 0;
+}
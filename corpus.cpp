@@ -0,0 +1,127 @@
+// Checks loads and dumps against the expectations in corpus/expected.txt
+// The expectations are written by hand in the format of corpus/generate.lua, which writes the same
+// cases with the reference Lua Smallfolk. Pass its output to test against the reference instead.
+// Usage: smallfolk_corpus [expected.txt]
+// Prints each mismatch and the loads and dumps throughput on the corpus as JSON lines,
+// so correctness and performance regressions show up in the same run.
+// Returns non zero if any case fails.
+#include "smallfolk.h"
+#include <iostream> // std::cout
+#include <fstream> // std::ifstream
+#include <chrono> // std::chrono
+#include <vector>
+
+#ifndef SMALLFOLK_CORPUS
+#define SMALLFOLK_CORPUS "corpus/expected.txt"
+#endif
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    size_t failures = 0;
+
+    void mismatch(unsigned int line, std::string const & what, std::string const & input, std::string const & got)
+    {
+        ++failures;
+        std::cout << "{\"name\":\"mismatch\",\"line\":" << line << ",\"what\":\"" << what << "\"}" << std::endl;
+        std::cerr << "line " << line << ": " << what << std::endl << "input: " << input << std::endl << "got:   " << got << std::endl;
+    }
+
+    // loads the input and checks that dumps gives the expected text
+    void expect_dumps(unsigned int line, std::string const & input, std::string const & expected)
+    {
+        LuaVal v(TNIL);
+        LuaVal::LoadResult result = LuaVal::try_loads(input, v);
+        if (!result)
+            mismatch(line, "loads failed", input, result.message());
+        else if (v.dumps() != expected)
+            mismatch(line, "dumps differs", input, v.dumps());
+    }
+
+    // runs f until it has run for at least a tenth of a second, returns MB/s
+    template<typename F> double throughput(size_t bytes, F f)
+    {
+        size_t n = 0;
+        Clock::time_point start = Clock::now();
+        double elapsed = 0;
+        while (elapsed < 0.1)
+        {
+            f();
+            ++n;
+            elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        return bytes * n / elapsed / 1e6;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    const char * path = argc > 1 ? argv[1] : SMALLFOLK_CORPUS;
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "smallfolk_corpus: could not read " << path << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> texts;
+    size_t bytes = 0;
+    unsigned int cases = 0;
+    unsigned int lineno = 0;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        ++lineno;
+        if (line.empty() || line[0] == '#')
+            continue;
+        ++cases;
+        if (line.compare(0, 3, "ok ") == 0)
+        {
+            std::string text = line.substr(3);
+            expect_dumps(lineno, text, text);
+            texts.push_back(text);
+            bytes += text.size();
+        }
+        else if (line.compare(0, 3, "to ") == 0)
+        {
+            size_t tab = line.find('\t');
+            if (tab == std::string::npos)
+                mismatch(lineno, "to line without tab", line, std::string());
+            else
+                expect_dumps(lineno, line.substr(3, tab - 3), line.substr(tab + 1));
+        }
+        else if (line.compare(0, 4, "err ") == 0)
+        {
+            std::string input = line.substr(4);
+            LuaVal v(TNIL);
+            if (LuaVal::try_loads(input, v))
+                mismatch(lineno, "loads accepted invalid input", input, v.dumps());
+        }
+        else
+            mismatch(lineno, "unknown line", line, std::string());
+    }
+
+    std::vector<LuaVal> values;
+    for (std::string const & text : texts)
+        values.push_back(LuaVal::loads(text));
+    double loads = throughput(bytes, [&]() {
+        for (std::string const & text : texts)
+            LuaVal::loads(text);
+    });
+    // size of the corpus in the MINIMAL style
+    LuaVal::DumpOptions minimal;
+    minimal.style = LuaVal::DumpOptions::MINIMAL;
+    size_t minimal_bytes = 0;
+    for (LuaVal const & v : values)
+        minimal_bytes += v.dumps(minimal).size();
+    LuaVal::DumpOptions uncached;
+    uncached.cache = false;
+    double dumps = throughput(bytes, [&]() {
+        for (LuaVal const & v : values)
+            v.dumps(uncached);
+    });
+    std::cout << "{\"name\":\"corpus\",\"cases\":" << cases << ",\"failures\":" << failures << ",\"bytes\":" << bytes << ",\"minimal_bytes\":" << minimal_bytes
+        << ",\"loads_mb_per_s\":" << loads << ",\"dumps_mb_per_s\":" << dumps << "}" << std::endl;
+    return failures ? 1 : 0;
+}
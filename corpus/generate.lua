@@ -0,0 +1,100 @@
+-- Writes the cases of expected.txt with the reference Lua implementation of Smallfolk
+-- https://github.com/gvx/Smallfolk
+-- Usage: lua generate.lua path/to/smallfolk.lua > reference.txt
+-- expected.txt is written by hand, diff it with the output or run smallfolk_corpus reference.txt
+--
+-- Line formats of the corpus, the text runs to the end of the line:
+-- ok <text>              reference dumps output, loads must accept it and dumps must give it back
+-- to <input><tab><text>  loads of input must succeed and dumps of the result must give text
+-- err <input>            the reference loads raises an error, loads must fail
+-- Lines starting with # and empty lines are ignored.
+-- Tables have at most one key outside of the sequence, so the order of pairs
+-- does not depend on the hash order of the reference implementation.
+
+local smallfolk = dofile(assert(arg[1], "usage: lua generate.lua path/to/smallfolk.lua"))
+
+local values = {
+	true, false,
+	0, 1, -1, 7, -0.0, 0.5, -0.5, 0.1, 1/3, -2/3, 123.456, -678, 4294967295, 4294967296,
+	1e20, 1e-20, 1.7976931348623157e308, 2.2250738585072014e-308, 5e-324,
+	1/0, -1/0,
+	"", "a", "hello world", 'say "hi"', '"', '""', "it's", "{1,2}", "a:b,c", "tab\tinside",
+	{}, {{}}, {{}, {{}}, {3}, {4}},
+	{1, 2, 3}, {"a", "b", "c"}, {true, false, "x", 1.5},
+	{x = 1}, {["key with space"] = "value"}, {[1.5] = "half"}, {[0] = "zero"}, {[-1] = "minus"},
+	{[true] = "yes"}, {[false] = {1}}, {[5] = "five"},
+	{1, 2, 3, n = 3}, {"Hello", [67.5] = -234.5},
+	{{x = {y = {z = {}}}}},
+	{{1, {2, {3, {4, {5}}}}}},
+	{"player", {100.25, 200.5, 7}, {hp = 57}},
+}
+
+local big = {}
+for i = 1, 500 do
+	big[i] = i
+end
+values[#values + 1] = big
+
+local fractions = {}
+for i = 1, 200 do
+	fractions[i] = i / 7
+end
+values[#values + 1] = fractions
+
+local names = {}
+for i = 1, 100 do
+	names[i] = {"player" .. i, {id = i}}
+end
+values[#values + 1] = names
+
+local nested = {}
+for i = 1, 100 do
+	nested = {nested}
+end
+values[#values + 1] = nested
+
+-- inputs the reference accepts but does not output itself
+local inputs = {
+	"'single'", "'it''s'", "\"\"\"\"", "{'a':'b'}",
+	"1E5", "1e+5", "-1.5e-5", "0.0", "00",
+	"I", "i", "{1:1,2:2}", "{2:2,1:1}",
+	"{1,2,3}trailing",
+}
+-- not included because the reference output depends on the Lua version or platform:
+-- "-0" is an integer in Lua 5.3, the sign of nan depends on the platform
+-- and the length of tables with holes depends on the hash order
+
+-- inputs the reference rejects
+local invalid = {
+	"", "x", "{", "{1,2", "{1,2 3}", "{1;2}", "{,}", "{n:1}",
+	"\"abc", "'abc", "\"abc\"\"", "-", "--1", "1.", "1.e5", ".5", "1e", "1e+", "{1:}", "{:1}",
+	"}", "@1", "{1,}",
+}
+
+local function check(v)
+	local hash = 0
+	if type(v) ~= "table" then
+		return
+	end
+	for k, x in pairs(v) do
+		if type(k) ~= "number" or k < 1 or k > #v or k ~= math.floor(k) then
+			hash = hash + 1
+		end
+		check(k)
+		check(x)
+	end
+	assert(hash <= 1, "table with more than one key outside of the sequence")
+end
+
+print("# generated by generate.lua with the reference Smallfolk")
+for _, v in ipairs(values) do
+	check(v)
+	print("ok " .. smallfolk.dumps(v))
+end
+for _, input in ipairs(inputs) do
+	print("to " .. input .. "\t" .. smallfolk.dumps(smallfolk.loads(input)))
+end
+for _, input in ipairs(invalid) do
+	assert(not pcall(smallfolk.loads, input), input)
+	print("err " .. input)
+end
@@ -0,0 +1,234 @@
+// Fuzz target for loads, the dumps -> loads round trip and the transcoders
+// Build with -DSMALLFOLK_LIBFUZZER=ON and clang to run it under libFuzzer.
+// Otherwise the standalone runner is built:
+// Usage: smallfolk_fuzz [iterations] [file...]
+// Each file is run as an input and then used as a seed for iterations of random mutations.
+// Failed checks print the input and abort, so sanitizers and debuggers catch them.
+#include "smallfolk.h"
+#include <cstdint> // uint8_t
+#include <cstdio> // fprintf
+#include <cstdlib> // std::abort
+#include <string>
+
+namespace
+{
+    void fail(const char * what, const char * data, size_t size)
+    {
+        fprintf(stderr, "smallfolk_fuzz: %s\ninput (%u bytes): ", what, static_cast<unsigned int>(size));
+        fwrite(data, 1, size, stderr);
+        fprintf(stderr, "\n");
+        std::abort();
+    }
+}
+
+#define FUZZ_CHECK(cond) do { if (!(cond)) fail(#cond, data, size); } while (0)
+
+namespace
+{
+    // the query must find what loads and get find
+    std::vector<LuaQuery::Path> const paths = { {}, { 1 }, { 2 }, { "a" }, { 1, 1 }, { "a", "b" }, { 2, "k", 1 }, { 1.5 }, { true }, { "" }, { "it's" } };
+    LuaQuery const query(paths);
+
+    LuaVal const & lookup(LuaVal const & v, LuaQuery::Path const & path, size_t n = 0)
+    {
+        if (n == path.size())
+            return v;
+        if (!v.istable())
+            return LuaVal::nil;
+        return lookup(v.get(path[n]), path, n + 1);
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * bytes, size_t size)
+{
+    const char * data = reinterpret_cast<const char *>(bytes);
+    LuaVal loaded(TTABLE);
+    LuaVal again(TNIL);
+    LuaVal::LoadResult result = LuaVal::try_loads(data, size, loaded);
+    std::vector<LuaVal> found;
+    LuaVal::LoadResult queried = query.find(data, size, found);
+    FUZZ_CHECK(queried.code == result.code && queried.offset == result.offset && found.size() == query.size());
+    for (size_t n = 0; n < paths.size(); ++n)
+        FUZZ_CHECK(found[n].deep_equals(lookup(loaded, paths[n])));
+
+    // the transcoders read the text like loads, table keys are not supported before any later error
+    std::string json;
+    std::string packed;
+    LuaTranscode::Result to_json = LuaTranscode::to_json(data, size, json);
+    LuaTranscode::Result to_msgpack = LuaTranscode::to_msgpack(data, size, packed);
+    for (LuaTranscode::Result const & r : { to_json, to_msgpack })
+    {
+        if (!result)
+            FUZZ_CHECK(r.code == LuaTranscode::Result::UNSUPPORTED || (r.code == LuaTranscode::Result::INVALID_SMALLFOLK && r.load.code == result.code && r.load.offset == result.offset));
+        else
+            FUZZ_CHECK(r || r.code == LuaTranscode::Result::UNSUPPORTED);
+    }
+    std::string text;
+    if (to_json)
+        FUZZ_CHECK(LuaTranscode::from_json(json, text) && LuaVal::try_loads(text, again));
+    // MessagePack keeps the keys and types, the value is the same
+    text.clear();
+    if (to_msgpack)
+        FUZZ_CHECK(LuaTranscode::from_msgpack(packed, text) && LuaVal::loads(text).deep_equals(loaded));
+    // anything the readers accept is valid smallfolk
+    text.clear();
+    if (LuaTranscode::from_json(data, size, text))
+        FUZZ_CHECK(LuaVal::try_loads(text, again));
+    text.clear();
+    if (LuaTranscode::from_msgpack(data, size, text))
+        FUZZ_CHECK(LuaVal::try_loads(text, again));
+    if (!result)
+    {
+        FUZZ_CHECK(loaded.isnil());
+        FUZZ_CHECK(!result.message().empty());
+        // loads must agree with try_loads, it has a more detailed message for invalid compressed data
+        std::string errmsg;
+        FUZZ_CHECK(LuaVal::loads(data, size, &errmsg).isnil());
+        FUZZ_CHECK(errmsg == result.message() || (result.code == LuaVal::LoadResult::INVALID_COMPRESSION && !errmsg.empty()));
+        return 0;
+    }
+
+    // a memory budget stops loads before the value would use more than it
+    LuaVal::LoadOptions budget;
+    budget.max_memory = loaded.memory_usage() / 2 + 1;
+    LuaVal limited(TNIL);
+    LuaVal::LoadResult limit = LuaVal::try_loads(data, size, limited, budget);
+    FUZZ_CHECK(limit ? limited.memory_usage() <= budget.max_memory : limit.code == LuaVal::LoadResult::MEMORY_LIMIT && limited.isnil());
+
+    // everything that loads must survive a round trip unchanged
+    std::string dumped = loaded.dumps();
+    FUZZ_CHECK(LuaVal::try_loads(dumped, again));
+    FUZZ_CHECK(again.dumps() == dumped);
+    FUZZ_CHECK(loaded.deep_equals(again) && loaded.content_hash() == again.content_hash());
+    // the cached serialization must match a fresh one
+    LuaVal::DumpOptions options;
+    options.cache = true;
+    FUZZ_CHECK(loaded.dumps(options) == dumped);
+    FUZZ_CHECK(loaded.dumps(options) == dumped);
+    options.cache = false;
+    // dumping in small steps gives the same output
+    LuaDumper dumper(loaded, options);
+    while (!dumper.step(7)) {}
+    FUZZ_CHECK(dumper.output() == dumped);
+    options.compress = true;
+    FUZZ_CHECK(LuaVal::loads(loaded.dumps(options)).dumps() == dumped);
+    // the other styles read back to the same value
+    options = LuaVal::DumpOptions();
+    options.style = LuaVal::DumpOptions::MINIMAL;
+    std::string minimal = loaded.dumps(options);
+    FUZZ_CHECK(minimal.size() <= dumped.size());
+    FUZZ_CHECK(LuaVal::loads(minimal).dumps() == dumped);
+    options.style = LuaVal::DumpOptions::PRETTY;
+    FUZZ_CHECK(LuaVal::loads(loaded.dumps(options)).dumps() == dumped);
+    FUZZ_CHECK(loaded.freeze().dumps() == again.freeze().dumps());
+    return 0;
+}
+
+#ifndef SMALLFOLK_LIBFUZZER
+#include <fstream> // std::ifstream
+#include <iostream> // std::cout
+#include <vector>
+
+namespace
+{
+    // xorshift, the runs are reproducible
+    struct Random
+    {
+        explicit Random(uint32_t seed) : state(seed ? seed : 1) {}
+        uint32_t next()
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+        uint32_t operator()(uint32_t n) { return next() % n; }
+        uint32_t state;
+    };
+
+    // fragments of the format that random bytes rarely produce
+    const char * const tokens[] = {
+        "{", "}", ",", ":", "\"", "'", "\"\"", "''", "t", "f", "n", "N", "Q", "I", "i",
+        "0", "1", "-", ".", "e", "E", "+", "-0.5e-3", "1.7976931348623157e+308", "4294967296", " ",
+        "{}", "{{}}", "{1,2}", "{\"a\":1}", "\x1bSFZ",
+    };
+
+    std::string mutate(std::string s, std::vector<std::string> const & seeds, Random & rnd)
+    {
+        unsigned int n = 1 + rnd(4);
+        for (unsigned int m = 0; m < n; ++m)
+        {
+            size_t at = s.empty() ? 0 : rnd(static_cast<uint32_t>(s.size() + 1));
+            switch (rnd(6))
+            {
+            case 0: // flip a byte
+                if (!s.empty())
+                    s[at % s.size()] = static_cast<char>(rnd(256));
+                break;
+            case 1: // insert a token
+                s.insert(at, tokens[rnd(sizeof(tokens) / sizeof(tokens[0]))]);
+                break;
+            case 2: // erase a range
+                if (!s.empty())
+                    s.erase(at % s.size(), 1 + rnd(8));
+                break;
+            case 3: // truncate
+                s.resize(at);
+                break;
+            case 4: // splice in a part of another seed
+            {
+                std::string const & other = seeds[rnd(static_cast<uint32_t>(seeds.size()))];
+                size_t from = other.empty() ? 0 : rnd(static_cast<uint32_t>(other.size()));
+                s.insert(at, other.substr(from, 1 + rnd(32)));
+                break;
+            }
+            case 5: // duplicate a range
+                if (!s.empty())
+                    s.insert(at, s.substr(at % s.size(), 1 + rnd(16)));
+                break;
+            }
+        }
+        return s;
+    }
+
+    void run(std::string const & s)
+    {
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    unsigned long iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    std::vector<std::string> seeds = {
+        "", "{}", "{1,2,3}", "{\"a\":1,\"b\":{t,f,n}}", "{'it''s',\"\"\"\"}", "{-0.5e-3,1E+2,N,Q,I,i}",
+        "{{{1},{2}},{\"k\":{3}}}", "{1:2,3:4,5.5:6}", "{n:1}", "{1,2", "\"abc",
+        "[1,-2.5e3,{\"a\\\"\\u00e9\":[true,null]}]",
+        std::string(LuaVal::max_load_depth, '{') + std::string(LuaVal::max_load_depth, '}'),
+        std::string(LuaVal::max_load_depth + 1, '{') + std::string(LuaVal::max_load_depth + 1, '}'),
+        std::string(100000, '{'),
+    };
+    LuaVal::DumpOptions compressed;
+    compressed.compress = true;
+    seeds.push_back(LuaVal::loads("{1,2,3,\"abcabcabcabc\",{\"x\":1}}").dumps(compressed));
+    seeds.push_back(std::string("\x93\x01\xcb\x3f\xf8\0\0\0\0\0\0\x82\xa1k\xc3\x01\xc0", 17));
+    for (int i = 2; i < argc; ++i)
+    {
+        std::ifstream in(argv[i], std::ios::binary);
+        if (!in)
+        {
+            std::cerr << "smallfolk_fuzz: could not read " << argv[i] << std::endl;
+            return 1;
+        }
+        seeds.push_back(std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()));
+    }
+
+    for (std::string const & s : seeds)
+        run(s);
+    Random rnd(0x5F3759DF);
+    for (unsigned long i = 0; i < iterations; ++i)
+        run(mutate(seeds[rnd(static_cast<uint32_t>(seeds.size()))], seeds, rnd));
+    std::cout << "smallfolk_fuzz: " << seeds.size() << " seeds and " << iterations << " mutations passed" << std::endl;
+    return 0;
+}
+#endif
@@ -1,7 +1,30 @@
 #include "smallfolk.h"
+#include "smallfolk_lz.h"
+#include "smallfolk_log.h"
+#include "smallfolk_shared.h"
 #include <iostream> // std::cout
+#undef NDEBUG // the tests are asserts, keep them in release builds
 #include <cassert> // assert
+#include <cmath> // std::nan
+#include <cstdio> // std::remove
+#include <cstdlib> // malloc
 #include <map>
+#include <atomic> // std::atomic
+#include <thread> // std::thread
+
+// counts allocations to test that values are moved and not copied
+static std::atomic<size_t> allocations(0);
+void * operator new(size_t size)
+{
+    ++allocations;
+    if (void * p = malloc(size ? size : 1))
+        return p;
+    std::abort();
+}
+void operator delete(void * p) noexcept
+{
+    free(p);
+}
 
 int main()
 {
@@ -13,6 +36,9 @@ int main()
         LuaVal v = LuaVal::loads(" { 1 , 2 , { 3 , 4, ' k e ' : ' t e s t ' } } ", &err);
         std::cout << v.dumps(&err) << std::endl;
         std::cout << err << std::endl;
+        LuaVal quotes = { "say \"hi\"", "'", "\"\"" };
+        LuaVal unquoted = LuaVal::loads(quotes.dumps());
+        assert(unquoted.get(1) == quotes.get(1) && unquoted.get(2) == quotes.get(2) && unquoted.get(3) == quotes.get(3));
 
         std::cout << "Testing different double corner values" << std::endl;
         double _zero = 0.0;
@@ -74,6 +100,7 @@ int main()
         std::cout << t3.tostring() << std::endl;
         std::cout << std::endl;
 
+#ifndef SMALLFOLK_NO_EXCEPTIONS
         std::cout << "Testing exception handling" << std::endl;
         std::string errmsg;
         try
@@ -89,6 +116,7 @@ int main()
         // printing caught error if any
         if (!errmsg.empty())
             std::cout << errmsg << std::endl << std::endl;
+#endif
     }
 
     {
@@ -253,6 +281,949 @@ int main()
         std::cout << t2.dumps() << std::endl;
     }
 
+    {
+        std::cout << "test freeze" << std::endl;
+        LuaVal config = LuaVal::loads("{1,2,{3,4},'name':'world',5.5:t}");
+        LuaFrozen frozen = config.freeze();
+        config.set("name", "changed"); // snapshot is not affected
+        assert(frozen.istable());
+        assert(frozen.len() == 3);
+        assert(frozen.size() == 5);
+        assert(frozen.get("name").str() == "world");
+        assert(frozen.get(5.5).boolean());
+        assert(frozen[3][2].num() == 4);
+        assert(frozen.has(1) && !frozen.has("missing"));
+        assert(frozen.get("missing").isnil());
+        size_t before = allocations;
+        assert(!frozen.has("a missing key longer than any small string buffer") && frozen.get(5.5).boolean());
+        assert(allocations == before); // lookups do not create a LuaVal key
+        LuaFrozen sub = frozen.get(3);
+        frozen = LuaFrozen(); // sub keeps the snapshot alive
+        assert(sub.dumps() == "{3,4}");
+        std::cout << config.freeze().dumps() << std::endl; // Outputs {1,2,{3,4},5.5:t,"name":"changed"}
+        assert(LuaVal::loads(sub.dumps()).get(2).num() == 4);
+        assert(sub.thaw().len() == 2);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test serialization cache" << std::endl;
+        LuaVal::DumpOptions cache;
+        cache.cache = true;
+        LuaVal state = LuaVal::loads("{{1,2,3},{'a':{4,5}},'x':1}");
+        std::string first = state.dumps(cache);
+        assert(state.dumps(cache) == first); // nothing changed, reuses the previous serialization
+        state[2]["a"].insert(6);
+        std::string second = state.dumps(cache);
+        assert(second != first);
+        assert(LuaVal::loads(second).get(2).get("a").len() == 3);
+        assert(state.dumps() == second);
+        // changes through kept references are seen as well
+        LuaVal & x = state["x"];
+        LuaVal & a = state[2]["a"];
+        state.dumps(cache);
+        x = 2;
+        assert(LuaVal::loads(state.dumps(cache)).get("x").num() == 2);
+        a.set(1, "changed");
+        assert(LuaVal::loads(state.dumps(cache)).get(2).get("a").get(1).str() == "changed");
+        // reading through [] is not a change, adding a key is
+        std::string third = state.dumps(cache);
+        size_t before = allocations;
+        assert(state.dumps(cache) == third);
+        size_t reused = allocations - before;
+        assert(state["x"] == 2 && state[1][2] == 2);
+        before = allocations;
+        assert(state.dumps(cache) == third && allocations - before == reused);
+        state[3];
+        assert(state.dumps(cache) != third);
+        // only the largest tables up to cache_size are stored, so a deep chain is stored about once
+        LuaVal chain = LuaVal::loads("{'end'}");
+        for (int i = 0; i < 400; ++i)
+            chain = LuaVal({ i, chain, "padding to make each level longer" });
+        size_t plain = chain.memory_usage();
+        assert(chain.dumps(cache) == chain.dumps());
+        assert(chain.dumps(cache) == chain.dumps());
+        assert(chain.memory_usage() > plain && chain.memory_usage() - plain <= LuaVal::LuaTable::cache_size * 2);
+        std::cout << state.dumps(cache) << std::endl;
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test diff and patch" << std::endl;
+        LuaVal before = LuaVal::loads("{1,2,{'hp':10,'mp':5},'name':'bob','gone':t}");
+        LuaVal after = LuaVal::loads("{1,3,{'hp':7,'mp':5},'name':'bob','new':{1}}");
+        LuaVal delta = LuaVal::diff(before, after);
+        std::string serialized = delta.dumps();
+        std::cout << serialized << std::endl;
+        assert(LuaVal::diff(before, before).tbl().empty());
+        LuaVal copy = before;
+        LuaVal::patch(copy, delta);
+        assert(copy.freeze().dumps() == after.freeze().dumps());
+        LuaVal::patch(before, LuaVal::loads(serialized));
+        assert(before.freeze().dumps() == after.freeze().dumps());
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test compression" << std::endl;
+        LuaVal big(TTABLE);
+        for (int i = 1; i <= 1000; ++i)
+            big.insert(LuaVal::loads("{'name':'item','count':12,'price':1.25}"));
+        LuaVal::DumpOptions options;
+        options.compress = true;
+        std::string plain = big.dumps();
+        std::string compressed = big.dumps(options);
+        std::cout << plain.size() << " -> " << compressed.size() << std::endl;
+        assert(compressed.size() < plain.size() / 4);
+        assert(SmallfolkLZ::is_compressed(compressed.data(), compressed.size()));
+        assert(LuaVal::loads(compressed).freeze().dumps() == big.freeze().dumps());
+        // feeding the frame in small pieces
+        SmallfolkLZ::Decompressor d;
+        for (size_t i = 0; i < compressed.size(); i += 7)
+            assert(d.feed(compressed.data() + i, std::min<size_t>(7, compressed.size() - i)));
+        assert(d.done() && d.output() == plain);
+        std::string err;
+        assert(LuaVal::loads(compressed.substr(0, compressed.size() - 3), &err).isnil());
+        std::cout << err << std::endl;
+        // a block can not write more than its declared length
+        std::string block = "\x1f" "a" "\x01";
+        block += '\0';
+        block.append(300, '\xff');
+        block += '\0';
+        std::string bomb = "\x1bSFZ\x01";
+        SmallfolkLZ::write_varint(bomb, SmallfolkLZ::block_size);
+        SmallfolkLZ::write_varint(bomb, SmallfolkLZ::block_size);
+        SmallfolkLZ::write_varint(bomb, block.size());
+        bomb += block;
+        std::string out;
+        err.clear();
+        assert(!SmallfolkLZ::decompress(bomb.data(), bomb.size(), out, &err) && out.size() <= SmallfolkLZ::block_size);
+        std::cout << err << std::endl;
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test save_file and load_file" << std::endl;
+        LuaVal big(TTABLE);
+        for (int i = 1; i <= 20000; ++i)
+            big.set(i, LuaVal::loads("{'name':'item','count':12,'price':1.25}"));
+        std::string err;
+        assert(big.save_file("smallfolk_test.txt", &err));
+        LuaVal loaded = LuaVal::load_file("smallfolk_test.txt", &err);
+        assert(err.empty());
+        assert(loaded.freeze().dumps() == big.freeze().dumps());
+        LuaVal::DumpOptions options;
+        options.compress = true;
+        assert(big.save_file("smallfolk_test.txt", options));
+        assert(LuaVal::load_file("smallfolk_test.txt").len() == 20000);
+        std::remove("smallfolk_test.txt");
+        assert(LuaVal::load_file("smallfolk_test.txt", &err).isnil());
+        std::cout << err << std::endl;
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test logs" << std::endl;
+        std::remove("smallfolk_test.log");
+        std::remove("smallfolk_test.log.idx");
+        std::string err;
+        LuaVal::DumpOptions compressed;
+        compressed.compress = true;
+        {
+            SmallfolkLog::Writer writer(16);
+            assert(writer.open("smallfolk_test.log", &err));
+            for (int i = 0; i < 100; ++i)
+                assert(writer.append(LuaVal({ i, "record", std::string(i % 7 * 40, 'x') }), i % 3 ? LuaVal::DumpOptions() : compressed));
+            assert(writer.close(&err));
+        }
+        // reopening continues the log
+        SmallfolkLog::Writer writer(64);
+        assert(writer.open("smallfolk_test.log", &err) && writer.size() == 100);
+        for (int i = 100; i < 150; ++i)
+            assert(writer.append(LuaVal({ i, "record" }).dumps()));
+        assert(writer.flush(&err));
+        SmallfolkLog::Reader reader;
+        assert(reader.open("smallfolk_test.log", &err) && reader.size() == 150);
+        for (size_t i = 0; i < 150; ++i)
+        {
+            size_t n = i * 37 % 150;
+            assert(reader.get(n).get(1).num() == n);
+        }
+        assert(reader.get(99, &err).get(3).str() == std::string(99 % 7 * 40, 'x'));
+        std::string record;
+        assert(reader.read(149, record) && record == "{149,\"record\"}");
+        assert(!reader.read(150, record, &err));
+        std::cout << err << std::endl;
+        err.clear();
+
+        // a record cut short by a crash is ignored and then removed by the writer
+        writer.close();
+        FILE * file = fopen("smallfolk_test.log", "ab");
+        fwrite("\x20{1,", 1, 4, file);
+        fclose(file);
+        assert(reader.open("smallfolk_test.log", &err) && reader.size() == 150);
+        assert(writer.open("smallfolk_test.log", &err) && writer.size() == 150);
+        assert(writer.append(LuaVal({ 150 })) && writer.close(&err));
+        assert(reader.open("smallfolk_test.log", &err) && reader.size() == 151);
+        assert(reader.get(150).get(1).num() == 150 && reader.get(149).get(1).num() == 149);
+
+        // a missing index is rebuilt from the records
+        std::remove("smallfolk_test.log.idx");
+        assert(reader.open("smallfolk_test.log", &err) && reader.size() == 151 && reader.get(77).get(1).num() == 77);
+        assert(writer.open("smallfolk_test.log", &err) && writer.size() == 151);
+        writer.close();
+        file = fopen("smallfolk_test.log.idx", "rb");
+        fseek(file, 0, SEEK_END);
+        // the header and the offsets of records 0, 16, ... 144
+        assert(ftell(file) == 16 + 10 * 8);
+        fclose(file);
+        reader.close();
+        assert(err.empty());
+
+        assert(!reader.open("smallfolk_test.txt", &err));
+        std::cout << err << std::endl;
+        std::remove("smallfolk_test.log");
+        std::remove("smallfolk_test.log.idx");
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test table policies" << std::endl;
+        LuaTablePolicy const policies[] = { TABLE_AUTO, TABLE_HASH, TABLE_FLAT, TABLE_ORDERED };
+        for (LuaTablePolicy policy : policies)
+        {
+            // the same changes on a table with the policy and on a std::map
+            LuaVal t = LuaVal::table(policy);
+            std::map<int, int> expected;
+            for (int i = 0; i < 3000; ++i)
+            {
+                int k = (i * 7919) % 211;
+                if (i % 3 == 2)
+                {
+                    t.rem(k);
+                    t.rem(std::to_string(k));
+                    expected.erase(k);
+                }
+                else
+                {
+                    t.set(k, i);
+                    t.set(std::to_string(k), i);
+                    expected[k] = i;
+                }
+                if (i % 100 == 0)
+                {
+                    for (int j = 0; j < 211; ++j)
+                    {
+                        auto it = expected.find(j);
+                        assert(t.has(j) == (it != expected.end()) && t.has(std::to_string(j)) == (it != expected.end()));
+                        assert(it == expected.end() || (t.get(j) == it->second && t.get(std::to_string(j)) == it->second));
+                    }
+                }
+            }
+            assert(t.tbl().size() == 2 * expected.size() && t.policy() == policy);
+            LuaVal copy = t;
+            assert(copy.policy() == policy && copy.dumps() == t.dumps());
+        }
+
+        // small tables are promoted to an index as they grow, references to values stay valid
+        LuaVal grown(TTABLE);
+        LuaVal & first = grown["first"];
+        first = 1;
+        for (int i = 1; i <= 100; ++i)
+            grown.set(i, i);
+        assert(&grown["first"] == &first && grown.get("first") == 1 && grown.len() == 100);
+        assert(grown.dumps().compare(0, 9, "{1,2,3,4,") == 0);
+
+        LuaVal ordered = LuaVal::table(TABLE_ORDERED);
+        ordered.set("b", 1).set("a", 2).set(3, 3).set(1.5, 4).set(true, 5).set(1, 6);
+        assert(ordered.dumps() == "{6,t:5,1.5:4,3:3,\"a\":2,\"b\":1}");
+        LuaVal sorted = LuaVal::loads("{\"b\":1,\"a\":2,3:3}");
+        assert(sorted.dumps() == "{\"b\":1,\"a\":2,3:3}");
+        assert(sorted.set_policy(TABLE_ORDERED).dumps() == "{3:3,\"a\":2,\"b\":1}");
+        // frozen and ordered tables use the same key order
+        assert(ordered.freeze().dumps() == ordered.dumps());
+        // nan keys are never found, whatever the index
+        for (LuaTablePolicy policy : policies)
+        {
+            LuaVal nan = LuaVal::table(policy);
+            nan.set(std::nan(""), 1).set(std::nan(""), 2).set(1.5, 3);
+            assert(!nan.has(std::nan("")) && nan.tbl().size() == 3 && !nan.freeze().has(std::nan("")));
+            nan.rem(1.5);
+            assert(nan.tbl().size() == 2);
+        }
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test deep_equals and content_hash" << std::endl;
+        LuaVal a = LuaVal::loads("{1,2,{\"x\":1,\"y\":{t,f}},\"name\":\"a\",5.5:\"half\"}");
+        LuaVal b(TTABLE);
+        b.set(5.5, "half").set("name", "a").set(3, LuaVal::loads("{\"y\":{t,f},\"x\":1}")).set(2, 2).set(1, 1);
+        assert(a != b && a.deep_equals(b) && b.deep_equals(a));
+        assert(a.content_hash() == b.content_hash());
+        // the stored hash is updated when a table inside changes
+        size_t before = a.content_hash();
+        a[3]["y"][2] = true;
+        assert(!a.deep_equals(b) && a.content_hash() != before);
+        a[3]["y"][2] = false;
+        assert(a.deep_equals(b) && a.content_hash() == before);
+        // nil values are ignored, other values compare like ==
+        b[3]["z"];
+        b[3].set("z", LuaVal::nil);
+        assert(a.deep_equals(b) && a.content_hash() == b.content_hash());
+        b.set("extra", 0);
+        assert(!a.deep_equals(b) && !b.deep_equals(a));
+        assert(LuaVal(1).deep_equals(1) && !LuaVal(1).deep_equals("1") && LuaVal(0.0).content_hash() == LuaVal(-0.0).content_hash());
+        // nan survives a round trip and equals itself
+        LuaVal nans = LuaVal::loads("{N,Q}");
+        assert(nans.dumps() == "{N,Q}" && nans.deep_equals(LuaVal::loads(nans.dumps())));
+        // table keys are compared by content
+        LuaVal k1(TTABLE), k2(TTABLE);
+        k1.set(LuaVal({ 1, 2 }), "p").set(LuaVal({ 1, 2, 3 }), "q");
+        k2.set(LuaVal({ 1, 2, 3 }), "q").set(LuaVal({ 1, 2 }), "p");
+        assert(k1.deep_equals(k2) && k1.content_hash() == k2.content_hash());
+        k2.set(LuaVal({ 1, 2 }), "p");
+        assert(!k1.deep_equals(k2));
+        // the functors for deduplicating with containers
+        LuaVal::ContentHasher hasher;
+        LuaVal::ContentEqual equal;
+        LuaVal reloaded = LuaVal::loads(a.dumps());
+        assert(hasher(a) == hasher(reloaded) && equal(a, reloaded) && !equal(a, b));
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test dump styles" << std::endl;
+        LuaVal v = LuaVal::loads("{0.1,100000,1e20,0.0001,123.456,-0.5,-0,'it''s','say \"hi\"',I,{}}");
+        LuaVal::DumpOptions minimal;
+        minimal.style = LuaVal::DumpOptions::MINIMAL;
+        std::string small = v.dumps(minimal);
+        std::cout << small << std::endl;
+        assert(small == "{0.1,1e5,1e20,1e-4,123.456,-0.5,-0,\"it's\",'say \"hi\"',I,{}}");
+        assert(LuaVal::loads(small).dumps() == v.dumps());
+        // shortest digits that still read back exactly
+        LuaVal third = LuaVal::loads("{0.33333333333333331,5e-324,1.7976931348623157e308}");
+        assert(third.dumps(minimal) == "{0.3333333333333333,5e-324,1.7976931348623157e308}");
+        assert(LuaVal::loads(third.dumps(minimal)).dumps() == third.dumps());
+
+        LuaVal::DumpOptions pretty;
+        pretty.style = LuaVal::DumpOptions::PRETTY;
+        LuaVal t = LuaVal::loads("{1,{},\"a\":{t,\"b\":\"c\"}}");
+        std::string text = t.dumps(pretty);
+        std::cout << text << std::endl;
+        assert(text == "{\n  1,\n  {},\n  \"a\": {\n    t,\n    \"b\": \"c\"\n  }\n}");
+        assert(LuaVal::loads(text).dumps() == t.dumps());
+        // the styles do not use or fill the serialization cache
+        assert(t.dumps() == "{1,{},\"a\":{t,\"b\":\"c\"}}");
+        assert(t.dumps(pretty) == text);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test dumping in steps" << std::endl;
+        LuaVal v = LuaVal::loads("{1,2,{},{{3}},\"a\":{t,f,\"b\":'c'},{4}:5,7.5:{n,n,6},\"long\":\"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\"}");
+        LuaVal::DumpOptions options[4];
+        options[1].style = LuaVal::DumpOptions::MINIMAL;
+        options[2].style = LuaVal::DumpOptions::PRETTY;
+        options[3].compress = true;
+        options[0].cache = true;
+        for (LuaVal::DumpOptions const & o : options)
+        {
+            LuaDumper dumper(v, o);
+            unsigned int steps = 1;
+            while (!dumper.step(1))
+                ++steps;
+            assert(dumper.done() && dumper.step(1));
+            assert(dumper.output() == v.dumps(o) && steps > 10);
+        }
+        // the dumper fills the cache and then uses it
+        LuaVal::DumpOptions cache;
+        cache.cache = true;
+        LuaDumper first(v, cache);
+        while (!first.step(8)) {}
+        LuaDumper cached(v, cache);
+        assert(cached.step(1) && cached.take() == v.dumps());
+        LuaVal str("str");
+        LuaDumper scalar(str);
+        assert(scalar.step_for(std::chrono::milliseconds(1)) && scalar.output() == "\"str\"");
+        LuaVal big(TTABLE);
+        for (int i = 1; i <= 20000; ++i)
+            big.set(i, LuaVal({ i, "item" }));
+        LuaDumper timed(big);
+        while (!timed.step_for(std::chrono::microseconds(100))) {}
+        assert(timed.output() == big.dumps());
+#ifndef SMALLFOLK_NO_EXCEPTIONS
+        // changing the value between the steps is an error
+        LuaDumper changed(big, options[3]);
+        changed.step(100);
+        big[5].set(1, 0);
+        bool thrown = false;
+        try
+        {
+            changed.step(100);
+        }
+        catch (smallfolk_exception const & e)
+        {
+            std::cout << e.what() << std::endl;
+            thrown = true;
+        }
+        assert(thrown);
+#endif
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test templates" << std::endl;
+        LuaVal message = { "move", LuaTemplate::hole(0), LuaTemplate::hole(1) };
+        message.set("ver", 3);
+        message.set("pos", LuaVal({ LuaTemplate::hole(2), LuaTemplate::hole(2) }));
+        message.set(LuaTemplate::hole(3), true);
+        LuaTemplate tmpl(message);
+        assert(tmpl.holes() == 4);
+        LuaVal items = { 1, "it's" };
+        std::string text = tmpl.dumps({ 42, "say \"hi\"", 1.5, items });
+        std::cout << text << std::endl;
+        assert(text == "{\"move\",42,\"say \"\"hi\"\"\",\"ver\":3,\"pos\":{1.5,1.5},{1,\"it's\"}:t}");
+        // the same as building the message and serializing it
+        LuaVal built = { "move", 42, "say \"hi\"" };
+        built.set("ver", 3);
+        built.set("pos", LuaVal({ 1.5, 1.5 }));
+        built.set(items, true);
+        assert(text == built.dumps());
+        std::string buffer = "prefix";
+        tmpl.dumps(buffer, { -1, false, 2, "k" });
+        assert(buffer == "prefix{\"move\",-1,f,\"ver\":3,\"pos\":{2,2},\"k\":t}");
+        // a template without holes is a constant serialization
+        LuaTemplate constant(LuaVal({ "hello", 1, 2 }));
+        assert(constant.holes() == 0 && constant.dumps() == "{\"hello\",1,2}");
+        // the styles format the values the same way
+        LuaVal::DumpOptions pretty;
+        pretty.style = LuaVal::DumpOptions::PRETTY;
+        LuaVal nested = { 1, LuaVal({ LuaTemplate::hole(0) }) };
+        LuaVal filled = { 1, LuaVal({ LuaVal({ 2, "x" }) }) };
+        assert(LuaTemplate(nested, pretty).dumps({ LuaVal({ 2, "x" }) }) == filled.dumps(pretty));
+        LuaVal::DumpOptions minimal;
+        minimal.style = LuaVal::DumpOptions::MINIMAL;
+        assert(LuaTemplate(LuaTemplate::hole(0), minimal).dumps({ 0.0001 }) == "1e-4");
+#ifndef SMALLFOLK_NO_EXCEPTIONS
+        bool thrown = false;
+        try
+        {
+            tmpl.dumps({ 1, 2 });
+        }
+        catch (smallfolk_exception const & e)
+        {
+            std::cout << e.what() << std::endl;
+            thrown = true;
+        }
+        assert(thrown);
+#endif
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test queries" << std::endl;
+        std::string text = "{'first',\"cmd\":\"move\",\"args\":{10,20,'it''s'},\"meta\":{\"log\":{1,2,3},\"cmd\":\"inner\"},'it''s':t,2:{f}}";
+        LuaQuery query({ { 1 }, { "cmd" }, { "args", 2 }, { "args" }, { "missing" }, { "it's" }, { "args", 3 }, { 2, 1 }, { "cmd", 1 } });
+        assert(query.size() == 9);
+        std::vector<LuaVal> found;
+        assert(query.find(text, found));
+        assert(found[0] == "first" && found[1] == "move" && found[2] == 20 && found[3].dumps() == "{10,20,\"it's\"}");
+        assert(found[4].isnil() && found[5] == true && found[6] == "it's" && found[7] == false && found[8].isnil());
+        // the last value of a key wins like in loads, also when it replaces a table
+        LuaQuery sub({ { "a" }, { "a", 2 }, { 1 } });
+        assert(sub.find("{'a':{1,2},7,'a':5,1:8}", found) && found[0] == 5 && found[1].isnil() && found[2] == 8);
+        assert(sub.find("{1:8,7,'a':{1,2},'a':n}", found) && found[0].isnil() && found[1].isnil() && found[2] == 7);
+        assert(sub.find("{1.0:'x',\"a\":{2:3}}", found) && found[2] == "x" && found[1] == 3);
+        // errors are the ones loads gives
+        LuaVal v(TNIL);
+        LuaVal::LoadResult r = query.find("{1,{2 x}}", found);
+        assert(!r && r.code == LuaVal::try_loads("{1,{2 x}}", v).code && r.offset == 6 && found[0].isnil());
+        assert(query.find("{n:1}", found).code == LuaVal::LoadResult::NIL_KEY);
+        // compressed input is decompressed first
+        LuaVal::DumpOptions compressed;
+        compressed.compress = true;
+        assert(query.find(LuaVal::loads(text).dumps(compressed), found) && found[2] == 20);
+        // skipping allocates nothing, only the values found do
+        LuaVal big(TTABLE);
+        for (int i = 1; i <= 1000; ++i)
+            big.set(i, LuaVal({ "player", i, LuaVal({ 1.5, 2.5 }) }));
+        big.set("id", 77);
+        std::string bigtext = big.dumps();
+        LuaQuery numbers({ { "id" }, { 500, 2 }, { 999, 3, 1 } });
+        numbers.find(bigtext, found);
+        size_t before = allocations;
+        assert(numbers.find(bigtext, found) && found[0] == 77 && found[1] == 500 && found[2] == 1.5);
+        assert(allocations == before);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test transcoding" << std::endl;
+        std::string json;
+        // sequences are arrays, other tables objects, like dumps tells them apart
+        assert(LuaTranscode::to_json("{1,2,{\"a\":t,\"b\":{f,n}},{}}", json) && json == "[1,2,{\"a\":true,\"b\":[false,null]},{}]");
+        json.clear();
+        assert(LuaTranscode::to_json("{1:'x',2.0:'y'}", json) && json == "[\"x\",\"y\"]");
+        json.clear();
+        // a table that stops being a sequence is rewritten with its keys
+        assert(LuaTranscode::to_json("{1,{2},'k':3,4}", json) && json == "{\"1\":1,\"2\":[2],\"k\":3,\"3\":4}");
+        json.clear();
+        assert(LuaTranscode::to_json("{t:1,-1.5:2,I:3,N:4}", json) && json == "{\"true\":1,\"-1.5\":2,\"Infinity\":3,\"NaN\":4}");
+        json.clear();
+        // a number key gets the same text however it is written
+        assert(LuaTranscode::to_json("{'a',3.0:1,1e1:2,-0:3,0.10:4,1e999:5}", json) && json == "{\"1\":\"a\",\"3\":1,\"10\":2,\"0\":3,\"0.1\":4,\"Infinity\":5}");
+        json.clear();
+        // different keys with the same JSON text can not be told apart, the same key twice can
+        assert(LuaTranscode::to_json("{1,2,'x':{5:'a',\"5\":'b'}}", json).offset == 9);
+        assert(LuaTranscode::to_json("{1:'a',\"1\":'b'}", json).code == LuaTranscode::Result::UNSUPPORTED);
+        assert(LuaTranscode::to_json("{'a',\"1\":'b'}", json).code == LuaTranscode::Result::UNSUPPORTED);
+        assert(LuaTranscode::to_json("{t:1,\"true\":2}", json).code == LuaTranscode::Result::UNSUPPORTED && json.empty());
+        assert(LuaTranscode::to_json("{1.5:'a',{'b'},\"t\":1,\"1.5\":'c'}", json).code == LuaTranscode::Result::UNSUPPORTED);
+        assert(LuaTranscode::to_json("{2:'a',2.0:'b',\"x\":{\"x\":1},\"x\":2}", json) && json == "{\"2\":\"a\",\"2\":\"b\",\"x\":{\"x\":1},\"x\":2}");
+        json.clear();
+        assert(LuaTranscode::to_json("{I,i,N,Q,-0.5e-3}", json) && json == "[1e999,-1e999,null,null,-0.5e-3]");
+        json.clear();
+        assert(LuaTranscode::to_json("{'it''s',\"a\"\"b\\\n\x01\xc3\xa9\"}", json) && json == "[\"it's\",\"a\\\"b\\\\\\n\\u0001\xc3\xa9\"]");
+        // the output is appended, on failure it is left as it was
+        LuaTranscode::Result r = LuaTranscode::to_json("{1,\"\xff\"}", json);
+        assert(r.code == LuaTranscode::Result::UNSUPPORTED && r.offset == 3 && json.size() == 27);
+        assert(LuaTranscode::to_json("{{}:1}", json).code == LuaTranscode::Result::UNSUPPORTED);
+        assert(r.message() == "Smallfolk: transcode at 3 value not supported by the output format");
+        // invalid input gives the error of loads
+        LuaVal v(TNIL);
+        r = LuaTranscode::to_json("{1,{2 x}}", json);
+        assert(r.code == LuaTranscode::Result::INVALID_SMALLFOLK && r.offset == 6 && r.load.code == LuaVal::try_loads("{1,{2 x}}", v).code);
+        assert(r.message() == "Smallfolk: loads at 6 expected , or } but found x");
+
+        std::string text;
+        assert(LuaTranscode::from_json(" {\"a\\\"\\u00e9\\ud83d\\ude00\" : [1, -2.5e3, true, null, {}], \"b\":[]} ", text));
+        assert(text == "{\"a\"\"\xc3\xa9\xf0\x9f\x98\x80\":{1,-2.5e3,t,n,{}},\"b\":{}}");
+        r = LuaTranscode::from_json("[1,]", text);
+        assert(r.code == LuaTranscode::Result::INVALID_JSON && r.offset == 3 && r.message() == "Smallfolk: transcode at 3 invalid JSON");
+        assert(LuaTranscode::from_json("\"\\ud800\"", text).offset == 1);
+        assert(!LuaTranscode::from_json("01", text) && !LuaTranscode::from_json("[1] x", text) && !LuaTranscode::from_json("'a'", text));
+        assert(LuaTranscode::from_json(std::string(1000, '['), text).code == LuaTranscode::Result::TOO_DEEP);
+
+        // MessagePack keeps the types, the result loads to the same value
+        std::string packed;
+        std::string sample = "{1,-1,200,-200,70000,1.5,-0,\"s\",{t,f},\"k\":{\"x\":1},4294967296,I,N,Q}";
+        assert(LuaTranscode::to_msgpack(sample, packed));
+        // 14 pairs, the values before "k" get their keys when the table becomes a map
+        assert(packed.compare(0, 14, std::string("\x8e\x01\x01\x02\xff\x03\xcc\xc8\x04\xd1\xff\x38\x05\xce", 14)) == 0);
+        text.clear();
+        // keys that continue the sequence are left out again, so the text is the same
+        assert(LuaTranscode::from_msgpack(packed, text) && text == sample);
+        packed.clear();
+        assert(LuaTranscode::to_msgpack("{1,2,n}", packed) && packed == "\x93\x01\x02\xc0");
+        // nil keys and ext values have no smallfolk equivalent, cut short input is invalid
+        assert(LuaTranscode::from_msgpack(std::string("\x81\xc0\x01", 3), text).code == LuaTranscode::Result::UNSUPPORTED);
+        assert(LuaTranscode::from_msgpack("\xd4\x01\x01", text).code == LuaTranscode::Result::UNSUPPORTED);
+        r = LuaTranscode::from_msgpack("\x92\x01\xa3xy", text);
+        assert(r.code == LuaTranscode::Result::INVALID_MSGPACK && r.offset == 2);
+        assert(LuaTranscode::from_msgpack("\xdd\xff\xff\xff\xff", text).code == LuaTranscode::Result::INVALID_MSGPACK);
+
+        // a message converts without creating values, sequences need nothing besides the output
+        LuaVal big(TTABLE);
+        for (int i = 1; i <= 1000; ++i)
+            big.set(i, LuaVal({ "player", i, LuaVal({ 1.5, 2.5 }) }));
+        std::string bigtext = big.dumps();
+        json.clear();
+        json.reserve(bigtext.size() * 2);
+        size_t before = allocations;
+        assert(LuaTranscode::to_json(bigtext, json) && allocations == before);
+        text.clear();
+        assert(LuaTranscode::from_json(json, text) && text == bigtext);
+        // objects only keep their keys while they are open and the values of a table that gets keys
+        LuaVal objects(TTABLE);
+        for (int i = 1; i <= 1000; ++i)
+            objects.set(i % 2 ? LuaVal(i) : LuaVal(std::to_string(i)), LuaVal({ "player", i }));
+        std::string objecttext = objects.dumps();
+        json.clear();
+        json.reserve(objecttext.size() * 2);
+        before = allocations;
+        assert(LuaTranscode::to_json(objecttext, json) && allocations - before < 32);
+        text.clear();
+        assert(LuaTranscode::from_json(json, text) && LuaVal::loads(text).tbl().size() == 1000 && LuaVal::loads(text).get("999").get(2).num() == 999);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test shared tables" << std::endl;
+        LuaSharedTable shared(5);
+        assert(shared.shard_count() == 8 && shared.size() == 0 && shared.dumps() == "{}");
+        shared.set(1, "one");
+        shared.set(2, LuaVal({ 2, { "x" } }));
+        shared.set("name", "shared");
+        shared.set(true, 1.5);
+        assert(shared.get(1).str() == "one");
+        assert(shared.get(2).get(2).get(1).str() == "x" && shared[true].num() == 1.5);
+        assert(shared.has("name") && !shared.has("missing") && shared.get("missing").isnil() && shared.size() == 4);
+        // lookups take a LuaKey, reading with a literal or a number does not allocate
+        size_t before = allocations;
+        assert(shared.get("name").isstring() && shared[1].isstring() && shared.has(true) && !shared.has("missing"));
+        assert(allocations == before);
+        // adding a key copies only the pointers of its shard, so it costs the same in a big shard
+        LuaSharedTable one(1);
+        before = allocations;
+        one.set("new", 1);
+        size_t small = allocations - before;
+        for (int i = 0; i < 1000; ++i)
+            one.set(i, i);
+        before = allocations;
+        one.set("newer", 1);
+        assert(allocations - before == small);
+        // removing allocates only the new map and its array
+        before = allocations;
+        assert(one.rem("newer") && allocations - before == 2);
+        // values are copies, changing the original does not change the table
+        LuaVal changed = { 1, 2 };
+        shared.set("list", changed);
+        changed.set(1, 100);
+        assert(shared.get("list").get(1).num() == 1);
+        // nil removes
+        shared.set("list", LuaVal::nil);
+        assert(!shared.has("list") && !shared.rem("list") && shared.size() == 4);
+        LuaVal counter = shared.update("count", [](LuaFrozen const & v) { return v.isnil() ? LuaVal(1) : LuaVal(v.num() + 1); }).thaw();
+        assert(counter == 1 && shared.update("count", [](LuaFrozen const & v) { return LuaVal(v.num() + 1); }).num() == 2);
+        // f runs without the lock, so it can read the whole table and write other keys
+        shared.update("count", [&](LuaFrozen const & v) {
+            shared.set("seen", static_cast<unsigned int>(shared.snapshot().size()));
+            return LuaVal(v.num() + shared.get("count").num());
+        });
+        assert(shared.get("count").num() == 4 && shared.has("seen"));
+        shared.rem("seen");
+        assert(shared.rem("count") && !shared.has("count"));
+
+        // a snapshot does not see later writes and serializes like a frozen table
+        LuaSharedTable::Snapshot snap = shared.snapshot();
+        shared.set(3, "three");
+        shared.rem("name");
+        assert(snap.size() == 4 && !snap.has(3) && snap.get("name").str() == "shared");
+        size_t pairs = 0;
+        for (size_t i = 0; i < snap.size(); ++i)
+            pairs += snap.value(i).thaw().deep_equals(snap.get(snap.key(i)).thaw());
+        assert(pairs == 4);
+        assert(snap.dumps() == snap.thaw().freeze().dumps());
+        assert(snap.dumps() == "{\"one\",{2,{\"x\"}},t:1.5,\"name\":\"shared\"}");
+        assert(shared.dumps() == "{\"one\",{2,{\"x\"}},\"three\",t:1.5}");
+        assert(LuaVal::loads(shared.dumps()).deep_equals(shared.snapshot().thaw()));
+#ifndef SMALLFOLK_NO_EXCEPTIONS
+        size_t thrown = 0;
+        double zero = 0;
+        LuaVal keys[] = { LuaVal::nil, LuaVal(TTABLE), LuaVal(0 / zero) };
+        for (LuaVal const & k : keys)
+        {
+            try
+            {
+                shared.set(k, 1);
+            }
+            catch (smallfolk_exception const & e)
+            {
+                std::cout << e.what() << std::endl;
+                ++thrown;
+            }
+        }
+        assert(thrown == 3);
+#endif
+
+        // writers move units between keys at the same time, no update is lost
+        LuaSharedTable accounts;
+        for (int i = 1; i <= 8; ++i)
+            accounts.set(i, 100);
+        std::atomic<bool> stop(false);
+        std::vector<std::thread> writers;
+        for (int w = 0; w < 2; ++w)
+        {
+            writers.push_back(std::thread([&accounts, w]() {
+                for (int i = 0; i < 2000; ++i)
+                {
+                    int from = 1 + (i + w) % 8;
+                    accounts.update(from, [](LuaFrozen const & v) { return LuaVal(v.num() - 1); });
+                    accounts.update(1 + (from + 3) % 8, [](LuaFrozen const & v) { return LuaVal(v.num() + 1); });
+                }
+            }));
+        }
+        std::thread reader([&accounts, &stop]() {
+            for (int i = 0; !stop; ++i)
+                assert(accounts.get(1 + i % 8).isnumber());
+        });
+        for (auto & t : writers)
+            t.join();
+        stop = true;
+        reader.join();
+        LuaSharedTable::Snapshot balances = accounts.snapshot();
+        double total = 0;
+        for (size_t i = 0; i < balances.size(); ++i)
+            total += balances.value(i).num();
+        assert(total == 800);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test try_loads" << std::endl;
+        LuaVal v(TNIL);
+        LuaVal::LoadResult r = LuaVal::try_loads("{1,\"a\":{t}}", v);
+        assert(r && v.get("a").get(1) == true);
+        r = LuaVal::try_loads("{1,2 x}", v);
+        assert(!r && r.code == LuaVal::LoadResult::UNEXPECTED_TABLE_CHARACTER && r.offset == 5 && r.found == 'x' && v.isnil());
+        std::string err;
+        assert(LuaVal::loads("{1,2 x}", &err).isnil() && err == r.message());
+        std::cout << err << std::endl;
+        r = LuaVal::try_loads("{\"abc", v);
+        assert(r.code == LuaVal::LoadResult::EOF_IN_STRING && r.offset == 1);
+        r = LuaVal::try_loads("{n:1}", v);
+        assert(r.code == LuaVal::LoadResult::NIL_KEY);
+        r = LuaVal::try_loads("1.e", v);
+        assert(r.code == LuaVal::LoadResult::NO_DECIMALS);
+        // deep nesting is rejected before it runs out of stack
+        std::string deep = std::string(LuaVal::max_load_depth, '{') + std::string(LuaVal::max_load_depth, '}');
+        assert(LuaVal::try_loads(deep, v) && v.dumps() == deep);
+        r = LuaVal::try_loads("{" + deep + "}", v);
+        assert(r.code == LuaVal::LoadResult::TOO_DEEP && r.offset == LuaVal::max_load_depth);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test memory budgets" << std::endl;
+        LuaVal small = 1;
+        assert(small.memory_usage() == sizeof(LuaVal));
+        // memory_usage counts what the value allocated
+        size_t before = allocations;
+        LuaVal text = std::string(1000, 'x');
+        assert(allocations == before + 1 && text.memory_usage() > sizeof(LuaVal) + 1000);
+        LuaVal t(TTABLE);
+        size_t empty = t.memory_usage();
+        for (int i = 1; i <= 100; ++i)
+            t.set(i, i);
+        assert(t.memory_usage() > empty + 100 * 2 * sizeof(LuaVal));
+        t.dumps(); // the serialization cache counts as well
+        size_t cached = t.memory_usage();
+        assert(cached > empty + t.dumps().size());
+
+        // a budget of exactly the memory_usage of the result is enough and one byte less is not
+        std::string message = LuaVal({ "a string longer than the small string buffer", LuaVal({ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 }), 1.5 }).dumps();
+        size_t usage = LuaVal::loads(message).memory_usage();
+        LuaVal::LoadOptions options;
+        options.max_memory = usage;
+        LuaVal v(TNIL);
+        assert(LuaVal::try_loads(message, v, options) && v.memory_usage() == usage);
+        options.max_memory = usage - 1;
+        LuaVal::LoadResult r = LuaVal::try_loads(message, v, options);
+        assert(r.code == LuaVal::LoadResult::MEMORY_LIMIT && v.isnil());
+        std::string err;
+        assert(LuaVal::loads(message, options, &err).isnil() && err == r.message());
+        std::cout << err << std::endl;
+        // many small tables are stopped early, long before the whole message is parsed
+        std::string bomb = "{";
+        for (int i = 0; i < 200000; ++i)
+            bomb += "{},";
+        bomb += "{}}";
+        options.max_memory = 100000;
+        r = LuaVal::try_loads(bomb, v, options);
+        assert(r.code == LuaVal::LoadResult::MEMORY_LIMIT && r.offset < 10000);
+        // compressed input is checked before decompressing
+        LuaVal::DumpOptions compressed;
+        compressed.compress = true;
+        std::string packed = LuaVal({ std::string(1 << 20, 'a') }).dumps(compressed);
+        assert(packed.size() < 10000);
+        r = LuaVal::try_loads(packed, v, options);
+        assert(r.code == LuaVal::LoadResult::MEMORY_LIMIT && r.offset == 0);
+        options.max_memory = 0;
+        assert(LuaVal::try_loads(packed, v, options) && v.get(1).str().size() == 1 << 20);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test checked access" << std::endl;
+        LuaVal t = { 1, "two" };
+        t.set("hp", 50);
+        double d = 0;
+        std::string str;
+        bool b = true;
+        assert(t.get(1).try_num(d) && d == 1);
+        assert(!t.get(2).try_num(d) && d == 1);
+        assert(t.get(2).try_str(str) && str == "two");
+        assert(!t.get(1).try_boolean(b) && b);
+        assert(t.find("hp") && t.find("hp")->num() == 50);
+        assert(!t.find("mp") && !t.find(LuaVal::nil) && !LuaVal(5).find(1));
+        assert(t.get_or("hp", 0) == 50 && t.get_or("mp", 10) == 10 && t.get_or(2, 0.5) == 0.5);
+        assert(t.get_or(2, "none") == "two" && !t.get_or("hp", false));
+        assert(t.get_or(1, LuaVal::nil).num() == 1);
+        assert(!t.try_set(LuaVal::nil, 1) && !LuaVal(5).try_set(1, 1) && t.try_set("mp", 5));
+        assert(!t.try_insert(1, 10) && !t.try_insert(1, "x") && t.try_insert(3, 1) && t.get(1) == 3);
+        assert(!t.try_remove(-1) && t.try_remove(1) && t.len() == 2);
+        assert(!t.try_rem(LuaVal::nil) && t.try_rem("mp") && !t.has("mp"));
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test moving values into tables" << std::endl;
+        std::string text(100, 'x'); // too long for the small string optimization
+        std::vector<LuaVal> parts;
+        for (unsigned int i = 0; i < 100; ++i)
+        {
+            LuaVal part(TTABLE);
+            part.reserve(50);
+            for (unsigned int j = 1; j <= 50; ++j)
+                part.set(j, text);
+            parts.push_back(std::move(part));
+        }
+        LuaVal t(TTABLE);
+        t.reserve(200, 2);
+        size_t before = allocations;
+        // one allocation per table entry, the parts are not copied
+        for (unsigned int i = 0; i < 50; ++i)
+            t.set(i + 1, std::move(parts[i]));
+        t.append_range(std::make_move_iterator(parts.begin() + 50), std::make_move_iterator(parts.end()));
+        assert(allocations - before == 100);
+        assert(t.len() == 100 && t[100].len() == 50 && parts[0].isnil());
+        before = allocations;
+        LuaVal & name = *t.try_emplace("name", LuaVal(text)).first;
+        assert(name.str() == text && !t.try_emplace("name", LuaVal(1)).second && t.try_emplace("id", LuaVal(1)).second);
+        LuaVal merged = LuaVal::mrg(std::move(t), LuaVal({ LuaVal(text) }));
+        assert(merged.get(1).str() == text && merged.get(2).len() == 50);
+        // text copies for name and in mrg, a node for name, id, the mrg table and its node
+        assert(allocations - before <= 8);
+        // a value moved out of a table leaves its key absent
+        LuaVal u = LuaVal({ 1, 2, 3 });
+        LuaVal x = std::move(u[2]);
+        assert(x == 2 && !u.has(2) && u.get(2).isnil());
+        auto added = u.try_emplace(2, 9);
+        assert(added.second && *added.first == 9 && u.get(2) == 9);
+        u[4] = LuaVal::nil;
+        assert(!u.has(4) && u.setignore(4, 8).get(4) == 8 && u.setignore(4, 7).get(4) == 8);
+        // a value can be assigned from inside its own table
+        LuaVal self = LuaVal::loads("{'a':{'b':{1}},'c':2}");
+        self = std::move(self["a"]);
+        assert(self.dumps() == "{\"b\":{1}}");
+        self = self["b"];
+        assert(self.dumps() == "{1}");
+        self = LuaVal::loads("{'a':{'b':2}}");
+        self = self.get("a");
+        assert(self.dumps() == "{\"b\":2}");
+        // inserting at the front moves the other values up
+        LuaVal first(std::vector<std::string>(100, text));
+        before = allocations;
+        merged.insert(std::move(first), 1);
+        assert(allocations - before == 1 && merged.len() == 101 && merged.get(1).len() == 100);
+        // loads moves parsed tables into their parents
+        LuaVal nested(TTABLE);
+        for (int i = 0; i < 100; ++i)
+            nested = LuaVal({ nested });
+        std::string dumped = nested.dumps();
+        before = allocations;
+        LuaVal loaded = LuaVal::loads(dumped);
+        assert(allocations - before < 500);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test key lookups without LuaVal" << std::endl;
+        std::string key(40, 'k'); // too long for the small string optimization
+        LuaVal t(TTABLE);
+        t.set(key, 1).set(2, "two").set(true, "yes").set(0, "zero");
+        size_t before = allocations;
+        // literals, strings and numbers are looked up without creating a LuaVal
+        assert(t.has(key) && t.has(key.c_str()) && t.get(key).num() == 1);
+        assert(t.find("kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk") != nullptr);
+        assert(t.get(2.0).str() == "two" && t.get(2u).str() == "two" && t.get(true).str() == "yes");
+        assert(t.get(-0.0).str() == "zero" && !t.has(2.5) && !t.has("two") && !t.has(false));
+        assert(t.get_or("missing_key_that_is_not_short", 5) == 5);
+        t.rem("missing_key_that_is_not_short");
+        assert(allocations == before);
+        // table keys are compared by identity
+        t.set(LuaVal(TTABLE), "table");
+        for (auto const & e : t.tbl())
+            if (e.first.istable())
+                assert(t.get(e.first).str() == "table");
+        assert(!t.has(LuaVal(TTABLE)));
+        // entries are iterated in insertion order
+        LuaVal order(TTABLE);
+        for (int i = 10; i > 0; --i)
+            order.set(std::to_string(i), i);
+        int expected = 10;
+        for (auto const & e : order.tbl())
+            assert(e.second.num() == expected--);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test ipairs and pairs" << std::endl;
+        LuaVal t(TTABLE);
+        t.set("x", 1).set(3, "c").set(1, "a").set(5, "e").set(2, "b").set("y", 2);
+        t[6] = LuaVal::nil; // stored nil is skipped
+        std::string seq;
+        for (auto const & e : t.ipairs())
+            seq += e.second.str();
+        assert(seq == "abc");
+        std::vector<std::string> keys;
+        for (auto const & e : t.pairs())
+            keys.push_back(e.first.tostring());
+        // the sequence in order and then the rest in insertion order
+        assert((keys == std::vector<std::string>{ "1", "2", "3", "x", "5", "y" }));
+        assert(t.dumps() == "{\"a\",\"b\",\"c\",\"x\":1,5:\"e\",\"y\":2}");
+        LuaVal empty(TTABLE);
+        assert(empty.pairs().begin() == empty.pairs().end() && empty.ipairs().begin() == empty.ipairs().end());
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test stats" << std::endl;
+        static size_t calls = 0;
+        LuaStats::Callback previous = LuaStats::set_callback([](LuaStats const &) { ++calls; });
+        LuaStats::reset_total();
+        LuaVal t = { 1, "two", { 3, { "four" } } };
+        std::string dumped = t.dumps();
+        LuaStats dumps = LuaStats::last();
+        LuaVal loaded = LuaVal::loads(dumped);
+        LuaStats loads = LuaStats::last();
+        if (LuaStats::enabled())
+        {
+            assert(dumps.operation == LuaStats::DUMPS && dumps.bytes == dumped.size());
+            assert(dumps.tables == 3 && dumps.strings == 2 && dumps.numbers == 2 && dumps.max_depth == 3);
+            assert(loads.operation == LuaStats::LOADS && loads.bytes == dumped.size());
+            assert(loads.tables == 3 && loads.strings == 2 && loads.numbers == 2 && loads.max_depth == 3);
+            // 3 tables and 6 entries, small tables have no hash index
+            assert(loads.allocations == 9);
+            assert(LuaStats::total().bytes == 2 * dumped.size() && calls == 2);
+        }
+        else
+            assert(dumps.bytes == 0 && loads.tables == 0 && calls == 0);
+        LuaStats::set_callback(previous);
+        std::cout << std::endl;
+    }
+
+    {
+        std::cout << "test pooling tables" << std::endl;
+        std::string text = LuaVal({ 1, "two", { 3, { "four" } }, { "x", "y" } }).dumps();
+        LuaVal kept(TNIL);
+        {
+            LuaPool pool;
+            LuaVal::loads(text); // fills the pool
+            assert(LuaPool::tables() == 4 && LuaPool::entries() == 9);
+            size_t before = allocations;
+            for (int i = 0; i < 10; ++i)
+            {
+                LuaVal loaded = LuaVal::loads(text);
+                assert(loaded.get(3).get(2).get(1).str() == "four");
+            }
+            // the tables, entries and buckets of the messages are reused
+            assert(allocations == before);
+            {
+                LuaPool nested; // uses the outer pool
+                kept = LuaVal::loads(text);
+                assert(LuaPool::tables() == 0);
+            }
+            assert(LuaPool::entries() == 0);
+        }
+        assert(LuaPool::tables() == 0 && LuaPool::entries() == 0);
+        // values from a pool can outlive it
+        assert(kept.dumps() == text);
+        kept = LuaVal::nil;
+        std::cout << std::endl;
+    }
+
     std::forward_list<std::deque<std::string>> vec = { { "a", "b" },{ "a", "b" } };
     std::unordered_map<std::string, std::string> m;
     m["test"] = "asd";
@@ -1,16 +1,212 @@
 #include "smallfolk.h"
+#include "smallfolk_lz.h"
 #include <map>
-#include <iomanip> // std::setprecision
-#include <sstream> // std::stringstream
 #include <cmath> // std::floor
 #include <stdarg.h> // va_start
 #include <functional> // std::hash
+#include <algorithm> // std::sort
+#include <atomic> // std::atomic
+#include <cstdio> // fopen
+#include <cstring> // std::memchr
+#include <cstdlib> // std::abort
+#ifdef SMALLFOLK_STATS
+#include <chrono> // std::chrono::steady_clock
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <fcntl.h> // open
+#include <unistd.h> // close
+#endif
 
 namespace Serializer
 {
-    typedef std::vector<LuaVal> TABLES;
+    // memory the value being loaded may still use, counted like LuaVal::memory_usage
+    struct BUDGET
+    {
+        explicit BUDGET(size_t max_memory) : left(max_memory ? max_memory : size_t(-1)) {}
+
+        // takes bytes from the budget, returns false if there are not enough left
+        bool take(size_t bytes)
+        {
+            if (bytes > left)
+                return false;
+            left -= bytes;
+            return true;
+        }
+
+        size_t left;
+    };
+
+    // heap memory of a string, short strings are stored in the string object
+    inline size_t heap_bytes(std::string const & s)
+    {
+        std::less<const char *> less;
+        const char * object = reinterpret_cast<const char *>(&s);
+        return !less(s.data(), object) && less(s.data(), object + sizeof(s)) ? 0 : s.capacity() + 1;
+    }
+    // returns true if the decompressed text of the compressed data is longer than options.max_memory
+    inline bool too_long(const char * data, size_t size, LuaVal::LoadOptions const & options)
+    {
+        size_t len;
+        return options.max_memory && SmallfolkLZ::decompressed_size(data, size, len) && len > options.max_memory;
+    }
+    // heap memory of a string created with room for len characters
+    inline size_t heap_bytes(size_t len)
+    {
+        static size_t const inside = std::string().capacity();
+        return len > inside ? len + 1 : 0;
+    }
+
+    // the text being deserialized, it does not need to be nul terminated
+    struct TEXT
+    {
+        TEXT(const char * data, size_t size) : data(data), size(size) {}
+
+        const char * data;
+        size_t size;
+    };
     typedef std::unordered_map<LuaVal, unsigned int, LuaVal::LuaValHasher> MEMO;
-    typedef std::stringstream ACC;
+    // accumulates the serialized output
+    struct ACC
+    {
+        explicit ACC(bool cache = false) : cache(cache), file(nullptr), failed(false), written(0), style(LuaVal::DumpOptions::STANDARD), indent(0), level(0), holes(nullptr) {}
+        explicit ACC(LuaVal::DumpOptions const & options) : cache(options.cache && options.style == LuaVal::DumpOptions::STANDARD), file(nullptr), failed(false), written(0), style(options.style), indent(options.indent), level(0), holes(nullptr) {}
+
+        ACC & operator<<(char c)
+        {
+            str += c;
+            return *this;
+        }
+        ACC & operator<<(std::string const & s)
+        {
+            str += s;
+            return *this;
+        }
+
+        // writes the output to file once there is enough of it
+        void flush(bool full = true)
+        {
+            if (!file || (!full && str.length() < buffer_size))
+                return;
+            // after a failed write the rest of the output is dropped
+            if (!failed && fwrite(str.data(), 1, str.length(), file) != str.length())
+                failed = true;
+            written += str.length();
+            str.clear();
+        }
+
+        // writes the stored serialization of the table if it is used and the table is unchanged
+        bool cached(LuaVal::LuaTable const & tbl)
+        {
+            std::string const * stored = cache ? tbl.cached() : nullptr;
+            if (!stored)
+                return false;
+            size_t start = str.length();
+            str += *stored;
+            if (!file)
+                pending.push_back(Pending{ &tbl, start, str.length() });
+            return true;
+        }
+        // called when the table written since start is closed, after the level is decremented
+        // only the largest tables of at most cache_size bytes are stored, so the tables up to
+        // that size wait in pending until a table around them is too big or the output is done
+        void store(LuaVal::LuaTable const & tbl, size_t start)
+        {
+            if (!cache || file)
+                return;
+            // the tables waiting inside this one
+            size_t inside = pending.size();
+            while (inside && pending[inside - 1].start >= start)
+                --inside;
+            if (str.length() - start <= LuaVal::LuaTable::cache_size)
+            {
+                for (size_t i = inside; i < pending.size(); ++i)
+                    pending[i].tbl->drop();
+                pending.resize(inside);
+                pending.push_back(Pending{ &tbl, start, str.length() });
+            }
+            else
+            {
+                tbl.drop();
+                keep(inside);
+            }
+            if (!level)
+                keep(0);
+        }
+        // stores the pending tables from first on
+        void keep(size_t first)
+        {
+            for (size_t i = first; i < pending.size(); ++i)
+                pending[i].tbl->store(str, pending[i].start, pending[i].end);
+            pending.resize(first);
+        }
+
+        static size_t const buffer_size = 1 << 16;
+
+        std::string str;
+        // use and fill the serialization caches of tables
+        // caches are only used, not filled, when writing to a file
+        bool cache;
+        // tables serialized or reused that may still be stored, in output order
+        struct Pending
+        {
+            LuaVal::LuaTable const * tbl;
+            size_t start;
+            size_t end;
+        };
+        std::vector<Pending> pending;
+        // file to write the output to, all output is kept in str if not set
+        FILE * file;
+        // set when writing to file failed
+        bool failed;
+        // bytes flushed to file
+        size_t written;
+        LuaVal::DumpOptions::Style style;
+        // spaces per level and the current table nesting level with PRETTY
+        unsigned int indent;
+        unsigned int level;
+        // set while preparing a LuaTemplate, hole strings are recorded here instead of written
+        std::vector<LuaTemplate::Hole> * holes;
+    };
+
+    // strings made by LuaTemplate::hole start with this
+    static char const hole_prefix[] = "\x1bSFH";
+    // returns true and sets n if s was made by LuaTemplate::hole(n)
+    bool is_hole(std::string const & s, unsigned int & n);
+
+    // whitespace the parser skips between values, includes newlines for the PRETTY style
+    inline bool is_whitespace(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    // read only memory mapping of a whole file
+    class MappedFile
+    {
+    public:
+        explicit MappedFile(std::string const & path);
+        ~MappedFile();
+
+        const char * data;
+        size_t size;
+        // reason the file could not be mapped or nullptr
+        const char * error;
+
+    private:
+        MappedFile(MappedFile const &) = delete;
+        MappedFile & operator=(MappedFile const &) = delete;
+
+#ifdef _WIN32
+        HANDLE handle;
+        HANDLE mapping;
+#else
+        int fd;
+#endif
+    };
 
     // sprintf is ~50% faster than other solutions
     inline std::string tostring(const double d)
@@ -26,18 +222,117 @@ namespace Serializer
         return arr;
     }
 
+    // appends the formatted error message to errmsg if it is set, returns false
+    bool error(std::string * errmsg, const char * format, ...);
+    std::string vformat(const char * format, va_list args);
+
     unsigned int dump_type_table(LuaVal const & object, unsigned int nmemo, MEMO& memo, ACC& acc);
     unsigned int dump_object(LuaVal const & object, unsigned int nmemo, MEMO& memo, ACC& acc);
-    std::string escape_quotes(const std::string &before, char quote);
-    std::string unescape_quotes(const std::string &before, char quote);
+    void dump_number(double d, ACC& acc);
+    void dump_string(const char * s, size_t len, ACC& acc);
+    inline void dump_string(std::string const & s, ACC& acc) { dump_string(s.data(), s.size(), acc); }
+    void dump_shortest_number(double d, ACC& acc);
+    // starts a new line indented to the current level
+    void newline(ACC& acc);
+    // appends the text with the quotes doubled to out
+    void escape_quotes(const char * before, size_t len, char quote, std::string & out);
+    std::string unescape_quotes(const char * before, size_t len, char quote);
     bool nonzero_digit(char c);
     bool is_digit(char c);
-    char strat(std::string const & string, std::string::size_type i);
-    LuaVal expect_number(std::string const & string, size_t& start);
-    LuaVal expect_object(std::string const & string, size_t& i, TABLES& tables);
+    char strat(TEXT const & string, size_t i);
+    typedef LuaVal::LoadResult RESULT;
+    bool fail(TEXT const & string, size_t at, RESULT::Code code, RESULT& result);
+    // checks the number at start and moves start past it
+    bool scan_number(TEXT const & string, size_t& start, RESULT& result);
+    // moves i from after the opening quote to after the closing quote
+    bool scan_string(TEXT const & string, size_t& i, char quote, RESULT& result);
+    bool expect_number(TEXT const & string, size_t& start, LuaVal& out, RESULT& result);
+    // checks the object at i like expect_object and moves i past it without creating it
+    bool skip_object(TEXT const & string, size_t& i, RESULT& result, unsigned int depth);
+    // skips whitespace and returns the character at i
+    inline char skip_whitespace(TEXT const & string, size_t& i);
+    // depth is the number of tables the object is in
+    bool expect_object(TEXT const & string, size_t& i, BUDGET& budget, LuaVal& out, RESULT& result, unsigned int depth = 0);
+
+#ifdef SMALLFOLK_STATS
+    // stats of the outermost dumps or loads call running on this thread or nullptr
+    thread_local LuaStats * stats = nullptr;
+    thread_local unsigned int depth = 0;
+    thread_local LuaStats last;
+    thread_local LuaStats total;
+    std::atomic<LuaStats::Callback> callback(nullptr);
+
+    // collects the stats of a dumps or loads call, calls nested in it add to the outermost call
+    class StatsCall
+    {
+    public:
+        explicit StatsCall(LuaStats::Operation operation) : outer(!Serializer::stats), start(std::chrono::steady_clock::now())
+        {
+            if (!outer)
+                return;
+            current.operation = operation;
+            Serializer::stats = &current;
+            depth = 0;
+        }
+        ~StatsCall()
+        {
+            if (!outer)
+                return;
+            current.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            Serializer::stats = nullptr;
+            last = current;
+            total.operation = current.operation;
+            total.bytes += current.bytes;
+            total.tables += current.tables;
+            total.strings += current.strings;
+            total.numbers += current.numbers;
+            total.max_depth = std::max(total.max_depth, current.max_depth);
+            total.allocations += current.allocations;
+            total.nanoseconds += current.nanoseconds;
+            if (LuaStats::Callback cb = callback.load(std::memory_order_acquire))
+                cb(last);
+        }
+        // sets the bytes read or written, only the outermost call sets them
+        void bytes(size_t n)
+        {
+            if (outer)
+                current.bytes = n;
+        }
+
+    private:
+        bool outer;
+        LuaStats current;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // counts a table and its depth while the table is serialized or parsed
+    struct StatsTable
+    {
+        StatsTable()
+        {
+            ++depth;
+            if (stats)
+            {
+                ++stats->tables;
+                stats->max_depth = std::max(stats->max_depth, depth);
+            }
+        }
+        ~StatsTable() { --depth; }
+    };
+#define SMALLFOLK_STATS_CALL(operation) Serializer::StatsCall stats_call(operation)
+#define SMALLFOLK_STATS_BYTES(n) stats_call.bytes(n)
+#define SMALLFOLK_STATS_TABLE() Serializer::StatsTable stats_table
+#define SMALLFOLK_STATS_COUNT(field) do { if (Serializer::stats) ++Serializer::stats->field; } while (0)
+#else
+#define SMALLFOLK_STATS_CALL(operation) ((void)0)
+#define SMALLFOLK_STATS_BYTES(n) ((void)0)
+#define SMALLFOLK_STATS_TABLE() ((void)0)
+#define SMALLFOLK_STATS_COUNT(field) ((void)0)
+#endif
 }
 
 LuaVal const LuaVal::nil(TNIL);
+unsigned int const LuaVal::max_load_depth;
 
 std::string LuaVal::tostring() const
 {
@@ -57,7 +352,7 @@ std::string LuaVal::tostring() const
     case TTABLE:
         return Serializer::tostring(tbl_ptr);
     }
-    throw smallfolk_exception("tostring invalid or unhandled tag %i", tag);
+    SMALLFOLK_THROW("tostring invalid or unhandled tag %i", tag);
 }
 
 size_t LuaVal::LuaValHasher::operator()(LuaVal const & v) const
@@ -67,618 +362,4483 @@ size_t LuaVal::LuaValHasher::operator()(LuaVal const & v) const
 
 size_t LuaValHash(LuaVal const & v)
 {
-    switch (v.tag)
+    return LuaKey(v).hash();
+}
+
+size_t LuaKey::hash() const
+{
+    switch (tag)
     {
     case TBOOL:
-        return std::hash<bool>()(v.b);
+        return std::hash<bool>()(b);
     case TNIL:
         return std::hash<int>()(0);
     case TSTRING:
-        return std::hash<std::string>()(v.s);
+        return hash_string(str, len);
     case TNUMBER:
-        return std::hash<double>()(v.d);
+        return hash_number(d);
     case TTABLE:
-        return std::hash<LuaVal::TblPtr>()(v.tbl_ptr);
+        return std::hash<LuaVal::TblPtr>()(val->tbl_ptr);
     }
-    return std::hash<std::string>()(v.tostring());
+    return 0;
 }
 
-LuaVal & LuaVal::operator[](LuaVal const & k)
+size_t LuaKey::hash_string(const char * s, size_t len)
 {
-    if (!istable())
-        throw smallfolk_exception("using [] on non table object");
-    if (k.isnil())
-        throw smallfolk_exception("using [] with nil key");
-    LuaTable & tbl = (*tbl_ptr);
-    return tbl[k];
+    // hashes 8 bytes at a time, the mixing constants are from splitmix64
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+    for (; len >= 8; s += 8, len -= 8)
+    {
+        uint64_t w;
+        std::memcpy(&w, s, 8);
+        h = (h ^ w) * 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+    }
+    uint64_t w = 0;
+    std::memcpy(&w, s, len);
+    h = (h ^ w) * 0x94D049BB133111EBull;
+    h ^= h >> 29;
+    return static_cast<size_t>(h);
 }
 
-LuaVal const & LuaVal::operator[](LuaVal const & k) const
+size_t LuaKey::hash_number(double d)
 {
-    return get(k);
+    if (d == 0)
+        return 0; // 0 and -0 are the same key
+    uint64_t h;
+    std::memcpy(&h, &d, sizeof(h));
+    h = (h ^ (h >> 33)) * 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return static_cast<size_t>(h);
 }
 
-LuaVal const & LuaVal::get(LuaVal const & k) const
+LuaVal LuaKey::value() const
 {
-    if (!istable())
-        throw smallfolk_exception("using get on non table object");
-    if (k.isnil())
-        throw smallfolk_exception("using get with nil key");
-    LuaTable & tbl = (*tbl_ptr);
-    auto it = tbl.find(k);
-    if (it != tbl.end())
-        return it->second;
-    return nil;
+    switch (tag)
+    {
+    case TBOOL:
+        return b;
+    case TNIL:
+        return LuaVal::nil;
+    case TSTRING:
+        return std::string(str, len);
+    case TNUMBER:
+        return d;
+    case TTABLE:
+        return *val;
+    }
+    return LuaVal::nil;
 }
 
-bool LuaVal::has(LuaVal const & k) const
+namespace
 {
-    if (!istable())
-        throw smallfolk_exception("using has on non table object");
-    if (k.isnil())
-        throw smallfolk_exception("using has with nil key");
-    LuaTable & tbl = (*tbl_ptr);
-    auto it = tbl.find(k);
-    return it != tbl.end();
+    // the free lists of the outermost LuaPool on this thread
+    struct Pool
+    {
+        Pool(size_t max_tables, size_t max_entries) : max_tables(max_tables), max_entries(max_entries), guards(0) {}
+
+        std::vector<LuaVal::LuaTable *> tables;
+        std::vector<void *> entries;
+        size_t max_tables;
+        size_t max_entries;
+        unsigned int guards;
+    };
+    thread_local Pool * pool = nullptr;
+
+    // recycled tables with more buckets than this give them up
+    size_t const max_recycled_buckets = 1024;
 }
 
-LuaVal & LuaVal::set(LuaVal const & k, LuaVal const & v)
+LuaPool::LuaPool(size_t max_tables, size_t max_entries)
 {
-    if (!istable())
-        throw smallfolk_exception("using set on non table object");
-    if (k.isnil())
-        throw smallfolk_exception("using set with nil key");
-    LuaTable & tbl = (*tbl_ptr);
-    if (v.isnil()) // on nil value erase key
-        tbl.erase(k);
-    else
-        tbl[k] = v; // normally set pair
-    return *this;
+    if (!pool)
+        pool = new Pool(max_tables, max_entries);
+    ++pool->guards;
 }
 
-LuaVal & LuaVal::setignore(LuaVal const & k, LuaVal const & v)
+LuaPool::~LuaPool()
 {
-    if (!istable())
-        throw smallfolk_exception("using setignore on non table object");
-    if (k.isnil())
-        throw smallfolk_exception("using setignore with nil key");
-    if (v.isnil())
-        return *this;
-    LuaTable & tbl = (*tbl_ptr);
-    tbl.emplace(k, v);
-    return *this;
+    if (--pool->guards)
+        return;
+    // the kept tables are empty, so deleting them does not give anything back to the pool
+    std::unique_ptr<Pool> p(pool);
+    pool = nullptr;
+    for (LuaVal::LuaTable * t : p->tables)
+        delete t;
+    for (void * n : p->entries)
+        ::operator delete(n);
 }
 
-LuaVal & LuaVal::rem(LuaVal const & k)
+size_t LuaPool::tables()
 {
-    if (!istable())
-        throw smallfolk_exception("using rem on non table object");
-    if (k.isnil())
-        throw smallfolk_exception("using set with nil key");
-    LuaTable & tbl = (*tbl_ptr);
-    tbl.erase(k);
-    return *this;
+    return pool ? pool->tables.size() : 0;
 }
 
-unsigned int LuaVal::len() const
+size_t LuaPool::entries()
 {
-    if (!istable())
-        throw smallfolk_exception("using len on non table object");
-    LuaTable & tbl = (*tbl_ptr);
-    unsigned int i = 0;
-    while (++i)
-    {
-        auto it = tbl.find(i);
-        if (it == tbl.end() || it->second.isnil())
-            break;
-    }
-    return i - 1;
+    return pool ? pool->entries.size() : 0;
 }
 
-LuaVal & LuaVal::insert(LuaVal const & v, LuaVal const & pos)
+LuaVal::LuaTable * LuaVal::newtable()
 {
-    if (!istable())
-        throw smallfolk_exception("using insert on non table object");
-    LuaTable & tbl = (*tbl_ptr);
-    if (pos.isnil())
+    if (pool && !pool->tables.empty())
     {
-        if (!v.isnil())
-            tbl[len() + 1] = v;
-        return *this;
+        LuaTable * t = pool->tables.back();
+        pool->tables.pop_back();
+        return t;
     }
-    if (!pos.isnumber())
-        throw smallfolk_exception("using insert with non number pos");
-    if (std::floor(pos.num()) != pos.num())
-        throw smallfolk_exception("using insert with invalid number key");
-    unsigned int max = len() + 1;
-    unsigned int val = static_cast<unsigned int>(pos.num());
-    if (val <= 0 || val > max)
-        throw smallfolk_exception("using insert with out of bounds key");
-    for (unsigned int i = max; i > val; --i)
-        tbl[i] = tbl[i - 1];
-    if (v.isnil())
-        tbl.erase(val);
-    else
-        tbl[val] = v;
-    return *this;
+    SMALLFOLK_STATS_ALLOCATED();
+    return new LuaTable();
 }
 
-LuaVal & LuaVal::remove(LuaVal const & pos)
+LuaVal::LuaTable * LuaVal::newtable(std::unordered_map<LuaVal, LuaVal> const & l)
 {
-    if (!istable())
-        throw smallfolk_exception("using remove on non table object");
-    LuaTable & tbl = (*tbl_ptr);
-    if (pos.isnil())
-    {
-        if (unsigned int i = len())
-            tbl.erase(i);
-        return *this;
-    }
-    if (!pos.isnumber())
-        throw smallfolk_exception("using remove with non number key");
-    if (std::floor(pos.num()) != pos.num())
-        throw smallfolk_exception("using remove with invalid number key");
-    unsigned int max = len();
-    unsigned int val = static_cast<unsigned int>(pos.num());
-    if (val <= 0 || val > max + 1)
-        throw smallfolk_exception("using remove with out of bounds key");
-    for (unsigned int i = val; i < max; ++i)
-        tbl[i] = tbl[i + 1];
-    tbl.erase(max);
-    return *this;
+    LuaTable * t = newtable();
+    t->reserve(l.size());
+    for (auto const & e : l)
+        t->insert(LuaKey(e.first).hash(), e.first, e.second);
+    return t;
 }
 
-std::string LuaVal::type(LuaTypeTag tag)
+LuaVal::LuaTable * LuaVal::copytable(LuaTable const & t)
 {
-    switch (tag)
-    {
-        case TBOOL:
-            return "boolean";
-        case TNIL:
-            return "nil";
-        case TSTRING:
-            return "string";
-        case TNUMBER:
-            return "number";
-        case TTABLE:
-            return "table";
-    }
-    throw smallfolk_exception("tostring invalid or unhandled tag %i", tag);
+    LuaTable * copy = newtable();
+    copy->set_policy(t.table_policy);
+    copy->reserve(t.size());
+    for (LuaTable::Node const * n = t.head; n; n = n->next)
+        copy->insert(n->hash, n->kv.first, n->kv.second);
+    return copy;
 }
 
-std::string LuaVal::dumps(std::string * errmsg) const
+void LuaVal::TblDelete::operator()(LuaTable * t) const
 {
-    try
-    {
-        Serializer::ACC acc;
-        acc << std::setprecision(17); // min lua percision
-        unsigned int nmemo = 0;
-        Serializer::MEMO memo;
-        Serializer::dump_object(*this, nmemo, memo, acc);
-        return acc.str();
-    }
-    catch (smallfolk_exception const & e)
+    if (pool && pool->tables.size() < pool->max_tables)
     {
-        if (errmsg)
-            *errmsg += e.what();
+        t->recycle();
+        pool->tables.push_back(t);
     }
-    return std::string();
+    else
+        delete t;
 }
 
-LuaVal LuaVal::loads(std::string const & string, std::string * errmsg)
+void * LuaVal::LuaTable::node_memory()
 {
-    try
-    {
-        Serializer::TABLES tables;
-        size_t i = 0;
-        return Serializer::expect_object(string, i, tables);
-    }
-    catch (smallfolk_exception const & e)
+    if (pool && !pool->entries.empty())
     {
-        if (errmsg)
-            *errmsg += e.what();
+        void * n = pool->entries.back();
+        pool->entries.pop_back();
+        return n;
     }
-    return LuaVal::nil;
+    SMALLFOLK_STATS_ALLOCATED();
+    return ::operator new(sizeof(Node));
 }
 
-bool LuaVal::operator==(LuaVal const& rhs) const
+void LuaVal::LuaTable::free_node(Node * n)
 {
-    if (tag != rhs.tag)
-        return false;
-    switch (tag)
+    n->~Node();
+    if (pool && pool->entries.size() < pool->max_entries)
+        pool->entries.push_back(n);
+    else
+        ::operator delete(n);
+}
+
+void LuaVal::LuaTable::recycle()
+{
+    clear();
+    // recycled tables are TABLE_AUTO again and keep the index if it is the one TABLE_AUTO grows
+    table_policy = TABLE_AUTO;
+    if (kind != OPEN || slots.size() > max_recycled_buckets)
     {
-    case TBOOL:
-        return b == rhs.b;
-    case TNIL:
-        return true;
-    case TSTRING:
-        return s == rhs.s;
-    case TNUMBER:
-        return d == rhs.d;
-    case TTABLE:
-        return tbl_ptr == rhs.tbl_ptr;
+        std::vector<Slot>().swap(slots);
+        kind = SCAN;
+        shift = 64;
     }
-    throw smallfolk_exception("operator== invalid or unhandled tag %i", tag);
+    std::vector<Node *>().swap(buckets);
+    std::string().swap(cache);
+    parent = nullptr;
+    version = 1;
+    cache_version = 0;
+    hash_version = 0;
 }
 
-LuaVal::operator bool() const
+LuaVal::LuaTable::LuaTable(std::unordered_map<LuaVal, LuaVal> const & m) : LuaTable()
 {
-    return !isnil() && (!isbool() || boolean());
+    reserve(m.size());
+    for (auto const & e : m)
+        insert(LuaKey(e.first).hash(), e.first, e.second);
 }
 
-LuaVal& LuaVal::operator=(LuaVal const& val)
+LuaVal::LuaTable::LuaTable(std::initializer_list<value_type> l) : LuaTable()
 {
-    tag = val.tag;
-    if (istable())
-        tbl_ptr.reset(new LuaTable(*val.tbl_ptr));
-    else
-        tbl_ptr = nullptr;
-    s = val.s;
-    d = val.d;
-    b = val.b;
-    return *this;
+    reserve(l.size());
+    for (auto const & e : l)
+        emplace(e.first, e.second);
 }
 
-unsigned int Serializer::dump_type_table(LuaVal const & object, unsigned int nmemo, MEMO & memo, ACC & acc)
+LuaVal::LuaTable::LuaTable(LuaTable const & t) : LuaTable()
 {
-    if (!object.istable())
-        throw smallfolk_exception("using dump_type_table on non table object");
+    set_policy(t.table_policy);
+    reserve(t.size());
+    for (Node const * n = t.head; n; n = n->next)
+        insert(n->hash, n->kv.first, n->kv.second);
+}
 
-    /*
-    auto it = memo.find(object);
-    if (it != memo.end())
+size_t LuaVal::LuaTable::bucket(size_t hash) const
+{
+    // fibonacci hashing spreads hashes with few differing bits, like table addresses
+    return static_cast<size_t>((static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull) >> shift);
+}
+
+LuaVal::LuaTable::Node * LuaVal::LuaTable::lookup(LuaKey const & k) const
+{
+    if (!entries)
+        return nullptr;
+    switch (kind)
     {
-    acc << '@' << it->second;
-    return nmemo;
-    }
-    memo[object] = ++nmemo;
-    */
-    acc << '{';
-    std::map<unsigned int, const LuaVal*> arr;
-    std::unordered_map<const LuaVal*, const LuaVal*> hash;
-    for (auto&& v : object.tbl())
+    case SCAN:
+        // comparing a few keys is cheaper than hashing the key
+        for (Node * n = head; n; n = n->next)
+            if (k == n->kv.first)
+                return n;
+        return nullptr;
+    case CHAINED:
     {
-        if (v.first.isnumber() && v.first.num() >= 1 && std::floor(v.first.num()) == v.first.num())
-            arr[static_cast<unsigned int>(v.first.num())] = &v.second;
-        else
-            hash[&v.first] = &v.second;
+        size_t hash = k.hash();
+        for (Node * n = buckets[bucket(hash)]; n; n = n->chain)
+            if (n->hash == hash && k == n->kv.first)
+                return n;
+        return nullptr;
     }
-    unsigned int i = 1;
-    for (auto&& v : arr)
+    case OPEN:
     {
-        if (v.first != i)
-        {
-            nmemo = dump_object(v.first, nmemo, memo, acc);
-            acc << ':';
-        }
-        else
-            ++i;
-        nmemo = dump_object(*v.second, nmemo, memo, acc);
-        acc << ',';
+        size_t hash = k.hash();
+        size_t mask = slots.size() - 1;
+        for (size_t i = bucket(hash); slots[i].node; i = (i + 1) & mask)
+            if (slots[i].hash == hash && k == slots[i].node->kv.first)
+                return slots[i].node;
+        return nullptr;
     }
-    for (auto&& v : hash)
+    case SORTED:
     {
-        nmemo = dump_object(*v.first, nmemo, memo, acc);
-        acc << ':';
-        nmemo = dump_object(*v.second, nmemo, memo, acc);
-        acc << ',';
+        // == and not compare, nan is never found like with the other kinds
+        size_t i = lower_bound(k);
+        if (i < buckets.size() && k == buckets[i]->kv.first)
+            return buckets[i];
+        return nullptr;
+    }
     }
-    std::string l = acc.str();
-    char c = strat(l, l.length() - 1);
-    if (c != '{')
+    return nullptr;
+}
+
+size_t LuaVal::LuaTable::lower_bound(LuaKey const & k) const
+{
+    // entries are usually added in order, so check the end first
+    size_t lo = 0;
+    size_t hi = buckets.size();
+    if (hi && k.compare(buckets[hi - 1]->kv.first) > 0)
+        return hi;
+    while (lo < hi)
     {
-        // remove last char
-        l.pop_back();
-        acc.clear();
-        acc.str(std::string());
-        acc << l;
+        size_t mid = lo + (hi - lo) / 2;
+        if (k.compare(buckets[mid]->kv.first) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    acc << '}';
-    return nmemo;
+    return lo;
 }
 
-unsigned int Serializer::dump_object(LuaVal const & object, unsigned int nmemo, MEMO & memo, ACC & acc)
+void LuaVal::LuaTable::link(Node * n)
 {
-    switch (object.typetag())
+    Node * before = nullptr;
+    switch (kind)
     {
-    case TBOOL:
-        acc << (object.boolean() ? 't' : 'f');
-        break;
-    case TNIL:
-        acc << 'n';
+    case SCAN:
+        if (entries < small_size || table_policy != TABLE_AUTO)
+            break;
+        kind = OPEN;
+        rehash(entries + 1);
+        // fall through
+    case OPEN:
+    {
+        // at most 3/4 of the slots are used
+        if ((entries + 1) * 4 > slots.size() * 3)
+            rehash(slots.size() ? slots.size() : 8);
+        size_t mask = slots.size() - 1;
+        size_t i = bucket(n->hash);
+        while (slots[i].node)
+            i = (i + 1) & mask;
+        slots[i].hash = n->hash;
+        slots[i].node = n;
         break;
-    case TSTRING:
-        acc << '"';
-        acc << escape_quotes(object.str(), '"'); // change to std::quote() in c++14?
-        acc << '"';
+    }
+    case CHAINED:
+    {
+        if (entries >= buckets.size())
+            rehash(buckets.empty() ? 8 : buckets.size() * 2);
+        Node *& b = buckets[bucket(n->hash)];
+        n->chain = b;
+        b = n;
         break;
-    case TNUMBER:
-        if (!std::isfinite(object.num()))
-        {
-            // slightly ugly :(
-            std::string nn = tostring(object.num());
-            if (nn == "inf")
-                acc << 'I';
-            else if (nn == "-inf")
-                acc << 'i';
-            else if (nn == "-nan(ind)")
-                acc << 'N';
-            else if (nn == "nan")
-                acc << 'Q';
-            else
-                acc << 'I';
-        }
-        else
-            acc << object.num();
-        break;
-    case TTABLE:
-        return dump_type_table(object, nmemo, memo, acc);
-        break;
-    default:
-        throw smallfolk_exception("dump_object invalid or unhandled tag %i", object.typetag());
+    }
+    case SORTED:
+    {
+        if (buckets.size() == buckets.capacity())
+            SMALLFOLK_STATS_ALLOCATED();
+        size_t i = lower_bound(LuaKey(n->kv.first));
+        if (i < buckets.size())
+            before = buckets[i];
+        buckets.insert(buckets.begin() + i, n);
         break;
     }
-    return nmemo;
-}
-
-std::string Serializer::escape_quotes(const std::string & before, char quote)
-{
-    std::string after;
-    after.reserve(before.length() + 4);
-
-    for (std::string::size_type i = 0; i < before.length(); ++i)
+    }
+    if (before)
     {
-        if (before[i] == quote)
-            after += quote; // no break
+        n->prev = before->prev;
+        n->next = before;
+        if (before->prev)
+            before->prev->next = n;
         else
-            after += before[i];
+            head = n;
+        before->prev = n;
     }
-
-    return after;
+    else
+    {
+        n->prev = tail;
+        if (tail)
+            tail->next = n;
+        else
+            head = n;
+        tail = n;
+    }
+    ++entries;
+    n->kv.second.owner = this;
+    n->kv.second.reparent();
 }
 
-std::string Serializer::unescape_quotes(const std::string & before, char quote)
+void LuaVal::LuaTable::unindex(Node * n)
 {
-    std::string after;
-    after.reserve(before.length());
-
-    for (std::string::size_type i = 0; i < before.length(); ++i)
+    switch (kind)
     {
-        if (before[i] == quote)
+    case SCAN:
+        break;
+    case CHAINED:
+    {
+        Node ** b = &buckets[bucket(n->hash)];
+        while (*b != n)
+            b = &(*b)->chain;
+        *b = n->chain;
+        break;
+    }
+    case OPEN:
+    {
+        size_t mask = slots.size() - 1;
+        size_t i = bucket(n->hash);
+        while (slots[i].node != n)
+            i = (i + 1) & mask;
+        // moves back the following entries that can not be found past the emptied slot
+        for (size_t j = (i + 1) & mask; slots[j].node; j = (j + 1) & mask)
         {
-            if (i + 1 < before.length() && before[i + 1] == quote)
-                ++i;
+            size_t home = bucket(slots[j].hash);
+            if (((j - home) & mask) >= ((j - i) & mask))
+            {
+                slots[i] = slots[j];
+                i = j;
+            }
         }
-        else
-            after += before[i];
+        slots[i].node = nullptr;
+        break;
     }
-
-    return after;
-}
-
-bool Serializer::nonzero_digit(char c)
-{
-    switch (c)
+    case SORTED:
     {
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-        return true;
+        // nan keys compare equal, so the node may be after the lower bound
+        size_t i = lower_bound(LuaKey(n->kv.first));
+        while (buckets[i] != n)
+            ++i;
+        buckets.erase(buckets.begin() + i);
+        break;
+    }
     }
-    return false;
 }
 
-bool Serializer::is_digit(char c)
+void LuaVal::LuaTable::rehash(size_t n)
 {
-    switch (c)
+    if (kind == SCAN)
+        return;
+    if (kind == SORTED)
     {
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-        return true;
+        if (n > buckets.capacity())
+            SMALLFOLK_STATS_ALLOCATED();
+        buckets.reserve(n);
+        return;
     }
-    return false;
-}
-
-char Serializer::strat(std::string const & string, std::string::size_type i)
-{
-    if (i != std::string::npos &&
-        i < string.length())
-        return string.at(i);
-    return '\0'; // bad?
-}
-
-LuaVal Serializer::expect_number(std::string const & string, size_t & start)
-{
-    size_t i = start;
-    char head = strat(string, i);
-    if (head == '-')
-        head = strat(string, ++i);
-    if (nonzero_digit(head))
+    unsigned int bits = 3;
+    if (kind == CHAINED)
     {
-        do
-        {
-            head = strat(string, ++i);
-        } while (is_digit(head));
+        while ((size_t(1) << bits) < n)
+            ++bits;
+        if ((size_t(1) << bits) > buckets.capacity())
+            SMALLFOLK_STATS_ALLOCATED();
+        buckets.assign(size_t(1) << bits, nullptr);
     }
-    else if (head == '0')
-        head = strat(string, ++i);
     else
-        throw smallfolk_exception("expect_number at %u unexpected character %c", i, head);
-    if (head == '.')
     {
-        size_t oldi = i;
-        do
-        {
-            head = strat(string, ++i);
-        } while (is_digit(head));
-        if (i == oldi + 1)
-            throw smallfolk_exception("expect_number at %u no numbers after decimal", i);
+        while ((size_t(1) << bits) * 3 < n * 4)
+            ++bits;
+        if ((size_t(1) << bits) > slots.capacity())
+            SMALLFOLK_STATS_ALLOCATED();
+        Slot empty = { 0, nullptr };
+        slots.assign(size_t(1) << bits, empty);
     }
-    if (head == 'e' || head == 'E')
+    shift = 64 - bits;
+    size_t mask = (size_t(1) << bits) - 1;
+    for (Node * e = head; e; e = e->next)
     {
-        head = strat(string, ++i);
-        if (head == '+' || head == '-')
-            head = strat(string, ++i);
-        if (!is_digit(head))
-            throw smallfolk_exception("expect_number at %u not a digit part %c", i, head);
-        do
+        if (kind == CHAINED)
         {
-            head = strat(string, ++i);
-        } while (is_digit(head));
+            Node *& b = buckets[bucket(e->hash)];
+            e->chain = b;
+            b = e;
+        }
+        else
+        {
+            size_t i = bucket(e->hash);
+            while (slots[i].node)
+                i = (i + 1) & mask;
+            slots[i].hash = e->hash;
+            slots[i].node = e;
+        }
     }
-    size_t temp = start;
-    start = i;
-    return std::atof(string.substr(temp, i).c_str());
 }
 
-LuaVal Serializer::expect_object(std::string const & string, size_t & i, Serializer::TABLES & tables)
+void LuaVal::LuaTable::reserve(size_t n)
 {
-    static double _zero = 0.0;
-
-    char cc = strat(string, i++);
-    switch (cc)
-    {
-    case ' ':
-    case '\t':
-        // skip whitespace
-        return expect_object(string, i, tables);
-    case 't':
-        return true;
-    case 'f':
-        return false;
-    case 'n':
-        return LuaVal::nil;
-    case 'Q':
-        return -(0 / _zero);
-    case 'N':
-        return (0 / _zero);
-    case 'I':
-        return (1 / _zero);
-    case 'i':
-        return -(1 / _zero);
-    case '\'':
-    case '"':
+    switch (kind)
     {
-        size_t nexti = i - 1;
-        do
-        {
-            nexti = string.find(cc, nexti + 1);
-            if (nexti == std::string::npos)
-            {
-                throw smallfolk_exception("expect_object at %u was %c eof before string ends", i, cc);
-            }
-            ++nexti;
-        } while (strat(string, nexti) == cc);
-        size_t temp = i;
-        i = nexti;
-        return unescape_quotes(string.substr(temp, nexti - temp - 1), cc);
+    case SCAN:
+        if (n <= small_size || table_policy != TABLE_AUTO)
+            return;
+        kind = OPEN;
+        rehash(n);
+        break;
+    case CHAINED:
+        if (n > buckets.size())
+            rehash(n);
+        break;
+    case OPEN:
+        if (n * 4 > slots.size() * 3)
+            rehash(n);
+        break;
+    case SORTED:
+        rehash(n);
+        break;
     }
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-    case '-':
-    case '.':
-        return expect_number(string, --i);
-    case '{':
+}
+
+size_t LuaVal::LuaTable::insert_bytes() const
+{
+    // follows link and rehash: the index grows before the insert that would fill it too much
+    // and memory is counted by capacity, so a smaller index reuses the memory of a bigger one
+    size_t index = 0;
+    size_t capacity = 0;
+    size_t slot = sizeof(Slot);
+    switch (kind)
     {
-        LuaVal nt(TTABLE);
-        unsigned int j = 1;
-        tables.push_back(nt);
-        if (strat(string, i) == '}')
+    case SCAN:
+        if (entries >= small_size && table_policy == TABLE_AUTO)
         {
-            ++i;
-            return nt;
+            index = open_size(entries + 1);
+            capacity = slots.capacity();
         }
-        while (true)
+        break;
+    case OPEN:
+        if ((entries + 1) * 4 > slots.size() * 3)
         {
-            LuaVal k = expect_object(string, i, tables);
-            char at = strat(string, i);
-            while (at == ' ')
-                at = strat(string, ++i);
-            if (at == ':')
-            {
-                nt.set(k, expect_object(string, ++i, tables));
-            }
-            else
-            {
-                nt.set(j, k);
-                ++j;
-            }
-            char head = strat(string, i);
-            while (head == ' ')
-                head = strat(string, ++i);
-            if (head == ',')
-                ++i;
-            else if (head == '}')
-            {
-                ++i;
-                return nt;
-            }
-            else
-            {
-                throw smallfolk_exception("expect_object at %u was %c unexpected character %c", i, cc, head);
-            }
+            index = open_size(slots.size() ? slots.size() : 8);
+            capacity = slots.capacity();
+        }
+        break;
+    case CHAINED:
+        if (entries >= buckets.size())
+        {
+            index = buckets.empty() ? 8 : buckets.size() * 2;
+            capacity = buckets.capacity();
+            slot = sizeof(Node *);
+        }
+        break;
+    case SORTED:
+        // the vector of the sorted entries doubles when it is full
+        if (buckets.size() == buckets.capacity())
+        {
+            index = buckets.capacity() ? buckets.capacity() * 2 : 1;
+            capacity = buckets.capacity();
+            slot = sizeof(Node *);
         }
         break;
     }
-    /*
-    case '@':
-    {
-    std::string::size_type x = i;
-    for (; x < string.length(); ++x)
+    return sizeof(Node) + (index > capacity ? (index - capacity) * slot : 0);
+}
+
+size_t LuaVal::LuaTable::open_size(size_t n)
+{
+    size_t size = 8;
+    while (size * 3 < n * 4)
+        size *= 2;
+    return size;
+}
+
+void LuaVal::LuaTable::set_policy(LuaTablePolicy policy)
+{
+    if (policy == table_policy)
+        return;
+    table_policy = policy;
+    std::vector<Node *>().swap(buckets);
+    std::vector<Slot>().swap(slots);
+    switch (policy)
     {
-    if (!isdigit(string[x]))
-    break;
+    case TABLE_AUTO:
+        kind = entries > small_size ? OPEN : SCAN;
+        break;
+    case TABLE_HASH:
+        kind = CHAINED;
+        break;
+    case TABLE_FLAT:
+        kind = OPEN;
+        break;
+    case TABLE_ORDERED:
+        kind = SORTED;
+        sort();
+        return;
     }
-    std::string substr = string.substr(i, x - i);
-    size_t index = std::stoul(substr.c_str());
-    if (index >= 1 && index <= tables.size())
+    if (entries)
+        rehash(entries);
+}
+
+void LuaVal::LuaTable::sort()
+{
+    buckets.reserve(entries);
+    for (Node * n = head; n; n = n->next)
+        buckets.push_back(n);
+    // only nan keys can compare equal
+    std::sort(buckets.begin(), buckets.end(), [](Node const * a, Node const * b) {
+        return LuaKey(a->kv.first).compare(b->kv.first) < 0;
+    });
+    head = tail = nullptr;
+    for (Node * n : buckets)
     {
-    i += substr.length();
-    return tables[index - 1];
+        n->prev = tail;
+        n->next = nullptr;
+        if (tail)
+            tail->next = n;
+        else
+            head = n;
+        tail = n;
     }
+}
 
-    throw smallfolk_exception("expect_object at %u was %c invalid index %u", i, cc, index);
-    break;
-    }
-    */
-    default:
+void LuaVal::LuaTable::store(std::string const & out, size_t start, size_t end) const
+{
+    if (cache_version == version)
+        return;
+    cache.assign(out, start, end - start);
+    cache_version = version;
+}
+
+void LuaVal::LuaTable::drop() const
+{
+    std::string().swap(cache);
+    cache_version = 0;
+}
+
+size_t LuaVal::LuaTable::erase(LuaKey const & k)
+{
+    const_iterator it = find(k);
+    if (it == end())
+        return 0;
+    erase(it);
+    return 1;
+}
+
+LuaVal::LuaTable::iterator LuaVal::LuaTable::erase(const_iterator it)
+{
+    Node * n = const_cast<Node *>(it.node);
+    unindex(n);
+    if (n->prev)
+        n->prev->next = n->next;
+    else
+        head = n->next;
+    if (n->next)
+        n->next->prev = n->prev;
+    else
+        tail = n->prev;
+    Node * next = n->next;
+    --entries;
+    free_node(n);
+    return iterator(next);
+}
+
+void LuaVal::LuaTable::clear()
+{
+    for (Node * n = head; n;)
     {
-        throw smallfolk_exception("expect_object at %u was %c", i, cc);
-        break;
-    }
+        Node * next = n->next;
+        free_node(n);
+        n = next;
     }
-    return LuaVal::nil;
+    head = tail = nullptr;
+    entries = 0;
+    if (kind == SORTED)
+        buckets.clear();
+    else
+        std::fill(buckets.begin(), buckets.end(), nullptr);
+    for (Slot & slot : slots)
+        slot.node = nullptr;
+}
+
+LuaVal & LuaVal::operator[](LuaKey const & k)
+{
+    if (!istable())
+        SMALLFOLK_THROW("using [] on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using [] with nil key");
+    LuaTable & tbl = (*tbl_ptr);
+    // a value changed through the returned reference touches the table itself, only a new key is a change here
+    size_t entries = tbl.size();
+    LuaVal & v = tbl[k];
+    if (tbl.size() != entries)
+        tbl.touch();
+    return v;
+}
+
+LuaVal & LuaVal::index(LuaVal && k)
+{
+    if (!istable())
+        SMALLFOLK_THROW("using [] on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using [] with nil key");
+    LuaTable & tbl = (*tbl_ptr);
+    size_t entries = tbl.size();
+    LuaVal & v = tbl[std::move(k)];
+    if (tbl.size() != entries)
+        tbl.touch();
+    return v;
+}
+
+LuaVal const & LuaVal::operator[](LuaKey const & k) const
+{
+    return get(k);
+}
+
+LuaVal const & LuaVal::get(LuaKey const & k) const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using get on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using get with nil key");
+    LuaTable & tbl = (*tbl_ptr);
+    auto it = tbl.find(k);
+    if (it != tbl.end())
+        return it->second;
+    return nil;
+}
+
+bool LuaVal::has(LuaKey const & k) const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using has on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using has with nil key");
+    LuaTable & tbl = (*tbl_ptr);
+    auto it = tbl.find(k);
+    return it != tbl.end() && !it->second.isnil();
+}
+
+template<typename K, typename V> LuaVal & LuaVal::set_pair(K && k, V && v)
+{
+    if (!istable())
+        SMALLFOLK_THROW("using set on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using set with nil key");
+    LuaTable & tbl = (*tbl_ptr);
+    if (v.isnil()) // on nil value erase key
+        tbl.erase(k);
+    else
+        tbl.slot(std::forward<K>(k)) = std::forward<V>(v); // normally set pair
+    tbl.touch();
+    return *this;
+}
+
+LuaVal & LuaVal::set(LuaVal const & k, LuaVal const & v)
+{
+    return set_pair(k, v);
+}
+
+LuaVal & LuaVal::set(LuaVal const & k, LuaVal && v)
+{
+    return set_pair(k, std::move(v));
+}
+
+LuaVal & LuaVal::set(LuaVal && k, LuaVal const & v)
+{
+    return set_pair(std::move(k), v);
+}
+
+LuaVal & LuaVal::set(LuaVal && k, LuaVal && v)
+{
+    return set_pair(std::move(k), std::move(v));
+}
+
+template<typename K, typename V> LuaVal & LuaVal::setignore_pair(K && k, V && v)
+{
+    if (!istable())
+        SMALLFOLK_THROW("using setignore on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using setignore with nil key");
+    if (v.isnil())
+        return *this;
+    LuaTable & tbl = (*tbl_ptr);
+    LuaVal & slot = tbl.slot(std::forward<K>(k));
+    if (slot.isnil())
+    {
+        slot = std::forward<V>(v);
+        tbl.touch();
+    }
+    return *this;
+}
+
+LuaVal & LuaVal::setignore(LuaVal const & k, LuaVal const & v)
+{
+    return setignore_pair(k, v);
+}
+
+LuaVal & LuaVal::setignore(LuaVal && k, LuaVal && v)
+{
+    return setignore_pair(std::move(k), std::move(v));
+}
+
+std::pair<LuaVal *, bool> LuaVal::try_emplace(LuaVal && k, LuaVal && v)
+{
+    if (!istable() || k.isnil())
+        return std::make_pair(nullptr, false);
+    LuaTable & tbl = (*tbl_ptr);
+    // look up first, the slot would allocate a node for a nil value
+    auto it = tbl.find(k);
+    if (it != tbl.end() && !it->second.isnil())
+        return std::make_pair(&it->second, false);
+    if (v.isnil())
+        return std::make_pair(nullptr, false);
+    LuaVal & slot = it != tbl.end() ? it->second : tbl.slot(std::move(k));
+    slot = std::move(v);
+    tbl.touch();
+    return std::make_pair(&slot, true);
+}
+
+LuaVal & LuaVal::reserve(size_t array_n, size_t hash_n)
+{
+    if (!istable())
+        SMALLFOLK_THROW("using reserve on non table object");
+    // sequence and other entries share the same hash map
+    tbl_ptr->reserve(tbl_ptr->size() + array_n + hash_n);
+    return *this;
+}
+
+LuaVal & LuaVal::set_policy(LuaTablePolicy policy)
+{
+    if (!istable())
+        SMALLFOLK_THROW("using set_policy on non table object");
+    // the order of the entries changes with TABLE_ORDERED
+    tbl_ptr->set_policy(policy);
+    tbl_ptr->touch();
+    return *this;
+}
+
+LuaTablePolicy LuaVal::policy() const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using policy on non table object");
+    return tbl_ptr->policy();
+}
+
+LuaVal & LuaVal::rem(LuaKey const & k)
+{
+    if (!istable())
+        SMALLFOLK_THROW("using rem on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using set with nil key");
+    LuaTable & tbl = (*tbl_ptr);
+    tbl.erase(k);
+    tbl.touch();
+    return *this;
+}
+
+unsigned int LuaVal::len() const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using len on non table object");
+    LuaTable & tbl = (*tbl_ptr);
+    unsigned int i = 0;
+    while (++i)
+    {
+        auto it = tbl.find(i);
+        if (it == tbl.end() || it->second.isnil())
+            break;
+    }
+    return i - 1;
+}
+
+LuaVal & LuaVal::insert(LuaVal const & v, LuaVal const & pos)
+{
+    if (const char * error = insert_checked(v, pos))
+        SMALLFOLK_THROW("%s", error);
+    return *this;
+}
+
+LuaVal & LuaVal::insert(LuaVal && v, LuaVal const & pos)
+{
+    if (const char * error = insert_checked(std::move(v), pos))
+        SMALLFOLK_THROW("%s", error);
+    return *this;
+}
+
+LuaVal & LuaVal::remove(LuaVal const & pos)
+{
+    if (const char * error = remove_checked(pos))
+        SMALLFOLK_THROW("%s", error);
+    return *this;
+}
+
+template<typename V> const char * LuaVal::insert_checked(V && v, LuaVal const & pos)
+{
+    if (!istable())
+        return "using insert on non table object";
+    LuaTable & tbl = (*tbl_ptr);
+    if (pos.isnil())
+    {
+        tbl.touch();
+        if (!v.isnil())
+            tbl.slot(len() + 1) = std::forward<V>(v);
+        return nullptr;
+    }
+    if (!pos.isnumber())
+        return "using insert with non number pos";
+    if (std::floor(pos.num()) != pos.num())
+        return "using insert with invalid number key";
+    unsigned int max = len() + 1;
+    unsigned int val = static_cast<unsigned int>(pos.num());
+    if (val <= 0 || val > max)
+        return "using insert with out of bounds key";
+    tbl.touch();
+    for (unsigned int i = max; i > val; --i)
+        tbl.slot(i) = std::move(tbl[i - 1]);
+    if (v.isnil())
+        tbl.erase(val);
+    else
+        tbl.slot(val) = std::forward<V>(v);
+    return nullptr;
+}
+
+const char * LuaVal::remove_checked(LuaVal const & pos)
+{
+    if (!istable())
+        return "using remove on non table object";
+    LuaTable & tbl = (*tbl_ptr);
+    if (pos.isnil())
+    {
+        tbl.touch();
+        if (unsigned int i = len())
+            tbl.erase(i);
+        return nullptr;
+    }
+    if (!pos.isnumber())
+        return "using remove with non number key";
+    if (std::floor(pos.num()) != pos.num())
+        return "using remove with invalid number key";
+    unsigned int max = len();
+    unsigned int val = static_cast<unsigned int>(pos.num());
+    if (val <= 0 || val > max + 1)
+        return "using remove with out of bounds key";
+    tbl.touch();
+    for (unsigned int i = val; i < max; ++i)
+        tbl[i] = std::move(tbl[i + 1]);
+    tbl.erase(max);
+    return nullptr;
+}
+
+LuaVal const * LuaVal::find(LuaKey const & k) const
+{
+    if (!istable() || k.isnil())
+        return nullptr;
+    LuaTable & tbl = (*tbl_ptr);
+    auto it = tbl.find(k);
+    if (it != tbl.end())
+        return &it->second;
+    return nullptr;
+}
+
+LuaVal * LuaVal::find(LuaKey const & k)
+{
+    return const_cast<LuaVal *>(static_cast<LuaVal const &>(*this).find(k));
+}
+
+LuaVal const & LuaVal::get_or(LuaKey const & k, LuaVal const & def) const
+{
+    LuaVal const * v = find(k);
+    return v && (def.isnil() || v->tag == def.tag) ? *v : def;
+}
+
+std::string LuaVal::get_or(LuaKey const & k, std::string const & def) const
+{
+    LuaVal const * v = find(k);
+    return v && v->isstring() ? v->s : def;
+}
+
+std::string LuaVal::get_or(LuaKey const & k, const char * def) const
+{
+    LuaVal const * v = find(k);
+    return v && v->isstring() ? v->s : std::string(def);
+}
+
+bool LuaVal::get_or(LuaKey const & k, bool def) const
+{
+    LuaVal const * v = find(k);
+    return v && v->isbool() ? v->b : def;
+}
+
+bool LuaVal::try_set(LuaVal const & k, LuaVal const & v)
+{
+    if (!istable() || k.isnil())
+        return false;
+    set(k, v);
+    return true;
+}
+
+bool LuaVal::try_rem(LuaKey const & k)
+{
+    if (!istable() || k.isnil())
+        return false;
+    rem(k);
+    return true;
+}
+
+bool LuaVal::try_insert(LuaVal const & v, LuaVal const & pos)
+{
+    return !insert_checked(v, pos);
+}
+
+bool LuaVal::try_insert(LuaVal && v, LuaVal const & pos)
+{
+    return !insert_checked(std::move(v), pos);
+}
+
+bool LuaVal::try_remove(LuaVal const & pos)
+{
+    return !remove_checked(pos);
+}
+
+std::string LuaVal::type(LuaTypeTag tag)
+{
+    switch (tag)
+    {
+        case TBOOL:
+            return "boolean";
+        case TNIL:
+            return "nil";
+        case TSTRING:
+            return "string";
+        case TNUMBER:
+            return "number";
+        case TTABLE:
+            return "table";
+    }
+    SMALLFOLK_THROW("tostring invalid or unhandled tag %i", tag);
+}
+
+std::string LuaVal::dumps(std::string * errmsg) const
+{
+    return dumps(DumpOptions(), errmsg);
+}
+
+std::string LuaVal::dumps(DumpOptions const & options, std::string *) const
+{
+    // every value can be serialized, errors are only possible with invalid type tags
+    SMALLFOLK_STATS_CALL(LuaStats::DUMPS);
+    Serializer::ACC acc(options);
+    unsigned int nmemo = 0;
+    Serializer::MEMO memo;
+    Serializer::dump_object(*this, nmemo, memo, acc);
+    if (options.compress)
+    {
+        std::string compressed = SmallfolkLZ::compress(acc.str.data(), acc.str.size());
+        SMALLFOLK_STATS_BYTES(compressed.size());
+        return compressed;
+    }
+    SMALLFOLK_STATS_BYTES(acc.str.size());
+    return std::move(acc.str);
+}
+
+LuaVal LuaVal::loads(std::string const & string, std::string * errmsg)
+{
+    return loads(string.data(), string.size(), errmsg);
+}
+
+LuaVal LuaVal::loads(const char * data, size_t size, std::string * errmsg)
+{
+    return loads(data, size, LoadOptions(), errmsg);
+}
+
+LuaVal LuaVal::loads(std::string const & string, LoadOptions const & options, std::string * errmsg)
+{
+    return loads(string.data(), string.size(), options, errmsg);
+}
+
+LuaVal LuaVal::loads(const char * data, size_t size, LoadOptions const & options, std::string * errmsg)
+{
+    SMALLFOLK_STATS_CALL(LuaStats::LOADS);
+    SMALLFOLK_STATS_BYTES(size);
+    if (SmallfolkLZ::is_compressed(data, size) && !Serializer::too_long(data, size, options))
+    {
+        // decompress here to get the detailed error message
+        std::string text;
+        if (!SmallfolkLZ::decompress(data, size, text, errmsg))
+            return LuaVal::nil;
+        return loads(text, options, errmsg);
+    }
+    LuaVal out(TNIL);
+    LoadResult result = try_loads(data, size, out, options);
+    if (!result && errmsg)
+        *errmsg += result.message();
+    return out;
+}
+
+LuaVal::LoadResult LuaVal::try_loads(std::string const & string, LuaVal & out)
+{
+    return try_loads(string.data(), string.size(), out, LoadOptions());
+}
+
+LuaVal::LoadResult LuaVal::try_loads(const char * data, size_t size, LuaVal & out)
+{
+    return try_loads(data, size, out, LoadOptions());
+}
+
+LuaVal::LoadResult LuaVal::try_loads(std::string const & string, LuaVal & out, LoadOptions const & options)
+{
+    return try_loads(string.data(), string.size(), out, options);
+}
+
+LuaVal::LoadResult LuaVal::try_loads(const char * data, size_t size, LuaVal & out, LoadOptions const & options)
+{
+    SMALLFOLK_STATS_CALL(LuaStats::LOADS);
+    SMALLFOLK_STATS_BYTES(size);
+    LoadResult result;
+    if (SmallfolkLZ::is_compressed(data, size))
+    {
+        std::string text;
+        if (Serializer::too_long(data, size, options))
+            result.code = LoadResult::MEMORY_LIMIT;
+        else if (SmallfolkLZ::decompress(data, size, text))
+            return try_loads(text.data(), text.size(), out, options);
+        else
+            result.code = LoadResult::INVALID_COMPRESSION;
+        out = nil;
+        return result;
+    }
+    Serializer::BUDGET budget(options.max_memory);
+    size_t i = 0;
+    if (!budget.take(sizeof(LuaVal)))
+        Serializer::fail(Serializer::TEXT(data, size), i, LoadResult::MEMORY_LIMIT, result);
+    if (!result || !Serializer::expect_object(Serializer::TEXT(data, size), i, budget, out, result))
+        out = nil;
+    return result;
+}
+
+std::string LuaVal::LoadResult::message() const
+{
+    const char * what = "";
+    switch (code)
+    {
+    case OK:
+        return std::string();
+    case UNEXPECTED_CHARACTER:
+        what = "unexpected character";
+        break;
+    case UNEXPECTED_TABLE_CHARACTER:
+        what = "expected , or } but found";
+        break;
+    case EOF_IN_STRING:
+        what = "eof before string ends";
+        break;
+    case INVALID_NUMBER:
+        what = "invalid number";
+        break;
+    case NO_DECIMALS:
+        what = "no numbers after decimal";
+        break;
+    case INVALID_EXPONENT:
+        what = "not a digit in exponent";
+        break;
+    case NIL_KEY:
+        what = "nil table key";
+        break;
+    case INVALID_COMPRESSION:
+        return "Smallfolk: loads invalid compressed data";
+    case TOO_DEEP:
+        what = "tables nested too deep";
+        break;
+    case MEMORY_LIMIT:
+        what = "memory limit exceeded";
+        break;
+    }
+    char buffer[128];
+    if (code == EOF_IN_STRING || code == NO_DECIMALS || code == NIL_KEY || code == TOO_DEEP || code == MEMORY_LIMIT)
+        snprintf(buffer, sizeof(buffer), "Smallfolk: loads at %u %s", static_cast<unsigned int>(offset), what);
+    else if (found)
+        snprintf(buffer, sizeof(buffer), "Smallfolk: loads at %u %s %c", static_cast<unsigned int>(offset), what, found);
+    else
+        snprintf(buffer, sizeof(buffer), "Smallfolk: loads at %u %s eof", static_cast<unsigned int>(offset), what);
+    return buffer;
+}
+
+LuaVal LuaVal::load_file(std::string const & path, std::string * errmsg)
+{
+    return load_file(path, LoadOptions(), errmsg);
+}
+
+LuaVal LuaVal::load_file(std::string const & path, LoadOptions const & options, std::string * errmsg)
+{
+    Serializer::MappedFile file(path);
+    if (file.error)
+    {
+        Serializer::error(errmsg, "load_file %s %s", file.error, path.c_str());
+        return LuaVal::nil;
+    }
+    return loads(file.data, file.size, options, errmsg);
+}
+
+bool LuaVal::save_file(std::string const & path, DumpOptions const & options, std::string * errmsg) const
+{
+    SMALLFOLK_STATS_CALL(LuaStats::DUMPS);
+    std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(path.c_str(), "wb"), fclose);
+    if (!file)
+        return Serializer::error(errmsg, "save_file could not open %s", path.c_str());
+    if (options.compress)
+    {
+        // the compressor needs the whole serialization
+        std::string compressed = dumps(options);
+        SMALLFOLK_STATS_BYTES(compressed.size());
+        if (fwrite(compressed.data(), 1, compressed.size(), file.get()) != compressed.size())
+            return Serializer::error(errmsg, "save_file could not write %s", path.c_str());
+    }
+    else
+    {
+        Serializer::ACC acc(options);
+        acc.file = file.get();
+        acc.str.reserve(Serializer::ACC::buffer_size * 2);
+        unsigned int nmemo = 0;
+        Serializer::MEMO memo;
+        Serializer::dump_object(*this, nmemo, memo, acc);
+        SMALLFOLK_STATS_BYTES(acc.written + acc.str.size());
+        acc.flush();
+        if (acc.failed)
+            return Serializer::error(errmsg, "save_file could not write %s", path.c_str());
+    }
+    if (fclose(file.release()) != 0)
+        return Serializer::error(errmsg, "save_file could not write %s", path.c_str());
+    return true;
+}
+
+bool LuaVal::save_file(std::string const & path, std::string * errmsg) const
+{
+    return save_file(path, DumpOptions(), errmsg);
+}
+
+bool LuaVal::operator==(LuaVal const& rhs) const
+{
+    if (tag != rhs.tag)
+        return false;
+    switch (tag)
+    {
+    case TBOOL:
+        return b == rhs.b;
+    case TNIL:
+        return true;
+    case TSTRING:
+        return s == rhs.s;
+    case TNUMBER:
+        return d == rhs.d;
+    case TTABLE:
+        return tbl_ptr == rhs.tbl_ptr;
+    }
+    SMALLFOLK_THROW("operator== invalid or unhandled tag %i", tag);
+}
+
+bool LuaVal::deep_equals(LuaVal const & v) const
+{
+    // nan values are equal so that equal content is equal
+    if (tag == TNUMBER && v.tag == TNUMBER && d != d && v.d != v.d)
+        return true;
+    if (tag != TTABLE || v.tag != TTABLE)
+        return *this == v;
+    LuaTable const & l = *tbl_ptr;
+    LuaTable const & r = *v.tbl_ptr;
+    if (&l == &r)
+        return true;
+    // stored hashes that differ tell the tables apart without visiting them
+    if (l.hash_version == l.version && r.hash_version == r.version && l.hash != r.hash)
+        return false;
+    size_t count = 0;
+    // table and nan keys can not be looked up by content,
+    // entries of r with them are matched to the entries of l one by one
+    auto bycontent = [](LuaVal const & k) { return k.istable() || (k.isnumber() && k.d != k.d); };
+    std::vector<std::pair<LuaTable::value_type const *, bool>> tablekeys;
+    bool collected = false;
+    for (auto const & e : l)
+    {
+        if (e.second.isnil())
+            continue;
+        ++count;
+        if (!bycontent(e.first))
+        {
+            LuaTable::const_iterator it = r.find(e.first);
+            if (it == r.end() || !e.second.deep_equals(it->second))
+                return false;
+            continue;
+        }
+        if (!collected)
+        {
+            for (auto const & o : r)
+                if (bycontent(o.first) && !o.second.isnil())
+                    tablekeys.push_back(std::make_pair(&o, false));
+            collected = true;
+        }
+        bool found = false;
+        for (auto & o : tablekeys)
+        {
+            if (!o.second && e.first.deep_equals(o.first->first) && e.second.deep_equals(o.first->second))
+            {
+                o.second = found = true;
+                break;
+            }
+        }
+        if (!found)
+            return false;
+    }
+    for (auto const & e : r)
+        if (!e.second.isnil() && count-- == 0)
+            return false;
+    return count == 0;
+}
+
+namespace
+{
+    // splitmix64 finalizer
+    size_t mix(uint64_t h)
+    {
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+        return static_cast<size_t>(h ^ (h >> 31));
+    }
+}
+
+size_t LuaVal::content_hash() const
+{
+    if (tag == TNUMBER && d != d)
+        return mix(TNUMBER); // all nans are deep_equals
+    if (tag != TTABLE)
+        return LuaKey(*this).hash();
+    LuaTable const & t = *tbl_ptr;
+    if (t.hash_version == t.version)
+        return t.hash;
+    // the pairs are summed so their order does not matter
+    uint64_t sum = 0;
+    uint64_t count = 0;
+    for (auto const & e : t)
+    {
+        if (e.second.isnil())
+            continue;
+        ++count;
+        sum += mix(e.first.content_hash() ^ mix(e.second.content_hash() + 0x9E3779B97F4A7C15ull));
+    }
+    t.hash = mix(sum ^ mix(count + TTABLE));
+    t.hash_version = t.version;
+    return t.hash;
+}
+
+size_t LuaVal::memory_usage() const
+{
+    return sizeof(LuaVal) + heap_usage();
+}
+
+size_t LuaVal::heap_usage() const
+{
+    size_t bytes = Serializer::heap_bytes(s);
+    if (tag != TTABLE || !tbl_ptr)
+        return bytes;
+    LuaTable const & t = *tbl_ptr;
+    bytes += sizeof(LuaTable) + t.buckets.capacity() * sizeof(LuaTable::Node *) + t.slots.capacity() * sizeof(LuaTable::Slot) + Serializer::heap_bytes(t.cache);
+    for (LuaTable::Node const * n = t.head; n; n = n->next)
+        bytes += sizeof(LuaTable::Node) + n->kv.first.heap_usage() + n->kv.second.heap_usage();
+    return bytes;
+}
+
+LuaVal::operator bool() const
+{
+    return !isnil() && (!isbool() || boolean());
+}
+
+LuaVal& LuaVal::operator=(LuaVal const& val)
+{
+    // copied before anything is released, val can be inside the table this value drops like in v = v["a"]
+    return *this = LuaVal(val);
+}
+
+LuaVal& LuaVal::operator=(LuaVal && val)
+{
+    if (this == &val)
+        return *this;
+    // moved out first, val can be inside the table this value drops like in v = std::move(v["a"])
+    LuaVal tmp(std::move(val));
+    tag = tmp.tag;
+    tbl_ptr = std::move(tmp.tbl_ptr);
+    s = std::move(tmp.s);
+    d = tmp.d;
+    b = tmp.b;
+    reparent();
+    if (owner)
+        owner->touch();
+    return *this;
+}
+
+LuaVal LuaVal::mrg(LuaVal const & l, LuaVal const & r)
+{
+    LuaVal t = l;
+    for (auto const & v : r.tbl())
+        t[v.first] = v.second;
+    return t;
+}
+
+LuaVal LuaVal::mrg(LuaVal&& l, LuaVal const & r)
+{
+    for (auto const & v : r.tbl())
+        l[v.first] = v.second;
+    return std::move(l);
+}
+
+LuaVal LuaVal::mrg(LuaVal&& l, LuaVal&& r)
+{
+    if (!l.istable() || !r.istable())
+        SMALLFOLK_THROW("using mrg on non table object");
+    for (auto & v : *r.tbl_ptr)
+        l.slot(v.first) = std::move(v.second);
+    l.tbl_ptr->touch();
+    return std::move(l);
+}
+
+LuaVal LuaVal::mrg(LuaVal const & l, LuaVal&& r)
+{
+    for (auto const & v : l.tbl())
+        r.setignore(v.first, v.second);
+    return std::move(r);
+}
+
+namespace
+{
+    // like == but nan equals nan so that unchanged nan values are not in patches
+    bool same_value(LuaVal const & a, LuaVal const & b)
+    {
+        if (a.isnumber() && b.isnumber() && std::isnan(a.num()) && std::isnan(b.num()))
+            return std::signbit(a.num()) == std::signbit(b.num());
+        return a == b;
+    }
+}
+
+LuaVal LuaVal::diff(LuaVal const & from, LuaVal const & to)
+{
+    if (!from.istable() || !to.istable())
+        SMALLFOLK_THROW("using diff on non table object");
+    LuaTable const & a = from.tbl();
+    LuaTable const & b = to.tbl();
+    LuaVal delta(TTABLE);
+    LuaVal sets(TTABLE);
+    LuaVal removed(TTABLE);
+    LuaVal patches(TTABLE);
+    for (auto const & e : b)
+    {
+        if (e.second.isnil())
+            continue;
+        auto it = a.find(e.first);
+        if (it == a.end() || it->second.isnil())
+            sets.slot(e.first) = e.second;
+        else if (it->second.istable() && e.second.istable())
+        {
+            LuaVal sub = diff(it->second, e.second);
+            if (!sub.tbl().empty())
+                patches.slot(e.first) = std::move(sub);
+        }
+        else if (!same_value(it->second, e.second))
+            sets.slot(e.first) = e.second;
+    }
+    unsigned int nremoved = 0;
+    for (auto const & e : a)
+    {
+        if (e.second.isnil())
+            continue;
+        auto it = b.find(e.first);
+        if (it == b.end() || it->second.isnil())
+            removed.slot(++nremoved) = e.first;
+    }
+    if (!sets.tbl().empty())
+        delta.slot("s") = std::move(sets);
+    if (nremoved)
+        delta.slot("r") = std::move(removed);
+    if (!patches.tbl().empty())
+        delta.slot("d") = std::move(patches);
+    return delta;
+}
+
+LuaVal & LuaVal::patch(LuaVal & base, LuaVal const & delta)
+{
+    if (!base.istable() || !delta.istable())
+        SMALLFOLK_THROW("using patch on non table object");
+    LuaVal const & removed = delta.get("r");
+    if (removed.istable())
+        for (auto const & e : removed.tbl())
+            base.rem(e.second);
+    LuaVal const & sets = delta.get("s");
+    if (sets.istable())
+        for (auto const & e : sets.tbl())
+            base.set(e.first, e.second);
+    LuaVal const & patches = delta.get("d");
+    if (patches.istable())
+    {
+        for (auto const & e : patches.tbl())
+        {
+            LuaVal & t = base[e.first];
+            if (!t.istable())
+                t = LuaVal(TTABLE);
+            patch(t, e.second);
+        }
+    }
+    return base;
+}
+
+LuaVal & LuaVal::patch(LuaVal & base, LuaVal && delta)
+{
+    if (!base.istable() || !delta.istable())
+        SMALLFOLK_THROW("using patch on non table object");
+    LuaVal const & removed = delta.get("r");
+    if (removed.istable())
+        for (auto const & e : removed.tbl())
+            base.rem(e.second);
+    // the values of the patch are moved to base instead of copying them
+    LuaTable & tbl = *delta.tbl_ptr;
+    auto sets = tbl.find("s");
+    if (sets != tbl.end() && sets->second.istable())
+    {
+        for (auto & e : *sets->second.tbl_ptr)
+        {
+            if (e.first.isnil())
+                SMALLFOLK_THROW("using patch with nil key");
+            if (e.second.isnil())
+                base.rem(e.first);
+            else
+                base[e.first] = std::move(e.second);
+        }
+    }
+    auto patches = tbl.find("d");
+    if (patches != tbl.end() && patches->second.istable())
+    {
+        for (auto & e : *patches->second.tbl_ptr)
+        {
+            LuaVal & t = base[e.first];
+            if (!t.istable())
+                t = LuaVal(TTABLE);
+            patch(t, std::move(e.second));
+        }
+    }
+    return base;
+}
+
+LuaVal & LuaVal::slot(LuaVal const & k)
+{
+    return tbl_ptr->slot(k);
+}
+
+struct LuaFrozen::Snapshot
+{
+    struct Node
+    {
+        LuaTypeTag tag;
+        bool b;
+        double d;
+        std::string s;
+        unsigned int first; // index of the first key-value pair in slots
+        unsigned int count; // number of key-value pairs
+        unsigned int narr; // pairs 0..narr-1 have the keys 1..narr
+    };
+
+    typedef std::pair<const LuaVal*, const LuaVal*> Pair;
+
+    ~Snapshot()
+    {
+        if (bytes)
+            for (size_t i = 0; i < nodes.size(); ++i)
+                delete bytes[i].load();
+    }
+
+    // the key order of LuaKey::compare, tables are ordered last and never equal to a node
+    static int compare(LuaKey const & a, Node const & b)
+    {
+        switch (b.tag)
+        {
+        case TBOOL:
+            return a.compare(LuaKey(b.b));
+        case TSTRING:
+            return a.compare(LuaKey(b.s));
+        case TNUMBER:
+            return a.compare(LuaKey(b.d));
+        default:
+            return -1;
+        }
+    }
+
+    static bool is_index(LuaVal const & k, unsigned int narr)
+    {
+        return k.isnumber() && k.num() >= 1 && k.num() <= narr && std::floor(k.num()) == k.num();
+    }
+
+    unsigned int add(LuaVal const & v)
+    {
+        unsigned int index = static_cast<unsigned int>(nodes.size());
+        nodes.push_back(Node());
+        Node & n = nodes.back();
+        n.tag = v.typetag();
+        n.b = false;
+        n.d = 0;
+        n.first = 0;
+        n.count = 0;
+        n.narr = 0;
+        switch (v.typetag())
+        {
+        case TBOOL:
+            n.b = v.boolean();
+            break;
+        case TNIL:
+            break;
+        case TSTRING:
+            n.s = v.str();
+            break;
+        case TNUMBER:
+            n.d = v.num();
+            break;
+        case TTABLE:
+        {
+            unsigned int narr = v.len();
+            std::vector<Pair> rest;
+            rest.reserve(v.tbl().size() - narr);
+            for (auto const & e : v.tbl())
+                if (!e.second.isnil() && !is_index(e.first, narr))
+                    rest.push_back(Pair(&e.first, &e.second));
+            std::sort(rest.begin(), rest.end(), [](Pair const & l, Pair const & r) { return LuaKey(*l.first).compare(*r.first) < 0; });
+
+            // reserve the pairs before adding the children so that they are contiguous
+            unsigned int first = static_cast<unsigned int>(slots.size());
+            unsigned int count = narr + static_cast<unsigned int>(rest.size());
+            slots.resize(slots.size() + 2 * count);
+            // add may reallocate slots, so the results are stored only after it returns
+            for (unsigned int i = 0; i < count; ++i)
+            {
+                unsigned int k = i < narr ? add(i + 1) : add(*rest[i - narr].first);
+                slots[first + 2 * i] = k;
+                unsigned int val = i < narr ? add(v.get(i + 1)) : add(*rest[i - narr].second);
+                slots[first + 2 * i + 1] = val;
+            }
+            // n is invalidated by adding the children
+            nodes[index].first = first;
+            nodes[index].count = count;
+            nodes[index].narr = narr;
+            break;
+        }
+        }
+        return index;
+    }
+
+    void dump(unsigned int index, Serializer::ACC & acc) const
+    {
+        Node const & n = nodes[index];
+        switch (n.tag)
+        {
+        case TBOOL:
+            acc << (n.b ? 't' : 'f');
+            break;
+        case TNIL:
+            acc << 'n';
+            break;
+        case TSTRING:
+            Serializer::dump_string(n.s, acc);
+            break;
+        case TNUMBER:
+            Serializer::dump_number(n.d, acc);
+            break;
+        case TTABLE:
+            acc << '{';
+            for (unsigned int i = 0; i < n.count; ++i)
+            {
+                if (i)
+                    acc << ',';
+                if (i >= n.narr)
+                {
+                    dump(slots[n.first + 2 * i], acc);
+                    acc << ':';
+                }
+                dump(slots[n.first + 2 * i + 1], acc);
+            }
+            acc << '}';
+            break;
+        }
+    }
+
+    LuaVal thaw(unsigned int index) const
+    {
+        Node const & n = nodes[index];
+        switch (n.tag)
+        {
+        case TBOOL:
+            return n.b;
+        case TNIL:
+            return LuaVal::nil;
+        case TSTRING:
+            return n.s;
+        case TNUMBER:
+            return n.d;
+        case TTABLE:
+        {
+            LuaVal t(TTABLE);
+            for (unsigned int i = 0; i < n.count; ++i)
+                t.set(thaw(slots[n.first + 2 * i]), thaw(slots[n.first + 2 * i + 1]));
+            return t;
+        }
+        }
+        SMALLFOLK_THROW("thaw invalid or unhandled tag %i", n.tag);
+    }
+
+    std::vector<Node> nodes; // nodes[0] is the root
+    std::vector<unsigned int> slots; // key and value node indexes of all table pairs
+    std::unique_ptr<std::atomic<std::string const *>[]> bytes; // serialized nodes, created on demand
+};
+
+LuaFrozen LuaVal::freeze() const
+{
+    std::shared_ptr<LuaFrozen::Snapshot> snap(new LuaFrozen::Snapshot());
+    snap->add(*this);
+    snap->nodes.shrink_to_fit();
+    snap->slots.shrink_to_fit();
+    snap->bytes.reset(new std::atomic<std::string const *>[snap->nodes.size()]());
+    return LuaFrozen(snap, 0);
+}
+
+LuaFrozen::LuaFrozen() : index(0)
+{
+}
+
+LuaTypeTag LuaFrozen::typetag() const
+{
+    if (!snap)
+        return TNIL;
+    return snap->nodes[index].tag;
+}
+
+std::string LuaFrozen::tostring() const
+{
+    switch (typetag())
+    {
+    case TBOOL:
+        if (boolean())
+            return "true";
+        else
+            return "false";
+    case TNIL:
+        return "nil";
+    case TSTRING:
+        return str();
+    case TNUMBER:
+        return Serializer::tostring(num());
+    case TTABLE:
+    {
+        char arr[128];
+        sprintf(arr, "table: %p", static_cast<void const *>(&snap->nodes[index]));
+        return arr;
+    }
+    }
+    SMALLFOLK_THROW("tostring invalid or unhandled tag %i", typetag());
+}
+
+double LuaFrozen::num() const
+{
+    if (!isnumber())
+        SMALLFOLK_THROW("using num on non number object");
+    return snap->nodes[index].d;
+}
+
+bool LuaFrozen::boolean() const
+{
+    if (!isbool())
+        SMALLFOLK_THROW("using boolean on non bool object");
+    return snap->nodes[index].b;
+}
+
+std::string const & LuaFrozen::str() const
+{
+    if (!isstring())
+        SMALLFOLK_THROW("using str on non string object");
+    return snap->nodes[index].s;
+}
+
+int LuaFrozen::find(LuaKey const & k) const
+{
+    Snapshot::Node const & n = snap->nodes[index];
+    if (k.tag == TNUMBER && k.d >= 1 && k.d <= n.narr && std::floor(k.d) == k.d)
+        return static_cast<int>(k.d) - 1;
+    // tables are compared by identity and nan is never equal, like in LuaVal tables
+    if (k.tag == TTABLE || (k.tag == TNUMBER && std::isnan(k.d)))
+        return -1;
+    unsigned int lo = n.narr;
+    unsigned int hi = n.count;
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        int c = Snapshot::compare(k, snap->nodes[snap->slots[n.first + 2 * mid]]);
+        if (c == 0)
+            return static_cast<int>(mid);
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return -1;
+}
+
+LuaFrozen LuaFrozen::get(LuaKey const & k) const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using get on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using get with nil key");
+    int i = find(k);
+    if (i < 0)
+        return LuaFrozen();
+    return LuaFrozen(snap, snap->slots[snap->nodes[index].first + 2 * i + 1]);
+}
+
+bool LuaFrozen::has(LuaKey const & k) const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using has on non table object");
+    if (k.isnil())
+        SMALLFOLK_THROW("using has with nil key");
+    return find(k) >= 0;
+}
+
+unsigned int LuaFrozen::len() const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using len on non table object");
+    return snap->nodes[index].narr;
+}
+
+size_t LuaFrozen::size() const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using size on non table object");
+    return snap->nodes[index].count;
+}
+
+LuaFrozen LuaFrozen::key(size_t i) const
+{
+    if (i >= size())
+        SMALLFOLK_THROW("using key with out of bounds index");
+    return LuaFrozen(snap, snap->slots[snap->nodes[index].first + 2 * i]);
+}
+
+LuaFrozen LuaFrozen::value(size_t i) const
+{
+    if (i >= size())
+        SMALLFOLK_THROW("using value with out of bounds index");
+    return LuaFrozen(snap, snap->slots[snap->nodes[index].first + 2 * i + 1]);
+}
+
+std::string const & LuaFrozen::dumps() const
+{
+    static std::string const nil("n");
+    if (!snap)
+        return nil;
+    std::atomic<std::string const *> & slot = snap->bytes[index];
+    std::string const * bytes = slot.load(std::memory_order_acquire);
+    if (bytes)
+        return *bytes;
+    Serializer::ACC acc;
+    snap->dump(index, acc);
+    std::unique_ptr<std::string const> created(new std::string(std::move(acc.str)));
+    // another thread may have serialized the value at the same time, keep the first one
+    if (slot.compare_exchange_strong(bytes, created.get(), std::memory_order_acq_rel))
+        return *created.release();
+    return *bytes;
+}
+
+LuaVal LuaFrozen::thaw() const
+{
+    if (!snap)
+        return LuaVal::nil;
+    return snap->thaw(index);
+}
+
+unsigned int Serializer::dump_type_table(LuaVal const & object, unsigned int nmemo, MEMO & memo, ACC & acc)
+{
+    if (!object.istable())
+        SMALLFOLK_THROW("using dump_type_table on non table object");
+
+    /*
+    auto it = memo.find(object);
+    if (it != memo.end())
+    {
+    acc << '@' << it->second;
+    return nmemo;
+    }
+    memo[object] = ++nmemo;
+    */
+    LuaVal::LuaTable const & tbl = object.tbl();
+    if (acc.cached(tbl))
+        return nmemo;
+    SMALLFOLK_STATS_TABLE();
+    size_t start = acc.str.length();
+    bool pretty = acc.style == LuaVal::DumpOptions::PRETTY;
+    acc << '{';
+    ++acc.level;
+    bool first = true;
+    unsigned int i = 1;
+    for (auto const & v : object.pairs())
+    {
+        if (!first)
+            acc << ',';
+        first = false;
+        if (pretty)
+            newline(acc);
+        // the sequence comes first and is written without keys
+        if (v.first.isnumber() && v.first.num() == i)
+            ++i;
+        else
+        {
+            nmemo = dump_object(v.first, nmemo, memo, acc);
+            acc << ':';
+            if (pretty)
+                acc << ' ';
+        }
+        nmemo = dump_object(v.second, nmemo, memo, acc);
+    }
+    --acc.level;
+    if (pretty && !first)
+        newline(acc);
+    acc << '}';
+    acc.store(tbl, start);
+    acc.flush(false);
+    return nmemo;
+}
+
+unsigned int Serializer::dump_object(LuaVal const & object, unsigned int nmemo, MEMO & memo, ACC & acc)
+{
+    switch (object.typetag())
+    {
+    case TBOOL:
+        acc << (object.boolean() ? 't' : 'f');
+        break;
+    case TNIL:
+        acc << 'n';
+        break;
+    case TSTRING:
+        SMALLFOLK_STATS_COUNT(strings);
+        if (acc.holes)
+        {
+            unsigned int n;
+            if (is_hole(object.str(), n))
+            {
+                LuaTemplate::Hole hole = { acc.str.length(), n, acc.level };
+                acc.holes->push_back(hole);
+                break;
+            }
+        }
+        dump_string(object.str(), acc);
+        break;
+    case TNUMBER:
+        SMALLFOLK_STATS_COUNT(numbers);
+        dump_number(object.num(), acc);
+        break;
+    case TTABLE:
+        return dump_type_table(object, nmemo, memo, acc);
+        break;
+    default:
+        SMALLFOLK_THROW("dump_object invalid or unhandled tag %i", object.typetag());
+        break;
+    }
+    return nmemo;
+}
+
+struct LuaDumper::State
+{
+    // a table being serialized
+    struct Frame
+    {
+        LuaVal::LuaTable const * tbl;
+        LuaVal::PairIterator it;
+        // offset of the table in the output for the cache
+        size_t start;
+        // next key of the sequence
+        unsigned int i;
+        bool first;
+    };
+
+    State(LuaVal const & value, LuaVal::DumpOptions const & options) : acc(options), nmemo(0), value(&value), compress(options.compress), started(false), finished(false), version(0) {}
+
+    // writes the value if it is not a table, otherwise starts serializing the table
+    void dump(LuaVal const & v)
+    {
+        if (!v.istable())
+        {
+            Serializer::dump_object(v, nmemo, memo, acc);
+            return;
+        }
+        LuaVal::LuaTable const & tbl = v.tbl();
+        if (acc.cached(tbl))
+            return;
+        SMALLFOLK_STATS_COUNT(tables);
+        Frame f = { &tbl, LuaVal::PairIterator(tbl, true), acc.str.length(), 1, true };
+        acc << '{';
+        ++acc.level;
+        stack.push_back(f);
+    }
+
+    // writes the next pair of the innermost table or closes it, like dump_type_table
+    void next()
+    {
+        Frame & f = stack.back();
+        bool pretty = acc.style == LuaVal::DumpOptions::PRETTY;
+        if (f.it == LuaVal::PairIterator())
+        {
+            --acc.level;
+            if (pretty && !f.first)
+                Serializer::newline(acc);
+            acc << '}';
+            acc.store(*f.tbl, f.start);
+            stack.pop_back();
+            return;
+        }
+        if (!f.first)
+            acc << ',';
+        f.first = false;
+        if (pretty)
+            Serializer::newline(acc);
+        LuaVal::LuaTable::value_type const & kv = *f.it;
+        ++f.it;
+        if (kv.first.isnumber() && kv.first.num() == f.i)
+            ++f.i;
+        else
+        {
+            // keys are written in one go, table keys are rare
+            Serializer::dump_object(kv.first, nmemo, memo, acc);
+            acc << ':';
+            if (pretty)
+                acc << ' ';
+        }
+        // f is invalid after this
+        dump(kv.second);
+    }
+
+    Serializer::ACC acc;
+    std::vector<Frame> stack;
+    unsigned int nmemo;
+    Serializer::MEMO memo;
+    LuaVal const * value;
+    bool compress;
+    bool started;
+    bool finished;
+    // version of the value when the first step started
+    uint64_t version;
+};
+
+LuaDumper::LuaDumper(LuaVal const & value, LuaVal::DumpOptions const & options) : state(new State(value, options))
+{
+}
+
+LuaDumper::LuaDumper(LuaDumper && other) = default;
+LuaDumper & LuaDumper::operator=(LuaDumper && other) = default;
+LuaDumper::~LuaDumper() = default;
+
+bool LuaDumper::step(size_t max_bytes)
+{
+    return run(max_bytes, nullptr);
+}
+
+bool LuaDumper::step_for(std::chrono::nanoseconds max_time)
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + max_time;
+    return run(static_cast<size_t>(-1), &deadline);
+}
+
+bool LuaDumper::run(size_t max_bytes, std::chrono::steady_clock::time_point const * deadline)
+{
+    State & s = *state;
+    if (s.finished)
+        return true;
+    SMALLFOLK_STATS_CALL(LuaStats::DUMPS);
+    size_t before = s.acc.str.length();
+    if (!s.started)
+    {
+        s.started = true;
+        if (s.value->istable())
+            s.version = s.value->tbl().version;
+        s.dump(*s.value);
+    }
+    else if (s.value->istable() && s.value->tbl().version != s.version)
+        SMALLFOLK_THROW("LuaDumper value changed between steps");
+    // every step makes progress, the clock is read every 64 values
+    for (unsigned int n = 1; !s.stack.empty(); ++n)
+    {
+        s.next();
+        if (s.acc.str.length() - before >= max_bytes)
+            break;
+        if (deadline && n % 64 == 0 && std::chrono::steady_clock::now() >= *deadline)
+            break;
+    }
+    SMALLFOLK_STATS_BYTES(s.acc.str.length() - before);
+    if (!s.stack.empty())
+        return false;
+    s.finished = true;
+    if (s.compress)
+        s.acc.str = SmallfolkLZ::compress(s.acc.str.data(), s.acc.str.size());
+    return true;
+}
+
+bool LuaDumper::done() const
+{
+    return state->finished;
+}
+
+std::string const & LuaDumper::output() const
+{
+    return state->acc.str;
+}
+
+std::string LuaDumper::take()
+{
+    return std::move(state->acc.str);
+}
+
+bool Serializer::is_hole(std::string const & s, unsigned int & n)
+{
+    size_t prefix = sizeof(hole_prefix) - 1;
+    if (s.size() <= prefix || s.size() > prefix + 9 || s.compare(0, prefix, hole_prefix) != 0)
+        return false;
+    n = 0;
+    for (size_t i = prefix; i < s.size(); ++i)
+    {
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+        n = n * 10 + (s[i] - '0');
+    }
+    return true;
+}
+
+LuaTemplate::LuaTemplate(LuaVal const & value, LuaVal::DumpOptions const & options) : nholes(0), options(options)
+{
+    Serializer::ACC acc(options);
+    // cached serializations would contain the hole strings
+    acc.cache = false;
+    acc.holes = &positions;
+    unsigned int nmemo = 0;
+    Serializer::MEMO memo;
+    Serializer::dump_object(value, nmemo, memo, acc);
+    text = std::move(acc.str);
+    for (Hole const & hole : positions)
+        nholes = std::max(nholes, hole.index + 1);
+}
+
+LuaVal LuaTemplate::hole(unsigned int n)
+{
+    return LuaVal(Serializer::hole_prefix + std::to_string(n));
+}
+
+std::string LuaTemplate::dumps(std::initializer_list<Value> values) const
+{
+    std::string out;
+    dumps(out, values);
+    return out;
+}
+
+void LuaTemplate::dumps(std::string & out, std::initializer_list<Value> values) const
+{
+    if (values.size() < nholes)
+        SMALLFOLK_THROW("LuaTemplate has %u holes, dumps got %u values", nholes, static_cast<unsigned int>(values.size()));
+    SMALLFOLK_STATS_CALL(LuaStats::DUMPS);
+    Serializer::ACC acc(options);
+    if (!options.compress)
+        acc.str.swap(out);
+    size_t start = acc.str.length();
+    acc.str.reserve(start + text.size() + 16 * positions.size());
+    size_t copied = 0;
+    unsigned int nmemo = 0;
+    Serializer::MEMO memo;
+    for (Hole const & hole : positions)
+    {
+        acc.str.append(text, copied, hole.offset - copied);
+        copied = hole.offset;
+        Value const & v = values.begin()[hole.index];
+        acc.level = hole.level;
+        switch (v.kind)
+        {
+        case Value::NUMBER:
+            Serializer::dump_number(v.d, acc);
+            break;
+        case Value::BOOL:
+            acc << (v.d != 0 ? 't' : 'f');
+            break;
+        case Value::STRING:
+            Serializer::dump_string(v.s, v.len, acc);
+            break;
+        case Value::VALUE:
+            Serializer::dump_object(*v.v, nmemo, memo, acc);
+            break;
+        }
+    }
+    acc.str.append(text, copied, std::string::npos);
+    if (options.compress)
+    {
+        std::string compressed = SmallfolkLZ::compress(acc.str.data(), acc.str.size());
+        SMALLFOLK_STATS_BYTES(compressed.size());
+        out += compressed;
+        return;
+    }
+    SMALLFOLK_STATS_BYTES(acc.str.length() - start);
+    out.swap(acc.str);
+}
+
+void Serializer::dump_number(double d, ACC & acc)
+{
+    if (std::isnan(d))
+    {
+        // N is the nan of 0/0 and Q the other one, like loads reads them
+        static volatile double _zero = 0.0;
+        acc << (std::signbit(d) == std::signbit(0 / _zero) ? 'N' : 'Q');
+    }
+    else if (std::isinf(d))
+        acc << (d > 0 ? 'I' : 'i');
+    else if (acc.style == LuaVal::DumpOptions::MINIMAL)
+        dump_shortest_number(d, acc);
+    else
+    {
+        char arr[32];
+        int n = snprintf(arr, sizeof(arr), "%.17g", d); // min lua percision
+        acc.str.append(arr, n);
+    }
+}
+
+namespace
+{
+    // removes the + and leading zeros of the exponent, loads does not need them
+    int trim_exponent(char * arr, int n)
+    {
+        char * e = static_cast<char *>(std::memchr(arr, 'e', n));
+        if (!e)
+            return n;
+        char * to = e + 1;
+        char * from = to;
+        if (*from == '-')
+            *to++ = *from++;
+        else if (*from == '+')
+            ++from;
+        while (*from == '0' && from[1])
+            ++from;
+        while (*from)
+            *to++ = *from++;
+        *to = '\0';
+        return static_cast<int>(to - arr);
+    }
+}
+
+void Serializer::dump_shortest_number(double d, ACC & acc)
+{
+    // fewest significant digits that read back as the same double,
+    // 15 digits always do for normal doubles and %g drops the trailing zeros
+    char arr[32];
+    int n = 0;
+    for (int precision = std::fpclassify(d) == FP_SUBNORMAL ? 1 : 15; precision <= 17; ++precision)
+    {
+        n = snprintf(arr, sizeof(arr), "%.*g", precision, d);
+        if (std::strtod(arr, nullptr) == d)
+            break;
+    }
+    n = trim_exponent(arr, n);
+
+    // the same digits in exponent notation are shorter for numbers like 100000 or 0.0001
+    int digits = 0;
+    int zeros = 0;
+    for (int i = 0; i < n && arr[i] != 'e'; ++i)
+    {
+        if (arr[i] == '0')
+            ++zeros;
+        else if (arr[i] >= '1' && arr[i] <= '9')
+        {
+            digits += digits ? zeros + 1 : 1;
+            zeros = 0;
+        }
+    }
+    if (digits)
+    {
+        char exp[32];
+        int m = snprintf(exp, sizeof(exp), "%.*e", digits - 1, d);
+        m = trim_exponent(exp, m);
+        if (m < n && std::strtod(exp, nullptr) == d)
+        {
+            std::memcpy(arr, exp, m + 1);
+            n = m;
+        }
+    }
+    // %g switches to exponent notation at fewer digits than integers like 2^53 + 2 need
+    char full[32];
+    int m = snprintf(full, sizeof(full), "%.17g", d);
+    if (m < n)
+        acc.str.append(full, m);
+    else
+        acc.str.append(arr, n);
+}
+
+void Serializer::dump_string(const char * s, size_t len, ACC & acc)
+{
+    char quote = '"';
+    // the reference Smallfolk always uses ", the minimal output uses the quote that appears less
+    if (acc.style == LuaVal::DumpOptions::MINIMAL && std::count(s, s + len, '\'') < std::count(s, s + len, '"'))
+        quote = '\'';
+    acc << quote;
+    escape_quotes(s, len, quote, acc.str);
+    acc << quote;
+}
+
+void Serializer::newline(ACC & acc)
+{
+    acc << '\n';
+    acc.str.append(static_cast<size_t>(acc.level) * acc.indent, ' ');
+}
+
+void Serializer::escape_quotes(const char * before, size_t len, char quote, std::string & out)
+{
+    const char * end = before + len;
+    while (const char * q = static_cast<const char *>(std::memchr(before, quote, end - before)))
+    {
+        // quotes are doubled
+        out.append(before, q + 1 - before);
+        out += quote;
+        before = q + 1;
+    }
+    out.append(before, end - before);
+}
+
+std::string Serializer::unescape_quotes(const char * before, size_t len, char quote)
+{
+    // created with its final capacity, so its memory is what loads counted for it
+    std::string after(len, '\0');
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (before[i] == quote && i + 1 < len && before[i + 1] == quote)
+            ++i;
+        after[n++] = before[i];
+    }
+    after.resize(n);
+    return after;
+}
+
+bool Serializer::nonzero_digit(char c)
+{
+    switch (c)
+    {
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+        return true;
+    }
+    return false;
+}
+
+bool Serializer::is_digit(char c)
+{
+    switch (c)
+    {
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+        return true;
+    }
+    return false;
+}
+
+char Serializer::strat(TEXT const & string, size_t i)
+{
+    if (i < string.size)
+        return string.data[i];
+    return '\0'; // bad?
+}
+
+bool Serializer::fail(TEXT const & string, size_t at, RESULT::Code code, RESULT & result)
+{
+    result.code = code;
+    result.offset = at;
+    result.found = strat(string, at);
+    return false;
+}
+
+bool Serializer::scan_number(TEXT const & string, size_t & start, RESULT & result)
+{
+    size_t i = start;
+    char head = strat(string, i);
+    if (head == '-')
+        head = strat(string, ++i);
+    if (nonzero_digit(head))
+    {
+        do
+        {
+            head = strat(string, ++i);
+        } while (is_digit(head));
+    }
+    else if (head == '0')
+        head = strat(string, ++i);
+    else
+        return fail(string, i, RESULT::INVALID_NUMBER, result);
+    if (head == '.')
+    {
+        size_t oldi = i;
+        do
+        {
+            head = strat(string, ++i);
+        } while (is_digit(head));
+        if (i == oldi + 1)
+            return fail(string, i, RESULT::NO_DECIMALS, result);
+    }
+    if (head == 'e' || head == 'E')
+    {
+        head = strat(string, ++i);
+        if (head == '+' || head == '-')
+            head = strat(string, ++i);
+        if (!is_digit(head))
+            return fail(string, i, RESULT::INVALID_EXPONENT, result);
+        do
+        {
+            head = strat(string, ++i);
+        } while (is_digit(head));
+    }
+    start = i;
+    return true;
+}
+
+bool Serializer::expect_number(TEXT const & string, size_t & start, LuaVal & out, RESULT & result)
+{
+    size_t temp = start;
+    if (!scan_number(string, start, result))
+        return false;
+    size_t i = start;
+    SMALLFOLK_STATS_COUNT(numbers);
+    // atof needs a nul terminated string, numbers that fit the buffer are not copied to the heap
+    char buffer[64];
+    if (i - temp < sizeof(buffer))
+    {
+        std::memcpy(buffer, string.data + temp, i - temp);
+        buffer[i - temp] = '\0';
+        out = std::atof(buffer);
+    }
+    else
+        out = std::atof(std::string(string.data + temp, i - temp).c_str());
+    return true;
+}
+
+bool Serializer::scan_string(TEXT const & string, size_t & i, char quote, RESULT & result)
+{
+    size_t nexti = i - 1;
+    do
+    {
+        const char * found = nexti + 1 < string.size ? static_cast<const char *>(std::memchr(string.data + nexti + 1, quote, string.size - nexti - 1)) : nullptr;
+        if (!found)
+            return fail(string, i - 1, RESULT::EOF_IN_STRING, result);
+        nexti = found - string.data + 1;
+    } while (strat(string, nexti) == quote);
+    i = nexti;
+    return true;
+}
+
+char Serializer::skip_whitespace(TEXT const & string, size_t & i)
+{
+    char c = strat(string, i);
+    while (is_whitespace(c))
+        c = strat(string, ++i);
+    return c;
+}
+
+bool Serializer::skip_object(TEXT const & string, size_t & i, RESULT & result, unsigned int depth)
+{
+    char cc = skip_whitespace(string, i);
+    ++i;
+    switch (cc)
+    {
+    case 't':
+    case 'f':
+    case 'n':
+    case 'Q':
+    case 'N':
+    case 'I':
+    case 'i':
+        return true;
+    case '\'':
+    case '"':
+        return scan_string(string, i, cc, result);
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+    case '-':
+    case '.':
+        return scan_number(string, --i, result);
+    case '{':
+    {
+        if (depth >= LuaVal::max_load_depth)
+            return fail(string, i - 1, RESULT::TOO_DEEP, result);
+        if (strat(string, i) == '}')
+        {
+            ++i;
+            return true;
+        }
+        while (true)
+        {
+            size_t key = i;
+            if (!skip_object(string, i, result, depth + 1))
+                return false;
+            if (skip_whitespace(string, i) == ':')
+            {
+                if (skip_whitespace(string, key) == 'n')
+                    return fail(string, i, RESULT::NIL_KEY, result);
+                if (!skip_object(string, ++i, result, depth + 1))
+                    return false;
+            }
+            char head = skip_whitespace(string, i);
+            if (head == ',')
+                ++i;
+            else if (head == '}')
+            {
+                ++i;
+                return true;
+            }
+            else
+                return fail(string, i, RESULT::UNEXPECTED_TABLE_CHARACTER, result);
+        }
+    }
+    }
+    return fail(string, i - 1, RESULT::UNEXPECTED_CHARACTER, result);
+}
+
+bool Serializer::expect_object(TEXT const & string, size_t & i, Serializer::BUDGET & budget, LuaVal & out, RESULT & result, unsigned int depth)
+{
+    static double _zero = 0.0;
+
+    char cc = strat(string, i);
+    while (is_whitespace(cc)) // skip whitespace
+        cc = strat(string, ++i);
+    ++i;
+    switch (cc)
+    {
+    case 't':
+        out = true;
+        return true;
+    case 'f':
+        out = false;
+        return true;
+    case 'n':
+        out = LuaVal::nil;
+        return true;
+    case 'Q':
+        SMALLFOLK_STATS_COUNT(numbers);
+        out = -(0 / _zero);
+        return true;
+    case 'N':
+        SMALLFOLK_STATS_COUNT(numbers);
+        out = (0 / _zero);
+        return true;
+    case 'I':
+        SMALLFOLK_STATS_COUNT(numbers);
+        out = (1 / _zero);
+        return true;
+    case 'i':
+        SMALLFOLK_STATS_COUNT(numbers);
+        out = -(1 / _zero);
+        return true;
+    case '\'':
+    case '"':
+    {
+        size_t temp = i;
+        if (!scan_string(string, i, cc, result))
+            return false;
+        if (!budget.take(heap_bytes(i - temp - 1)))
+            return fail(string, temp - 1, RESULT::MEMORY_LIMIT, result);
+        SMALLFOLK_STATS_COUNT(strings);
+        out = unescape_quotes(string.data + temp, i - temp - 1, cc);
+        return true;
+    }
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+    case '-':
+    case '.':
+        return expect_number(string, --i, out, result);
+    case '{':
+    {
+        if (depth >= LuaVal::max_load_depth)
+            return fail(string, i - 1, RESULT::TOO_DEEP, result);
+        if (!budget.take(sizeof(LuaVal::LuaTable)))
+            return fail(string, i - 1, RESULT::MEMORY_LIMIT, result);
+        SMALLFOLK_STATS_TABLE();
+        LuaVal nt(TTABLE);
+        unsigned int j = 1;
+        if (strat(string, i) == '}')
+        {
+            ++i;
+            out = std::move(nt);
+            return true;
+        }
+        while (true)
+        {
+            LuaVal k(TNIL);
+            if (!expect_object(string, i, budget, k, result, depth + 1))
+                return false;
+            char at = strat(string, i);
+            while (is_whitespace(at))
+                at = strat(string, ++i);
+            if (at == ':')
+            {
+                if (k.isnil())
+                    return fail(string, i, RESULT::NIL_KEY, result);
+                LuaVal v(TNIL);
+                if (!expect_object(string, ++i, budget, v, result, depth + 1))
+                    return false;
+                if (!budget.take(nt.tbl().insert_bytes()))
+                    return fail(string, i, RESULT::MEMORY_LIMIT, result);
+                nt.set(std::move(k), std::move(v));
+            }
+            else
+            {
+                if (!budget.take(nt.tbl().insert_bytes()))
+                    return fail(string, i, RESULT::MEMORY_LIMIT, result);
+                nt.set(j, std::move(k));
+                ++j;
+            }
+            char head = strat(string, i);
+            while (is_whitespace(head))
+                head = strat(string, ++i);
+            if (head == ',')
+                ++i;
+            else if (head == '}')
+            {
+                ++i;
+                out = std::move(nt);
+                return true;
+            }
+            else
+                return fail(string, i, RESULT::UNEXPECTED_TABLE_CHARACTER, result);
+        }
+    }
+    /*
+    case '@':
+    {
+    std::string::size_type x = i;
+    for (; x < string.length(); ++x)
+    {
+    if (!isdigit(string[x]))
+    break;
+    }
+    std::string substr = string.substr(i, x - i);
+    size_t index = std::stoul(substr.c_str());
+    if (index >= 1 && index <= tables.size())
+    {
+    i += substr.length();
+    return tables[index - 1];
+    }
+
+    SMALLFOLK_THROW("expect_object at %u was %c invalid index %u", i, cc, index);
+    break;
+    }
+    */
+    }
+    return fail(string, i - 1, RESULT::UNEXPECTED_CHARACTER, result);
+}
+
+struct LuaQuery::Scanner
+{
+    Scanner(LuaQuery const & query, Serializer::TEXT const & string, std::vector<LuaVal> & out) : query(query), string(string), out(out), budget(0) {}
+
+    // sets the paths at and under node to nil, a later value for the same key replaces the earlier one
+    void reset(unsigned int node)
+    {
+        Node const & n = query.nodes[node];
+        for (unsigned int p : n.paths)
+            out[p] = LuaVal::nil;
+        for (unsigned int c : n.children)
+            reset(c);
+    }
+
+    // sets the paths under node from v, the loaded value at node
+    void fill_children(unsigned int node, LuaVal const & v)
+    {
+        for (unsigned int c : query.nodes[node].children)
+        {
+            LuaVal const & child = v.istable() ? v.get(query.nodes[c].key) : LuaVal::nil;
+            fill_children(c, child);
+            for (unsigned int p : query.nodes[c].paths)
+                out[p] = child;
+        }
+    }
+
+    int child_number(unsigned int node, double d) const
+    {
+        for (unsigned int c : query.nodes[node].children)
+        {
+            LuaVal const & k = query.nodes[c].key;
+            if (k.isnumber() && k.num() == d)
+                return static_cast<int>(c);
+        }
+        return -1;
+    }
+
+    // returns the child of node with the key at i, the key has been checked already
+    int child(unsigned int node, size_t i)
+    {
+        char cc = Serializer::strat(string, i);
+        switch (cc)
+        {
+        case 't':
+        case 'f':
+            for (unsigned int c : query.nodes[node].children)
+            {
+                LuaVal const & k = query.nodes[c].key;
+                if (k.isbool() && k.boolean() == (cc == 't'))
+                    return static_cast<int>(c);
+            }
+            return -1;
+        case 'I':
+        case 'i':
+            return child_number(node, cc == 'I' ? HUGE_VAL : -HUGE_VAL);
+        case '\'':
+        case '"':
+            for (unsigned int c : query.nodes[node].children)
+            {
+                LuaVal const & k = query.nodes[c].key;
+                if (k.isstring() && string_equals(i + 1, cc, k.str()))
+                    return static_cast<int>(c);
+            }
+            return -1;
+        case '{':
+        case 'N':
+        case 'Q':
+            // table keys are compared by identity and nan is never equal
+            return -1;
+        }
+        LuaVal d(TNIL);
+        Serializer::expect_number(string, i, d, result);
+        return child_number(node, d.num());
+    }
+
+    // compares the quoted string starting at i with s without unescaping it
+    bool string_equals(size_t i, char quote, std::string const & s) const
+    {
+        for (char c : s)
+        {
+            char at = Serializer::strat(string, i++);
+            if (at != c)
+                return false;
+            // a quote in the string is doubled, a single one ends it
+            if (at == quote && Serializer::strat(string, i++) != quote)
+                return false;
+        }
+        return Serializer::strat(string, i) == quote && Serializer::strat(string, i + 1) != quote;
+    }
+
+    // reads the object at i for node, only the values on the paths are created
+    bool scan(size_t & i, unsigned int node, unsigned int depth)
+    {
+        Node const & n = query.nodes[node];
+        if (!n.paths.empty())
+        {
+            LuaVal v(TNIL);
+            if (!Serializer::expect_object(string, i, budget, v, result, depth))
+                return false;
+            fill_children(node, v);
+            for (size_t p = 0; p + 1 < n.paths.size(); ++p)
+                out[n.paths[p]] = v;
+            out[n.paths.back()] = std::move(v);
+            return true;
+        }
+        if (Serializer::skip_whitespace(string, i) != '{')
+            return Serializer::skip_object(string, i, result, depth);
+        // the same as expect_object, but only the keys of the children are looked at
+        ++i;
+        if (depth >= LuaVal::max_load_depth)
+            return Serializer::fail(string, i - 1, RESULT::TOO_DEEP, result);
+        if (Serializer::strat(string, i) == '}')
+        {
+            ++i;
+            return true;
+        }
+        unsigned int j = 1;
+        while (true)
+        {
+            size_t key = i;
+            if (!Serializer::skip_object(string, i, result, depth + 1))
+                return false;
+            if (Serializer::skip_whitespace(string, i) == ':')
+            {
+                if (Serializer::skip_whitespace(string, key) == 'n')
+                    return Serializer::fail(string, i, RESULT::NIL_KEY, result);
+                int c = child(node, key);
+                ++i;
+                if (c < 0)
+                {
+                    if (!Serializer::skip_object(string, i, result, depth + 1))
+                        return false;
+                }
+                else
+                {
+                    reset(c);
+                    if (!scan(i, c, depth + 1))
+                        return false;
+                }
+            }
+            else
+            {
+                // the value was skipped as a possible key, read it again if it is wanted
+                int c = child_number(node, j++);
+                if (c >= 0)
+                {
+                    reset(c);
+                    if (!scan(key, c, depth + 1))
+                        return false;
+                }
+            }
+            char head = Serializer::skip_whitespace(string, i);
+            if (head == ',')
+                ++i;
+            else if (head == '}')
+            {
+                ++i;
+                return true;
+            }
+            else
+                return Serializer::fail(string, i, RESULT::UNEXPECTED_TABLE_CHARACTER, result);
+        }
+    }
+
+    typedef LuaVal::LoadResult RESULT;
+
+    LuaQuery const & query;
+    Serializer::TEXT string;
+    std::vector<LuaVal> & out;
+    RESULT result;
+    Serializer::BUDGET budget;
+};
+
+LuaQuery::LuaQuery(std::vector<Path> const & paths) : npaths(paths.size())
+{
+    nodes.push_back(Node(LuaVal::nil));
+    for (size_t p = 0; p < paths.size(); ++p)
+    {
+        unsigned int node = 0;
+        for (LuaVal const & k : paths[p])
+        {
+            if (!k.isnumber() && !k.isstring() && !k.isbool())
+                SMALLFOLK_THROW("LuaQuery path key must be a number, string or bool, got %s", k.type().c_str());
+            if (k.isnumber() && std::isnan(k.num()))
+                SMALLFOLK_THROW("LuaQuery path key is nan");
+            int found = -1;
+            for (unsigned int c : nodes[node].children)
+                if (nodes[c].key == k)
+                    found = static_cast<int>(c);
+            if (found < 0)
+            {
+                found = static_cast<int>(nodes.size());
+                nodes.push_back(Node(k));
+                nodes[node].children.push_back(found);
+            }
+            node = found;
+        }
+        nodes[node].paths.push_back(static_cast<unsigned int>(p));
+    }
+}
+
+LuaVal::LoadResult LuaQuery::find(std::string const & string, std::vector<LuaVal> & out) const
+{
+    return find(string.data(), string.size(), out);
+}
+
+LuaVal::LoadResult LuaQuery::find(const char * data, size_t size, std::vector<LuaVal> & out) const
+{
+    out.assign(npaths, LuaVal::nil);
+    if (SmallfolkLZ::is_compressed(data, size))
+    {
+        std::string text;
+        if (SmallfolkLZ::decompress(data, size, text))
+            return find(text.data(), text.size(), out);
+        LuaVal::LoadResult result;
+        result.code = LuaVal::LoadResult::INVALID_COMPRESSION;
+        return result;
+    }
+    SMALLFOLK_STATS_CALL(LuaStats::LOADS);
+    SMALLFOLK_STATS_BYTES(size);
+    Scanner scanner(*this, Serializer::TEXT(data, size), out);
+    size_t i = 0;
+    if (!scanner.scan(i, 0, 0))
+        out.assign(npaths, LuaVal::nil);
+    return scanner.result;
+}
+
+namespace
+{
+    // value of the number at i, it has been checked already
+    double number_at(Serializer::TEXT const & string, size_t i)
+    {
+        LuaVal d(TNIL);
+        LuaVal::LoadResult result;
+        Serializer::expect_number(string, i, d, result);
+        return d.num();
+    }
+
+    // length of the UTF-8 sequence at s or 0 if it is not valid, overlong forms and surrogates are not
+    size_t utf8_length(const unsigned char * s, size_t left)
+    {
+        unsigned char c = s[0];
+        size_t n;
+        unsigned char lo = 0x80;
+        unsigned char hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF)
+            n = 2;
+        else if (c >= 0xE0 && c <= 0xEF)
+        {
+            n = 3;
+            if (c == 0xE0)
+                lo = 0xA0;
+            else if (c == 0xED)
+                hi = 0x9F;
+        }
+        else if (c >= 0xF0 && c <= 0xF4)
+        {
+            n = 4;
+            if (c == 0xF0)
+                lo = 0x90;
+            else if (c == 0xF4)
+                hi = 0x8F;
+        }
+        else
+            return 0;
+        if (left < n || s[1] < lo || s[1] > hi)
+            return 0;
+        for (size_t i = 2; i < n; ++i)
+            if (s[i] < 0x80 || s[i] > 0xBF)
+                return 0;
+        return n;
+    }
+
+    // appends the smallfolk string s as a JSON string, s is the text between the quotes with the quotes still doubled
+    // returns false if the string is not UTF-8
+    bool json_string(const char * s, size_t len, char quote, std::string & out)
+    {
+        static char const hex[] = "0123456789abcdef";
+        const unsigned char * u = reinterpret_cast<const unsigned char *>(s);
+        out += '"';
+        size_t run = 0;
+        size_t i = 0;
+        while (i < len)
+        {
+            unsigned char c = u[i];
+            if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\' && c != static_cast<unsigned char>(quote))
+            {
+                ++i;
+                continue;
+            }
+            if (c >= 0x80)
+            {
+                size_t n = utf8_length(u + i, len - i);
+                if (!n)
+                    return false;
+                i += n;
+                continue;
+            }
+            out.append(s + run, i - run);
+            switch (c)
+            {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\'':
+                out += '\'';
+                break;
+            case '\b':
+                out += "\\b";
+                break;
+            case '\f':
+                out += "\\f";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 15];
+                break;
+            }
+            // a quote of the smallfolk string is doubled
+            i += c == static_cast<unsigned char>(quote) ? 2 : 1;
+            run = i;
+        }
+        out.append(s + run, len - run);
+        out += '"';
+        return true;
+    }
+
+    // moves i past the JSON value at i in text written by LuaTranscode, it has no whitespace
+    size_t skip_json(std::string const & s, size_t i)
+    {
+        unsigned int depth = 0;
+        do
+        {
+            char c = s[i++];
+            if (c == '"')
+            {
+                while (s[i] != '"')
+                    i += s[i] == '\\' ? 2 : 1;
+                ++i;
+            }
+            else if (c == '[' || c == '{')
+                ++depth;
+            else if (c == ']' || c == '}')
+                --depth;
+            else if (!depth)
+            {
+                // a number or literal ends at the next value
+                while (i < s.size() && s[i] != ',')
+                    ++i;
+            }
+        } while (depth);
+        return i;
+    }
+
+    // the header of a MessagePack value
+    struct MsgpackItem
+    {
+        enum Kind
+        {
+            NIL,
+            BOOL,
+            UINT,
+            INT,
+            FLOAT,
+            STR, // str and bin
+            EXT,
+            ARRAY,
+            MAP,
+        };
+
+        MsgpackItem() : kind(NIL), u(0), i(0), d(0), n(0) {}
+
+        Kind kind;
+        // the value of BOOL and UINT
+        uint64_t u;
+        int64_t i;
+        double d;
+        // bytes after the header for STR and EXT, values of ARRAY, pairs of MAP
+        uint64_t n;
+    };
+
+    uint64_t read_big_endian(const unsigned char * p, size_t bytes)
+    {
+        uint64_t v = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            v = v << 8 | p[i];
+        return v;
+    }
+
+    // reads the header of the value at i and moves i past it
+    // returns false if the input ends in the header or the byte at i starts no value
+    bool read_msgpack(const unsigned char * data, size_t size, size_t & i, MsgpackItem & item)
+    {
+        if (i >= size)
+            return false;
+        unsigned char b = data[i++];
+        item.u = 0;
+        item.i = 0;
+        item.d = 0;
+        item.n = 0;
+        if (b <= 0x7F)
+        {
+            item.kind = MsgpackItem::UINT;
+            item.u = b;
+            return true;
+        }
+        if (b >= 0xE0)
+        {
+            item.kind = MsgpackItem::INT;
+            item.i = static_cast<int8_t>(b);
+            return true;
+        }
+        if (b <= 0xBF)
+        {
+            item.kind = b <= 0x8F ? MsgpackItem::MAP : b <= 0x9F ? MsgpackItem::ARRAY : MsgpackItem::STR;
+            item.n = b & (b >= 0xA0 ? 0x1F : 0x0F);
+            return true;
+        }
+        // the size of the field after the type byte and what it is
+        size_t bytes = 0;
+        switch (b)
+        {
+        case 0xC0:
+            item.kind = MsgpackItem::NIL;
+            return true;
+        case 0xC2:
+        case 0xC3:
+            item.kind = MsgpackItem::BOOL;
+            item.u = b & 1;
+            return true;
+        case 0xC4: case 0xC5: case 0xC6:
+            item.kind = MsgpackItem::STR;
+            bytes = size_t(1) << (b - 0xC4);
+            break;
+        case 0xC7: case 0xC8: case 0xC9:
+            item.kind = MsgpackItem::EXT;
+            bytes = size_t(1) << (b - 0xC7);
+            break;
+        case 0xCA: case 0xCB:
+            item.kind = MsgpackItem::FLOAT;
+            bytes = b == 0xCA ? 4 : 8;
+            break;
+        case 0xCC: case 0xCD: case 0xCE: case 0xCF:
+            item.kind = MsgpackItem::UINT;
+            bytes = size_t(1) << (b - 0xCC);
+            break;
+        case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+            item.kind = MsgpackItem::INT;
+            bytes = size_t(1) << (b - 0xD0);
+            break;
+        case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8:
+            // fixext, the type byte and the data follow
+            item.kind = MsgpackItem::EXT;
+            item.n = 1 + (uint64_t(1) << (b - 0xD4));
+            return true;
+        case 0xD9: case 0xDA: case 0xDB:
+            item.kind = MsgpackItem::STR;
+            bytes = size_t(1) << (b - 0xD9);
+            break;
+        case 0xDC: case 0xDD:
+            item.kind = MsgpackItem::ARRAY;
+            bytes = b == 0xDC ? 2 : 4;
+            break;
+        case 0xDE: case 0xDF:
+            item.kind = MsgpackItem::MAP;
+            bytes = b == 0xDE ? 2 : 4;
+            break;
+        default: // 0xC1 is never used
+            --i;
+            return false;
+        }
+        if (size - i < bytes)
+        {
+            --i;
+            return false;
+        }
+        uint64_t v = read_big_endian(data + i, bytes);
+        i += bytes;
+        switch (item.kind)
+        {
+        case MsgpackItem::FLOAT:
+            if (bytes == 4)
+            {
+                uint32_t bits = static_cast<uint32_t>(v);
+                float f;
+                std::memcpy(&f, &bits, sizeof(f));
+                item.d = f;
+            }
+            else
+                std::memcpy(&item.d, &v, sizeof(item.d));
+            break;
+        case MsgpackItem::UINT:
+            item.u = v;
+            break;
+        case MsgpackItem::INT:
+            switch (bytes)
+            {
+            case 1: item.i = static_cast<int8_t>(v); break;
+            case 2: item.i = static_cast<int16_t>(v); break;
+            case 4: item.i = static_cast<int32_t>(v); break;
+            default: item.i = static_cast<int64_t>(v); break;
+            }
+            break;
+        case MsgpackItem::EXT:
+            // the type byte
+            item.n = v + 1;
+            break;
+        default:
+            item.n = v;
+            break;
+        }
+        return true;
+    }
+
+    // the value of a number, returns false for other values
+    bool msgpack_number(MsgpackItem const & item, double & d)
+    {
+        switch (item.kind)
+        {
+        case MsgpackItem::UINT:
+            d = static_cast<double>(item.u);
+            return true;
+        case MsgpackItem::INT:
+            d = static_cast<double>(item.i);
+            return true;
+        case MsgpackItem::FLOAT:
+            d = item.d;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // moves i past the value at i in MessagePack written by LuaTranscode
+    size_t skip_msgpack(std::string const & s, size_t i)
+    {
+        const unsigned char * data = reinterpret_cast<const unsigned char *>(s.data());
+        MsgpackItem item;
+        uint64_t values = 1;
+        while (values--)
+        {
+            read_msgpack(data, s.size(), i, item);
+            if (item.kind == MsgpackItem::STR)
+                i += static_cast<size_t>(item.n);
+            else if (item.kind == MsgpackItem::ARRAY)
+                values += item.n;
+            else if (item.kind == MsgpackItem::MAP)
+                values += 2 * item.n;
+        }
+        return i;
+    }
+}
+
+// a table being converted from smallfolk text
+struct LuaTranscode::Table
+{
+    Table() : start(0), count(0), seq(1), next(1), keys(0), array(true) {}
+
+    // offset of the table in the output
+    size_t start;
+    // values written, or pairs once it is not an array
+    size_t count;
+    // next key of the sequence while it is an array
+    size_t seq;
+    // key of the next value without a key, counted like expect_object does
+    size_t next;
+    // index of the first key of the table in JsonWriter::keys
+    size_t keys;
+    bool array;
+};
+
+struct LuaTranscode::JsonWriter
+{
+    explicit JsonWriter(std::string & out) : out(out) {}
+
+    // an object key written to the output, with the quotes and without the colon
+    struct Key
+    {
+        size_t at;
+        size_t len;
+        // a string key, the others are the text of a number or bool key
+        bool string;
+    };
+
+    void open(Table & t)
+    {
+        t.start = out.size();
+        t.keys = keys.size();
+        out += '[';
+    }
+
+    // fails when two different keys of the table have the same text, like 1 and "1" or t and "true"
+    bool close(Table & t)
+    {
+        if (!t.count)
+            out[t.start] = '{';
+        out += t.array && t.count ? ']' : '}';
+        std::vector<Key>::iterator first = keys.begin() + t.keys;
+        // sorted by text and then kind, a string key right after a key with the same text collides with it
+        std::sort(first, keys.end(), KeyLess(out));
+        bool unique = true;
+        for (std::vector<Key>::iterator it = first; unique && it != keys.end() && it + 1 != keys.end(); ++it)
+            unique = it->string || !(it + 1)->string || out.compare(it->at, it->len, out, (it + 1)->at, (it + 1)->len);
+        keys.erase(first, keys.end());
+        return unique;
+    }
+
+    // starts the next value of an array
+    void element(Table & t)
+    {
+        if (t.count++)
+            out += ',';
+    }
+
+    // makes the table an object, the values written so far get their keys
+    // the values are moved back in place from the last one, so nothing is copied out of the output
+    void to_map(Table & t)
+    {
+        if (!t.array)
+            return;
+        t.array = false;
+        out[t.start] = '{';
+        if (!t.count)
+            return;
+        values.clear();
+        size_t extra = 0;
+        size_t i = t.start + 1;
+        for (size_t n = 1; n <= t.count; ++n)
+        {
+            if (n > 1)
+                ++i;
+            values.push_back(i);
+            i = skip_json(out, i);
+            extra += index_length(n);
+        }
+        size_t end = out.size();
+        out.resize(end + extra);
+        for (size_t n = t.count; n >= 1; --n)
+        {
+            size_t start = values[n - 1];
+            size_t len = end - start;
+            std::memmove(&out[start + extra], &out[start], len);
+            extra -= index_length(n);
+            write_index(start + extra, n);
+            if (n > 1)
+                out[start + extra - 1] = ',';
+            end = start - 1;
+        }
+    }
+
+    // starts a pair with the key n
+    void index_key(Table & t, size_t n)
+    {
+        if (t.count++)
+            out += ',';
+        size_t at = out.size();
+        out.resize(at + index_length(n));
+        write_index(at, n);
+    }
+
+    // starts a pair with the key at at
+    bool key(Table & t, Serializer::TEXT const & string, size_t at, size_t end)
+    {
+        if (t.count++)
+            out += ',';
+        Key k = { out.size(), 0, false };
+        switch (string.data[at])
+        {
+        case 't':
+            out += "\"true\"";
+            break;
+        case 'f':
+            out += "\"false\"";
+            break;
+        case 'I':
+            out += "\"Infinity\"";
+            break;
+        case 'i':
+            out += "\"-Infinity\"";
+            break;
+        case 'N':
+        case 'Q':
+            out += "\"NaN\"";
+            break;
+        case '\'':
+        case '"':
+            if (!json_string(string.data + at + 1, end - at - 2, string.data[at], out))
+                return false;
+            k.string = true;
+            break;
+        default:
+            number_key(number_at(string, at));
+        }
+        k.len = out.size() - k.at;
+        keys.push_back(k);
+        out += ':';
+        return true;
+    }
+
+    // writes the value at at that is not a table
+    bool value(Serializer::TEXT const & string, size_t at, size_t end)
+    {
+        switch (string.data[at])
+        {
+        case 't':
+            out += "true";
+            return true;
+        case 'f':
+            out += "false";
+            return true;
+        case 'n':
+        case 'N':
+        case 'Q':
+            out += "null";
+            return true;
+        case 'I':
+            out += "1e999";
+            return true;
+        case 'i':
+            out += "-1e999";
+            return true;
+        case '\'':
+        case '"':
+            return json_string(string.data + at + 1, end - at - 2, string.data[at], out);
+        }
+        out.append(string.data + at, end - at);
+        return true;
+    }
+
+    // the same number key always gets the same text: whole numbers are written like integers,
+    // so 1.0 and 1e0 are "1" like the index 1, and other numbers in the shortest form that reads back
+    void number_key(double d)
+    {
+        if (std::isinf(d))
+        {
+            out += d > 0 ? "\"Infinity\"" : "\"-Infinity\"";
+            return;
+        }
+        char arr[32];
+        if (d == std::floor(d) && std::fabs(d) < 9223372036854775808.0)
+        {
+            out.append(arr, snprintf(arr, sizeof(arr), "\"%lld\"", static_cast<long long>(d)));
+            return;
+        }
+        out += '"';
+        // the output is lent to the accumulator to write into it without a copy
+        Serializer::ACC acc;
+        acc.str.swap(out);
+        Serializer::dump_shortest_number(d, acc);
+        acc.str.swap(out);
+        out += '"';
+    }
+
+    // length of "n":
+    static size_t index_length(size_t n)
+    {
+        size_t len = 4;
+        while (n >= 10)
+        {
+            n /= 10;
+            ++len;
+        }
+        return len;
+    }
+
+    // writes "n": at at where there is room for it
+    void write_index(size_t at, size_t n)
+    {
+        size_t len = index_length(n);
+        out[at] = '"';
+        out[at + len - 2] = '"';
+        out[at + len - 1] = ':';
+        for (size_t i = at + len - 3; i > at; --i, n /= 10)
+            out[i] = static_cast<char>('0' + n % 10);
+        Key k = { at, len - 1, false };
+        keys.push_back(k);
+    }
+
+    // orders keys by their text in the output
+    struct KeyLess
+    {
+        explicit KeyLess(std::string const & out) : out(out) {}
+
+        bool operator()(Key const & a, Key const & b) const
+        {
+            int c = out.compare(a.at, a.len, out, b.at, b.len);
+            return c < 0 || (c == 0 && a.string < b.string);
+        }
+
+        std::string const & out;
+    };
+
+    std::string & out;
+    // keys of the open objects, the ones of the innermost table last
+    std::vector<Key> keys;
+    // offsets of the values of the table to_map rewrites
+    std::vector<size_t> values;
+};
+
+struct LuaTranscode::MsgpackWriter
+{
+    explicit MsgpackWriter(std::string & out) : out(out) {}
+
+    void open(Table & t)
+    {
+        // room for the header, it is written when the size is known
+        t.start = out.size();
+        out += '\0';
+    }
+
+    bool close(Table & t)
+    {
+        char header[5];
+        size_t len = 1;
+        size_t n = t.count;
+        bool array = t.array && n;
+        if (n < 16)
+            header[0] = static_cast<char>((array ? 0x90 : 0x80) | n);
+        else if (n < 0x10000)
+        {
+            header[0] = static_cast<char>(array ? 0xDC : 0xDE);
+            len = 3;
+        }
+        else
+        {
+            header[0] = static_cast<char>(array ? 0xDD : 0xDF);
+            len = 5;
+        }
+        for (size_t i = 1; i < len; ++i)
+            header[i] = static_cast<char>(n >> (8 * (len - 1 - i)));
+        if (len == 1)
+            out[t.start] = header[0];
+        else
+            out.replace(t.start, 1, header, len);
+        return true;
+    }
+
+    void element(Table & t)
+    {
+        ++t.count;
+    }
+
+    // makes the table a map, the values written so far get their keys
+    // the values are moved back in place from the last one like JsonWriter::to_map does
+    void to_map(Table & t)
+    {
+        if (!t.array)
+            return;
+        t.array = false;
+        if (!t.count)
+            return;
+        values.clear();
+        size_t extra = 0;
+        size_t i = t.start + 1;
+        char arr[9];
+        for (size_t n = 1; n <= t.count; ++n)
+        {
+            values.push_back(i);
+            i = skip_msgpack(out, i);
+            extra += encode_unsigned(n, arr);
+        }
+        size_t end = out.size();
+        out.resize(end + extra);
+        for (size_t n = t.count; n >= 1; --n)
+        {
+            size_t start = values[n - 1];
+            std::memmove(&out[start + extra], &out[start], end - start);
+            size_t len = encode_unsigned(n, arr);
+            extra -= len;
+            std::memcpy(&out[start + extra], arr, len);
+            end = start;
+        }
+    }
+
+    void index_key(Table & t, size_t n)
+    {
+        ++t.count;
+        unsigned_integer(n);
+    }
+
+    bool key(Table & t, Serializer::TEXT const & string, size_t at, size_t end)
+    {
+        ++t.count;
+        return value(string, at, end);
+    }
+
+    bool value(Serializer::TEXT const & string, size_t at, size_t end)
+    {
+        static volatile double _zero = 0.0;
+        switch (string.data[at])
+        {
+        case 't':
+            out += '\xC3';
+            return true;
+        case 'f':
+            out += '\xC2';
+            return true;
+        case 'n':
+            out += '\xC0';
+            return true;
+        case 'I':
+            number(1 / _zero);
+            return true;
+        case 'i':
+            number(-1 / _zero);
+            return true;
+        case 'N':
+            number(0 / _zero);
+            return true;
+        case 'Q':
+            number(-(0 / _zero));
+            return true;
+        case '\'':
+        case '"':
+            str(string.data + at + 1, end - at - 2, string.data[at]);
+            return true;
+        }
+        number(number_at(string, at));
+        return true;
+    }
+
+    void number(double d)
+    {
+        // whole numbers get the smallest integer format, -0 stays a float to keep its sign
+        if (d == std::floor(d) && !(d == 0 && std::signbit(d)))
+        {
+            if (d >= 0 && d < 18446744073709551616.0)
+            {
+                unsigned_integer(static_cast<uint64_t>(d));
+                return;
+            }
+            if (d < 0 && d >= -9223372036854775808.0)
+            {
+                signed_integer(static_cast<int64_t>(d));
+                return;
+            }
+        }
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        out += '\xCB';
+        big_endian(bits, 8);
+    }
+
+    void unsigned_integer(uint64_t u)
+    {
+        char arr[9];
+        out.append(arr, encode_unsigned(u, arr));
+    }
+
+    // writes the smallest format of u to arr and returns its length
+    static size_t encode_unsigned(uint64_t u, char * arr)
+    {
+        size_t bytes;
+        if (u < 0x80)
+        {
+            arr[0] = static_cast<char>(u);
+            return 1;
+        }
+        if (u < 0x100)
+        {
+            arr[0] = '\xCC';
+            bytes = 1;
+        }
+        else if (u < 0x10000)
+        {
+            arr[0] = '\xCD';
+            bytes = 2;
+        }
+        else if (u < 0x100000000ull)
+        {
+            arr[0] = '\xCE';
+            bytes = 4;
+        }
+        else
+        {
+            arr[0] = '\xCF';
+            bytes = 8;
+        }
+        for (size_t i = 0; i < bytes; ++i)
+            arr[1 + i] = static_cast<char>(u >> (8 * (bytes - 1 - i)));
+        return 1 + bytes;
+    }
+
+    // i is negative
+    void signed_integer(int64_t i)
+    {
+        uint64_t u = static_cast<uint64_t>(i);
+        if (i >= -32)
+            out += static_cast<char>(u);
+        else if (i >= -128)
+        {
+            out += '\xD0';
+            big_endian(u, 1);
+        }
+        else if (i >= -32768)
+        {
+            out += '\xD1';
+            big_endian(u, 2);
+        }
+        else if (i >= -2147483647 - 1)
+        {
+            out += '\xD2';
+            big_endian(u, 4);
+        }
+        else
+        {
+            out += '\xD3';
+            big_endian(u, 8);
+        }
+    }
+
+    // writes the smallfolk string s, the text between the quotes with the quotes still doubled
+    void str(const char * s, size_t len, char quote)
+    {
+        size_t n = len - std::count(s, s + len, quote) / 2;
+        if (n < 32)
+            out += static_cast<char>(0xA0 | n);
+        else if (n < 0x100)
+        {
+            out += '\xD9';
+            big_endian(n, 1);
+        }
+        else if (n < 0x10000)
+        {
+            out += '\xDA';
+            big_endian(n, 2);
+        }
+        else
+        {
+            out += '\xDB';
+            big_endian(n, 4);
+        }
+        const char * end = s + len;
+        while (const char * q = static_cast<const char *>(std::memchr(s, quote, end - s)))
+        {
+            out.append(s, q + 1 - s);
+            s = q + 2;
+        }
+        out.append(s, end - s);
+    }
+
+    void big_endian(uint64_t v, size_t bytes)
+    {
+        char arr[8];
+        for (size_t i = 0; i < bytes; ++i)
+            arr[i] = static_cast<char>(v >> (8 * (bytes - 1 - i)));
+        out.append(arr, bytes);
+    }
+
+    std::string & out;
+    // offsets of the values of the table to_map rewrites
+    std::vector<size_t> values;
+};
+
+// reads smallfolk text like expect_object and writes each value with Writer as it is read
+template<typename Writer> struct LuaTranscode::Reader
+{
+    typedef LuaVal::LoadResult RESULT;
+
+    Reader(Serializer::TEXT const & string, Writer & writer) : string(string), writer(writer) {}
+
+    bool fail(size_t at, Result::Code code)
+    {
+        result.code = code;
+        result.offset = at;
+        return false;
+    }
+
+    // the input is not valid smallfolk, result.load has the error
+    bool invalid()
+    {
+        return fail(result.load.offset, Result::INVALID_SMALLFOLK);
+    }
+
+    // converts the value at i and moves i past it
+    bool value(size_t & i, unsigned int depth)
+    {
+        size_t at = i;
+        if (Serializer::skip_whitespace(string, at) != '{')
+        {
+            if (!Serializer::skip_object(string, i, result.load, depth))
+                return invalid();
+            return writer.value(string, at, i) || fail(at, Result::UNSUPPORTED);
+        }
+        i = at + 1;
+        if (depth >= LuaVal::max_load_depth)
+        {
+            Serializer::fail(string, at, RESULT::TOO_DEEP, result.load);
+            return invalid();
+        }
+        Table t;
+        writer.open(t);
+        if (Serializer::strat(string, i) == '}')
+        {
+            ++i;
+            return writer.close(t) || fail(at, Result::UNSUPPORTED);
+        }
+        while (true)
+        {
+            size_t key = i;
+            char kc = Serializer::skip_whitespace(string, key);
+            if (kc == '{')
+            {
+                // a table is written as a value, tables can not be keys in JSON or in most MessagePack readers
+                next(t);
+                if (!value(i, depth + 1))
+                    return false;
+                if (Serializer::skip_whitespace(string, i) == ':')
+                    return fail(key, Result::UNSUPPORTED);
+            }
+            else
+            {
+                if (!Serializer::skip_object(string, i, result.load, depth + 1))
+                    return invalid();
+                size_t end = i;
+                if (Serializer::skip_whitespace(string, i) == ':')
+                {
+                    if (kc == 'n')
+                    {
+                        Serializer::fail(string, i, RESULT::NIL_KEY, result.load);
+                        return invalid();
+                    }
+                    // a key that continues the sequence is written without it like dumps does
+                    if (t.array && (Serializer::is_digit(kc) || kc == '-') && number_at(string, key) == t.seq)
+                    {
+                        writer.element(t);
+                        ++t.seq;
+                    }
+                    else
+                    {
+                        writer.to_map(t);
+                        if (!writer.key(t, string, key, end))
+                            return fail(key, Result::UNSUPPORTED);
+                    }
+                    if (!value(++i, depth + 1))
+                        return false;
+                }
+                else
+                {
+                    next(t);
+                    if (!writer.value(string, key, end))
+                        return fail(key, Result::UNSUPPORTED);
+                }
+            }
+            char head = Serializer::skip_whitespace(string, i);
+            if (head == ',')
+                ++i;
+            else if (head == '}')
+            {
+                ++i;
+                // two keys that are written the same way are reported at the table
+                return writer.close(t) || fail(at, Result::UNSUPPORTED);
+            }
+            else
+            {
+                Serializer::fail(string, i, RESULT::UNEXPECTED_TABLE_CHARACTER, result.load);
+                return invalid();
+            }
+        }
+    }
+
+    // starts a value without a key
+    void next(Table & t)
+    {
+        if (t.array && t.next == t.seq)
+        {
+            writer.element(t);
+            ++t.seq;
+        }
+        else
+        {
+            writer.to_map(t);
+            writer.index_key(t, t.next);
+        }
+        ++t.next;
+    }
+
+    Serializer::TEXT string;
+    Writer & writer;
+    Result result;
+};
+
+// reads JSON and writes smallfolk text as it is read
+struct LuaTranscode::JsonReader
+{
+    JsonReader(Serializer::TEXT const & string, std::string & out) : string(string), out(out) {}
+
+    bool fail(size_t at, Result::Code code = Result::INVALID_JSON)
+    {
+        result.code = code;
+        result.offset = at;
+        return false;
+    }
+
+    // converts the value at i and moves i past it, JSON has the same whitespace as smallfolk
+    bool value(size_t & i, unsigned int depth)
+    {
+        char c = Serializer::skip_whitespace(string, i);
+        switch (c)
+        {
+        case '{':
+        case '[':
+        {
+            if (depth >= LuaVal::max_load_depth)
+                return fail(i, Result::TOO_DEEP);
+            char close = c == '{' ? '}' : ']';
+            out += '{';
+            ++i;
+            if (Serializer::skip_whitespace(string, i) == close)
+            {
+                ++i;
+                out += '}';
+                return true;
+            }
+            while (true)
+            {
+                if (c == '{')
+                {
+                    if (Serializer::skip_whitespace(string, i) != '"')
+                        return fail(i);
+                    if (!str(++i))
+                        return false;
+                    if (Serializer::skip_whitespace(string, i) != ':')
+                        return fail(i);
+                    out += ':';
+                    ++i;
+                }
+                if (!value(i, depth + 1))
+                    return false;
+                char head = Serializer::skip_whitespace(string, i);
+                if (head == ',')
+                    out += ',';
+                else if (head == close)
+                {
+                    ++i;
+                    out += '}';
+                    return true;
+                }
+                else
+                    return fail(i);
+                ++i;
+            }
+        }
+        case '"':
+            return str(++i);
+        case 't':
+            return literal(i, "true", 't');
+        case 'f':
+            return literal(i, "false", 'f');
+        case 'n':
+            return literal(i, "null", 'n');
+        case '-':
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+        {
+            // JSON numbers are smallfolk numbers
+            size_t start = i;
+            LuaVal::LoadResult number;
+            if (!Serializer::scan_number(string, i, number))
+                return fail(number.offset);
+            out.append(string.data + start, i - start);
+            return true;
+        }
+        }
+        return fail(i);
+    }
+
+    bool literal(size_t & i, const char * word, char c)
+    {
+        size_t len = std::strlen(word);
+        if (string.size - i < len || std::memcmp(string.data + i, word, len) != 0)
+            return fail(i);
+        i += len;
+        out += c;
+        return true;
+    }
+
+    // converts the string after the opening quote at i - 1
+    bool str(size_t & i)
+    {
+        size_t open = i - 1;
+        out += '"';
+        size_t run = i;
+        while (true)
+        {
+            if (i >= string.size)
+                return fail(open);
+            unsigned char c = static_cast<unsigned char>(string.data[i]);
+            if (c != '"' && c != '\\' && c >= 0x20)
+            {
+                ++i;
+                continue;
+            }
+            out.append(string.data + run, i - run);
+            if (c == '"')
+            {
+                ++i;
+                out += '"';
+                return true;
+            }
+            if (c != '\\' || !escape(i))
+                return fail(i);
+            run = i;
+        }
+    }
+
+    // converts the escape at i and moves i past it
+    bool escape(size_t & i)
+    {
+        size_t at = i;
+        char e = Serializer::strat(string, i + 1);
+        i += 2;
+        switch (e)
+        {
+        case '"':
+            out += "\"\"";
+            return true;
+        case '\\':
+        case '/':
+            out += e;
+            return true;
+        case 'b':
+            out += '\b';
+            return true;
+        case 'f':
+            out += '\f';
+            return true;
+        case 'n':
+            out += '\n';
+            return true;
+        case 'r':
+            out += '\r';
+            return true;
+        case 't':
+            out += '\t';
+            return true;
+        case 'u':
+        {
+            unsigned int cp;
+            if (!hex4(i, cp))
+                break;
+            i += 4;
+            if (cp >= 0xDC00 && cp <= 0xDFFF)
+                break;
+            if (cp >= 0xD800 && cp <= 0xDBFF)
+            {
+                // a surrogate pair
+                unsigned int low;
+                if (Serializer::strat(string, i) != '\\' || Serializer::strat(string, i + 1) != 'u' || !hex4(i + 2, low) || low < 0xDC00 || low > 0xDFFF)
+                    break;
+                i += 6;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            }
+            utf8(cp);
+            return true;
+        }
+        }
+        i = at;
+        return false;
+    }
+
+    bool hex4(size_t at, unsigned int & cp) const
+    {
+        cp = 0;
+        for (size_t k = 0; k < 4; ++k)
+        {
+            char h = Serializer::strat(string, at + k);
+            unsigned int d;
+            if (h >= '0' && h <= '9')
+                d = h - '0';
+            else if (h >= 'a' && h <= 'f')
+                d = h - 'a' + 10;
+            else if (h >= 'A' && h <= 'F')
+                d = h - 'A' + 10;
+            else
+                return false;
+            cp = cp << 4 | d;
+        }
+        return true;
+    }
+
+    void utf8(unsigned int cp)
+    {
+        if (cp < 0x80)
+        {
+            out += static_cast<char>(cp);
+            if (cp == '"')
+                out += '"';
+        }
+        else if (cp < 0x800)
+        {
+            out += static_cast<char>(0xC0 | cp >> 6);
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            out += static_cast<char>(0xE0 | cp >> 12);
+            out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += static_cast<char>(0xF0 | cp >> 18);
+            out += static_cast<char>(0x80 | (cp >> 12 & 0x3F));
+            out += static_cast<char>(0x80 | (cp >> 6 & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    Serializer::TEXT string;
+    std::string & out;
+    Result result;
+};
+
+// reads MessagePack and writes smallfolk text as it is read
+struct LuaTranscode::MsgpackReader
+{
+    MsgpackReader(Serializer::TEXT const & string, Serializer::ACC & acc) : data(reinterpret_cast<const unsigned char *>(string.data)), size(string.size), acc(acc) {}
+
+    bool fail(size_t at, Result::Code code = Result::INVALID_MSGPACK)
+    {
+        result.code = code;
+        result.offset = at;
+        return false;
+    }
+
+    // converts the value at i and moves i past it
+    bool value(size_t & i, unsigned int depth)
+    {
+        size_t at = i;
+        MsgpackItem item;
+        if (!read_msgpack(data, size, i, item))
+            return fail(at);
+        switch (item.kind)
+        {
+        case MsgpackItem::NIL:
+            acc << 'n';
+            return true;
+        case MsgpackItem::BOOL:
+            acc << (item.u ? 't' : 'f');
+            return true;
+        case MsgpackItem::UINT:
+        case MsgpackItem::INT:
+        {
+            // integers are written exactly
+            char arr[32];
+            int len = item.kind == MsgpackItem::UINT ? snprintf(arr, sizeof(arr), "%llu", static_cast<unsigned long long>(item.u)) : snprintf(arr, sizeof(arr), "%lld", static_cast<long long>(item.i));
+            acc.str.append(arr, len);
+            return true;
+        }
+        case MsgpackItem::FLOAT:
+            Serializer::dump_number(item.d, acc);
+            return true;
+        case MsgpackItem::STR:
+            if (item.n > size - i)
+                return fail(at);
+            acc << '"';
+            Serializer::escape_quotes(string(i), static_cast<size_t>(item.n), '"', acc.str);
+            acc << '"';
+            i += static_cast<size_t>(item.n);
+            return true;
+        case MsgpackItem::EXT:
+            return fail(at, Result::UNSUPPORTED);
+        case MsgpackItem::ARRAY:
+            if (depth >= LuaVal::max_load_depth)
+                return fail(at, Result::TOO_DEEP);
+            acc << '{';
+            for (uint64_t n = 0; n < item.n; ++n)
+            {
+                if (n)
+                    acc << ',';
+                if (!value(i, depth + 1))
+                    return false;
+            }
+            acc << '}';
+            return true;
+        case MsgpackItem::MAP:
+        {
+            if (depth >= LuaVal::max_load_depth)
+                return fail(at, Result::TOO_DEEP);
+            acc << '{';
+            // keys that continue the sequence are not written like dumps does
+            double seq = 1;
+            for (uint64_t n = 0; n < item.n; ++n)
+            {
+                if (n)
+                    acc << ',';
+                size_t key = i;
+                MsgpackItem k;
+                double d;
+                if (!read_msgpack(data, size, i, k))
+                    return fail(key);
+                if (k.kind == MsgpackItem::NIL)
+                    return fail(key, Result::UNSUPPORTED);
+                if (msgpack_number(k, d) && d == seq)
+                    ++seq;
+                else
+                {
+                    i = key;
+                    if (!value(i, depth + 1))
+                        return false;
+                    acc << ':';
+                }
+                if (!value(i, depth + 1))
+                    return false;
+            }
+            acc << '}';
+            return true;
+        }
+        }
+        return fail(at);
+    }
+
+    const char * string(size_t i) const
+    {
+        return reinterpret_cast<const char *>(data + i);
+    }
+
+    const unsigned char * data;
+    size_t size;
+    Serializer::ACC & acc;
+    Result result;
+};
+
+std::string LuaTranscode::Result::message() const
+{
+    const char * what = "";
+    switch (code)
+    {
+    case OK:
+        return std::string();
+    case INVALID_SMALLFOLK:
+        return load.message();
+    case INVALID_JSON:
+        what = "invalid JSON";
+        break;
+    case INVALID_MSGPACK:
+        what = "invalid MessagePack";
+        break;
+    case TOO_DEEP:
+        what = "tables nested too deep";
+        break;
+    case UNSUPPORTED:
+        what = "value not supported by the output format";
+        break;
+    }
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "Smallfolk: transcode at %u %s", static_cast<unsigned int>(offset), what);
+    return buffer;
+}
+
+template<typename Writer> LuaTranscode::Result LuaTranscode::transcode(const char * data, size_t size, std::string & out)
+{
+    if (SmallfolkLZ::is_compressed(data, size))
+    {
+        std::string text;
+        if (SmallfolkLZ::decompress(data, size, text))
+            return transcode<Writer>(text.data(), text.size(), out);
+        Result result;
+        result.code = Result::INVALID_SMALLFOLK;
+        result.load.code = LuaVal::LoadResult::INVALID_COMPRESSION;
+        return result;
+    }
+    size_t start = out.size();
+    Writer writer(out);
+    Reader<Writer> reader(Serializer::TEXT(data, size), writer);
+    size_t i = 0;
+    if (!reader.value(i, 0))
+        out.resize(start);
+    return reader.result;
+}
+
+LuaTranscode::Result LuaTranscode::to_json(std::string const & string, std::string & out)
+{
+    return to_json(string.data(), string.size(), out);
+}
+
+LuaTranscode::Result LuaTranscode::to_json(const char * data, size_t size, std::string & out)
+{
+    return transcode<JsonWriter>(data, size, out);
+}
+
+LuaTranscode::Result LuaTranscode::to_msgpack(std::string const & string, std::string & out)
+{
+    return to_msgpack(string.data(), string.size(), out);
+}
+
+LuaTranscode::Result LuaTranscode::to_msgpack(const char * data, size_t size, std::string & out)
+{
+    return transcode<MsgpackWriter>(data, size, out);
+}
+
+LuaTranscode::Result LuaTranscode::from_json(std::string const & string, std::string & out)
+{
+    return from_json(string.data(), string.size(), out);
+}
+
+LuaTranscode::Result LuaTranscode::from_json(const char * data, size_t size, std::string & out)
+{
+    size_t start = out.size();
+    Serializer::TEXT text(data, size);
+    JsonReader reader(text, out);
+    size_t i = 0;
+    if (reader.value(i, 0))
+    {
+        // nothing but whitespace can follow the value
+        Serializer::skip_whitespace(text, i);
+        if (i != size)
+            reader.fail(i);
+    }
+    if (!reader.result)
+        out.resize(start);
+    return reader.result;
+}
+
+LuaTranscode::Result LuaTranscode::from_msgpack(std::string const & string, std::string & out)
+{
+    return from_msgpack(string.data(), string.size(), out);
+}
+
+LuaTranscode::Result LuaTranscode::from_msgpack(const char * data, size_t size, std::string & out)
+{
+    Serializer::ACC acc;
+    acc.str.swap(out);
+    size_t start = acc.str.size();
+    MsgpackReader reader(Serializer::TEXT(data, size), acc);
+    size_t i = 0;
+    if (reader.value(i, 0) && i != size)
+        reader.fail(i);
+    if (!reader.result)
+        acc.str.resize(start);
+    acc.str.swap(out);
+    return reader.result;
+}
+
+#ifdef _WIN32
+Serializer::MappedFile::MappedFile(std::string const & path) : data(nullptr), size(0), error(nullptr), handle(INVALID_HANDLE_VALUE), mapping(nullptr)
+{
+    handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        error = "could not open";
+        return;
+    }
+    LARGE_INTEGER filesize;
+    if (!GetFileSizeEx(handle, &filesize))
+    {
+        error = "could not read";
+        return;
+    }
+    size = static_cast<size_t>(filesize.QuadPart);
+    if (size == 0)
+        return; // empty files cannot be mapped
+    mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping)
+        data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!data)
+        error = "could not map";
+}
+
+Serializer::MappedFile::~MappedFile()
+{
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapping)
+        CloseHandle(mapping);
+    if (handle != INVALID_HANDLE_VALUE)
+        CloseHandle(handle);
+}
+#else
+Serializer::MappedFile::MappedFile(std::string const & path) : data(nullptr), size(0), error(nullptr), fd(-1)
+{
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = "could not open";
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        error = "could not read";
+        return;
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size == 0)
+        return; // empty files cannot be mapped
+    void * p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        error = "could not map";
+        return;
+    }
+    // the parser reads the file from start to end
+    madvise(p, size, MADV_SEQUENTIAL);
+    data = static_cast<const char *>(p);
+}
+
+Serializer::MappedFile::~MappedFile()
+{
+    if (data)
+        munmap(const_cast<char *>(data), size);
+    if (fd >= 0)
+        close(fd);
+}
+#endif
+
+std::string Serializer::vformat(const char * format, va_list args)
+{
+    char buffer[smallfolk_exception::size];
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    return std::string("Smallfolk: ") + buffer;
+}
+
+bool Serializer::error(std::string * errmsg, const char * format, ...)
+{
+    if (!errmsg)
+        return false;
+    va_list args;
+    va_start(args, format);
+    *errmsg += vformat(format, args);
+    va_end(args);
+    return false;
+}
+
+#ifdef SMALLFOLK_STATS
+bool LuaStats::enabled()
+{
+    return true;
+}
+
+LuaStats const & LuaStats::last()
+{
+    return Serializer::last;
+}
+
+LuaStats const & LuaStats::total()
+{
+    return Serializer::total;
+}
+
+void LuaStats::reset_total()
+{
+    Serializer::total = LuaStats();
+}
+
+LuaStats::Callback LuaStats::set_callback(Callback callback)
+{
+    return Serializer::callback.exchange(callback, std::memory_order_acq_rel);
+}
+
+void LuaStats::allocated()
+{
+    if (Serializer::stats)
+        ++Serializer::stats->allocations;
+}
+#else
+bool LuaStats::enabled()
+{
+    return false;
+}
+
+LuaStats const & LuaStats::last()
+{
+    static LuaStats const none;
+    return none;
+}
+
+LuaStats const & LuaStats::total()
+{
+    return last();
+}
+
+void LuaStats::reset_total()
+{
+}
+
+LuaStats::Callback LuaStats::set_callback(Callback)
+{
+    return nullptr;
+}
+
+void LuaStats::allocated()
+{
+}
+#endif
+
+#ifdef SMALLFOLK_NO_EXCEPTIONS
+namespace
+{
+    smallfolk_error_handler error_handler = nullptr;
+}
+
+smallfolk_error_handler set_smallfolk_error_handler(smallfolk_error_handler handler)
+{
+    smallfolk_error_handler previous = error_handler;
+    error_handler = handler;
+    return previous;
+}
+
+void smallfolk_abort(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    std::string errmsg = Serializer::vformat(format, args);
+    va_end(args);
+    if (error_handler)
+        error_handler(errmsg.c_str());
+    else
+        fprintf(stderr, "%s\n", errmsg.c_str());
+    std::abort();
 }
+#endif
 
 smallfolk_exception::smallfolk_exception(const char * format, ...) : std::logic_error("Smallfolk exception")
 {
-    char buffer[size];
     va_list args;
     va_start(args, format);
-    vsnprintf(buffer, size, format, args);
-    errmsg = std::string("Smallfolk: ") + buffer;
+    errmsg = Serializer::vformat(format, args);
     va_end(args);
 }
 
@@ -14,6 +14,13 @@
 #include <stdexcept> // std::logic_error
 #include <cstddef> // size_t
 #include <utility> // std::move
+#include <cstdint> // uint64_t
+#include <type_traits> // std::enable_if
+#include <iterator> // std::make_move_iterator
+#include <cstring> // std::strlen
+#include <new> // placement new
+#include <functional> // std::less
+#include <chrono> // std::chrono::nanoseconds
 
 class smallfolk_exception : public std::logic_error
 {
@@ -26,6 +33,19 @@ public:
     std::string errmsg;
 };
 
+// Define SMALLFOLK_NO_EXCEPTIONS to build without exceptions, for example with -fno-exceptions.
+// Errors that would throw a smallfolk_exception then call the error handler and abort.
+// Use the functions that do not throw, like try_num, find, get_or and try_set, to avoid them.
+#ifdef SMALLFOLK_NO_EXCEPTIONS
+typedef void (*smallfolk_error_handler)(const char * errmsg);
+// sets the function called with the error message before aborting, returns the previous one
+smallfolk_error_handler set_smallfolk_error_handler(smallfolk_error_handler handler);
+[[noreturn]] void smallfolk_abort(const char * format, ...);
+#define SMALLFOLK_THROW(...) smallfolk_abort(__VA_ARGS__)
+#else
+#define SMALLFOLK_THROW(...) throw smallfolk_exception(__VA_ARGS__)
+#endif
+
 enum LuaTypeTag
 {
     TNIL,
@@ -35,9 +55,140 @@ enum LuaTypeTag
     TBOOL,
 };
 
+// how a table indexes its keys, see LuaVal::LuaTable
+enum LuaTablePolicy
+{
+    TABLE_AUTO, // scans the entries while there are at most LuaTable::small_size of them, then indexes them like TABLE_FLAT
+    TABLE_HASH, // chained hash buckets
+    TABLE_FLAT, // open addressing hash with linear probing
+    TABLE_ORDERED, // entries sorted by key, they are iterated and serialized in key order
+};
+
 class LuaVal;
+class LuaFrozen;
+class LuaDumper;
+namespace Serializer { struct ACC; }
+class LuaTemplate;
+class LuaQuery;
+
+// LuaStats are the statistics of one dumps or loads call, including save_file, try_loads and load_file.
+// They are collected only when built with SMALLFOLK_STATS defined. Otherwise nothing is counted,
+// the stats stay zero, the callback is never called and the calls have no overhead.
+struct LuaStats
+{
+    enum Operation
+    {
+        DUMPS,
+        LOADS,
+    };
+    typedef void (*Callback)(LuaStats const & stats);
+
+    LuaStats() : operation(DUMPS), bytes(0), tables(0), strings(0), numbers(0), max_depth(0), allocations(0), nanoseconds(0) {}
+
+    Operation operation;
+    // bytes written by dumps or read by loads, compressed bytes if compressed
+    size_t bytes;
+    // values serialized or parsed, tables reused from the serialization cache are not visited
+    size_t tables;
+    size_t strings;
+    size_t numbers;
+    // deepest table nesting visited, the outermost table is at depth 1
+    unsigned int max_depth;
+    // tables, table entries and hash bucket arrays allocated
+    size_t allocations;
+    uint64_t nanoseconds;
+
+    // true if built with SMALLFOLK_STATS
+    static bool enabled();
+    // stats of the last dumps or loads call on this thread
+    static LuaStats const & last();
+    // sums of all calls on this thread since reset_total, max_depth is the maximum
+    static LuaStats const & total();
+    static void reset_total();
+    // sets the function called on the calling thread after each dumps and loads call,
+    // nullptr removes it, returns the previous callback
+    static Callback set_callback(Callback callback);
+
+private:
+    friend class LuaVal;
+    // counts an allocation to the dumps or loads call running on this thread, if any
+    static void allocated();
+};
+
+// LuaPool recycles tables and table entries on the calling thread while it exists.
+// Tables and entries freed while a pool exists are kept in it and reused for new ones
+// instead of returning them to the heap, so repeatedly loading and discarding similar
+// messages stops allocating once the pool has warmed up. Recycled tables keep their hash index and get TABLE_AUTO.
+// Pools can be nested, the outermost one owns the kept memory and frees it when destroyed.
+// Values can still be freed on any thread, they go to the pool of that thread or to the heap.
+class LuaPool
+{
+public:
+    // keeps at most max_tables tables and max_entries table entries for reuse
+    explicit LuaPool(size_t max_tables = 4096, size_t max_entries = 65536);
+    ~LuaPool();
+
+    // numbers of tables and table entries kept for reuse on this thread
+    static size_t tables();
+    static size_t entries();
+
+private:
+    LuaPool(LuaPool const &) = delete;
+    LuaPool & operator=(LuaPool const &) = delete;
+};
+
+#ifdef SMALLFOLK_STATS
+#define SMALLFOLK_STATS_ALLOCATED() LuaStats::allocated()
+#else
+#define SMALLFOLK_STATS_ALLOCATED() ((void)0)
+#endif
+
 size_t LuaValHash(LuaVal const & v);
 
+// LuaKey is a view of a table key for lookups.
+// It can be created from string literals, strings, numbers and bools without creating a LuaVal,
+// and it hashes and compares like the LuaVal with the same value.
+// It must not outlive the string or value it was created from.
+class LuaKey
+{
+public:
+    LuaKey(LuaVal const & v);
+    LuaKey(const char * s) : tag(TSTRING), str(s), len(std::strlen(s)), d(0), b(false), val(nullptr) {}
+    LuaKey(const char * s, size_t len) : tag(TSTRING), str(s), len(len), d(0), b(false), val(nullptr) {}
+    LuaKey(std::string const & s) : tag(TSTRING), str(s.data()), len(s.size()), d(0), b(false), val(nullptr) {}
+    LuaKey(const int d) : tag(TNUMBER), str(nullptr), len(0), d(d), b(false), val(nullptr) {}
+    LuaKey(const unsigned int d) : tag(TNUMBER), str(nullptr), len(0), d(d), b(false), val(nullptr) {}
+    LuaKey(const double d) : tag(TNUMBER), str(nullptr), len(0), d(d), b(false), val(nullptr) {}
+    LuaKey(const bool b) : tag(TBOOL), str(nullptr), len(0), d(0), b(b), val(nullptr) {}
+
+    LuaTypeTag typetag() const { return tag; }
+    bool isnil() const { return tag == TNIL; }
+    // same as LuaValHash of the LuaVal with the same value
+    size_t hash() const;
+    bool operator==(LuaVal const & v) const;
+    // orders keys by type (bool, number, string, table) and then by value,
+    // returns a negative number, zero or a positive number like strcmp
+    // this is the one key order of TABLE_ORDERED, LuaFrozen and LuaSharedTable,
+    // nan is ordered after the other numbers and compares equal to nan, but it is never == to a key
+    int compare(LuaKey const & k) const;
+    int compare(LuaVal const & v) const { return compare(LuaKey(v)); }
+    // creates a LuaVal with the value of the key, table keys are deep copied
+    LuaVal value() const;
+
+    static size_t hash_string(const char * s, size_t len);
+    static size_t hash_number(double d);
+
+private:
+    LuaTypeTag tag;
+    const char * str;
+    size_t len;
+    double d;
+    bool b;
+    LuaVal const * val; // the viewed value for table keys
+
+    friend class LuaFrozen;
+};
+
 namespace std {
     template <>
     struct hash<LuaVal> {
@@ -65,104 +216,124 @@ public:
     {
         size_t operator()(LuaVal const & v) const;
     };
+    // hash and equality by content, tables with the same pairs are the same key,
+    // for example std::unordered_set<LuaVal, LuaVal::ContentHasher, LuaVal::ContentEqual>
+    struct ContentHasher
+    {
+        size_t operator()(LuaVal const & v) const { return v.content_hash(); }
+    };
+    struct ContentEqual
+    {
+        bool operator()(LuaVal const & l, LuaVal const & r) const { return l.deep_equals(r); }
+    };
 
-    typedef std::unordered_map<LuaVal, LuaVal> LuaTable;
-    typedef std::unique_ptr<LuaTable> TblPtr; // circular reference memleak if insert self to self
+    class LuaTable;
+    class PairIterator;
+    class PairRange;
+    // returns the table to the LuaPool of the thread or deletes it
+    struct TblDelete
+    {
+        void operator()(LuaTable * t) const;
+    };
+    typedef std::unique_ptr<LuaTable, TblDelete> TblPtr; // circular reference memleak if insert self to self
 
-    LuaVal(const LuaTypeTag tag) : tag(tag), tbl_ptr(tag == TTABLE ? new LuaTable() : nullptr), d(0), b(false) {}
-    LuaVal() : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false) {}
+    LuaVal(const LuaTypeTag tag) : tag(tag), tbl_ptr(tag == TTABLE ? newtable() : nullptr), d(0), b(false) {}
+    LuaVal() : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false) {}
     LuaVal(const int d) : tag(TNUMBER), tbl_ptr(nullptr), d(d), b(false) {}
     LuaVal(const unsigned int d) : tag(TNUMBER), tbl_ptr(nullptr), d(d), b(false) {}
     LuaVal(const double d) : tag(TNUMBER), tbl_ptr(nullptr), d(d), b(false) {}
     LuaVal(const std::string & s) : tag(TSTRING), tbl_ptr(nullptr), s(s), d(0), b(false) {}
+    LuaVal(std::string && s) : tag(TSTRING), tbl_ptr(nullptr), s(std::move(s)), d(0), b(false) {}
     LuaVal(const char * s) : tag(TSTRING), tbl_ptr(nullptr), s(s), d(0), b(false) {}
     LuaVal(const bool b) : tag(TBOOL), tbl_ptr(nullptr), d(0), b(b) {}
-    LuaVal(LuaVal const & val) : tag(val.tag), tbl_ptr(val.tag == TTABLE ? val.tbl_ptr ? new LuaTable(*val.tbl_ptr) : new LuaTable() : nullptr), s(val.s), d(val.d), b(val.b) {}
-    LuaVal(LuaVal && val) noexcept : tag(std::move(val.tag)), tbl_ptr(std::move(val.tbl_ptr)), s(std::move(val.s)), d(std::move(val.d)), b(std::move(val.b)) {}
-    LuaVal(std::initializer_list<LuaVal> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    LuaVal(LuaVal const & val) : tag(val.tag), tbl_ptr(val.tag == TTABLE ? val.tbl_ptr ? copytable(*val.tbl_ptr) : newtable() : nullptr), s(val.s), d(val.d), b(val.b) {}
+    LuaVal(LuaVal && val) noexcept : tag(std::move(val.tag)), tbl_ptr(std::move(val.tbl_ptr)), s(std::move(val.s)), d(std::move(val.d)), b(std::move(val.b))
     {
-        InitializeSequence(l);
+        val.moved();
+        reparent();
     }
-    template<typename T> LuaVal(std::initializer_list<T> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    LuaVal(std::initializer_list<LuaVal> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    LuaVal(std::vector<LuaVal> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    template<typename T> LuaVal(std::initializer_list<T> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    template<typename T> LuaVal(std::vector<T> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    LuaVal(std::vector<LuaVal> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    LuaVal(std::list<LuaVal> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    template<typename T> LuaVal(std::vector<T> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    template<typename T> LuaVal(std::list<T> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    LuaVal(std::list<LuaVal> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    template<size_t C> LuaVal(std::array<LuaVal, C> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    template<typename T> LuaVal(std::list<T> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    template<typename T, size_t C> LuaVal(std::array<T, C> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    template<size_t C> LuaVal(std::array<LuaVal, C> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    LuaVal(std::deque<LuaVal> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    template<typename T, size_t C> LuaVal(std::array<T, C> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    template<typename T> LuaVal(std::deque<T> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    LuaVal(std::deque<LuaVal> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    LuaVal(std::forward_list<LuaVal> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    template<typename T> LuaVal(std::deque<T> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    template<typename T> LuaVal(std::forward_list<T> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    LuaVal(std::forward_list<LuaVal> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeSequence(l);
     }
-    LuaVal(std::map<LuaVal, LuaVal> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    template<typename T> LuaVal(std::forward_list<T> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
-        InitializeMap(l);
+        InitializeSequence(l);
     }
-    template<typename K, typename V> LuaVal(std::map<K, V> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    LuaVal(std::map<LuaVal, LuaVal> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeMap(l);
     }
-    LuaVal(std::unordered_map<LuaVal, LuaVal> const & l) : tag(TTABLE), tbl_ptr(new LuaTable(l)), d(0), b(false)
-    {
-    }
-    template<typename K, typename V> LuaVal(std::unordered_map<K, V> const & l) : tag(TTABLE), tbl_ptr(new LuaTable()), d(0), b(false)
+    template<typename K, typename V> LuaVal(std::map<K, V> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
         InitializeMap(l);
     }
-    static LuaVal table() { return LuaVal(TTABLE); }
-    static LuaVal mrg(LuaVal const & l, LuaVal const & r)
+    LuaVal(std::unordered_map<LuaVal, LuaVal> const & l) : tag(TTABLE), tbl_ptr(newtable(l)), d(0), b(false)
     {
-        LuaVal t = l;
-        for (auto const & v : r.tbl())
-            t[v.first] = v.second;
-        return t;
     }
-    static LuaVal mrg(LuaVal&& l, LuaVal&& r) { return mrg(l, std::move(r)); }
-    static LuaVal mrg(LuaVal&& l, LuaVal const & r)
+    template<typename K, typename V> LuaVal(std::unordered_map<K, V> const & l) : tag(TTABLE), tbl_ptr(newtable()), d(0), b(false)
     {
-        for (auto const & v : r.tbl())
-            l[v.first] = v.second;
-        return std::move(l);
+        InitializeMap(l);
     }
-    static LuaVal mrg(LuaVal const & l, LuaVal&& r)
+    LuaVal(LuaTable const & t) : tag(TTABLE), tbl_ptr(copytable(t)), d(0), b(false)
     {
-        for (auto const & v : l.tbl())
-            r.setignore(v.first, v.second);
-        return std::move(r);
     }
+    static LuaVal table() { return LuaVal(TTABLE); }
+    static LuaVal table(LuaTablePolicy policy) { return LuaVal(TTABLE).set_policy(policy); }
+    static LuaVal mrg(LuaVal const & l, LuaVal const & r);
+    static LuaVal mrg(LuaVal&& l, LuaVal&& r);
+    static LuaVal mrg(LuaVal&& l, LuaVal const & r);
+    static LuaVal mrg(LuaVal const & l, LuaVal&& r);
+
+    // computes a patch that turns the table from into the table to
+    // the patch is a table {"s":{k:v,...},"r":{k,...},"d":{k:patch,...}}
+    // with the set, removed and recursively patched keys of from,
+    // unneeded parts are left out and a patch for equal tables is {}
+    // patches can be serialized like any other table
+    static LuaVal diff(LuaVal const & from, LuaVal const & to);
+    // applies a patch created with diff to the table base, returns base
+    static LuaVal & patch(LuaVal & base, LuaVal const & delta);
+    static LuaVal & patch(LuaVal & base, LuaVal && delta);
 
     ~LuaVal() = default;
 
@@ -174,54 +345,140 @@ public:
 
     // gettable, adds key-nil pair if not existing
     // nil key throws error
-    LuaVal & operator[](LuaVal const & k);
-    LuaVal const & operator[](LuaVal const & k) const;
+    // lookups take a LuaKey, so string literals and numbers are not converted to a LuaVal
+    LuaVal & operator[](LuaKey const & k);
+    // moves a LuaVal key into the table if it does not exist
+    template<typename T, typename std::enable_if<std::is_same<T, LuaVal>::value, int>::type = 0>
+    LuaVal & operator[](T && k) { return index(std::move(k)); }
+    LuaVal const & operator[](LuaKey const & k) const;
     // gettable
-    LuaVal const & get(LuaVal const & k) const;
-    // returns true if value was found with key
-    bool has(LuaVal const & k) const;
+    LuaVal const & get(LuaKey const & k) const;
+    // returns true if a non nil value was found with key
+    // keys with nil values, like those left by assigning nil through operator[] or by moving a value out, are absent
+    bool has(LuaKey const & k) const;
     // settable, return self
+    // the rvalue overloads move the key and value into the table instead of copying them
     LuaVal & set(LuaVal const & k, LuaVal const & v);
-    // settable ignore if exists, return self
+    LuaVal & set(LuaVal const & k, LuaVal && v);
+    LuaVal & set(LuaVal && k, LuaVal const & v);
+    LuaVal & set(LuaVal && k, LuaVal && v);
+    // settable ignore if a non nil value exists, return self
     LuaVal & setignore(LuaVal const & k, LuaVal const & v);
+    LuaVal & setignore(LuaVal && k, LuaVal && v);
+    // like std::map::try_emplace, moves the pair into the table only if the key has no non nil value
+    // returns the value with the key and whether the pair was added,
+    // or nullptr on nil key, nil value or if this is not a table
+    std::pair<LuaVal *, bool> try_emplace(LuaVal && k, LuaVal && v);
     // erase, return self
-    LuaVal & rem(LuaVal const & k);
+    LuaVal & rem(LuaKey const & k);
     // table array size, not actual element count
     unsigned int len() const;
+    // reserves room for array_n sequence and hash_n other entries, return self
+    LuaVal & reserve(size_t array_n, size_t hash_n = 0);
+    // changes how the table indexes its keys, return self
+    // copies of the table get the same policy, tables created by loads use TABLE_AUTO
+    LuaVal & set_policy(LuaTablePolicy policy);
+    LuaTablePolicy policy() const;
     // table.insert, return self
     LuaVal & insert(LuaVal const & v, LuaVal const & pos = nil);
+    LuaVal & insert(LuaVal && v, LuaVal const & pos = nil);
+    // appends the values to the end of the sequence, return self
+    // the values of an rvalue container are moved
+    template<typename It> LuaVal & append_range(It first, It last);
+    template<typename T> LuaVal & append_range(T && range);
     // table.remove, return self
     LuaVal & remove(LuaVal const & pos = nil);
+    // iterates the sequence 1..len() in order like lua ipairs
+    PairRange ipairs() const;
+    // iterates the sequence like ipairs and then the other pairs like lua pairs,
+    // in insertion order or with TABLE_ORDERED in key order, pairs with nil values are skipped
+    // the table must not be changed while iterating it
+    PairRange pairs() const;
+
+    // table functions that do not throw
+    // returns a pointer to the value with key or nullptr if the key is not found,
+    // the key is nil or this is not a table
+    LuaVal const * find(LuaKey const & k) const;
+    LuaVal * find(LuaKey const & k);
+    // returns the value with key if it has the type of def, otherwise returns def
+    // a nil def accepts values of any type
+    LuaVal const & get_or(LuaKey const & k, LuaVal const & def) const;
+    std::string get_or(LuaKey const & k, std::string const & def) const;
+    std::string get_or(LuaKey const & k, const char * def) const;
+    bool get_or(LuaKey const & k, bool def) const;
+    template<typename T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+    double get_or(LuaKey const & k, T def) const
+    {
+        LuaVal const * v = find(k);
+        return v && v->isnumber() ? v->d : static_cast<double>(def);
+    }
+    // like set, rem, insert and remove, but return false instead of throwing on error
+    bool try_set(LuaVal const & k, LuaVal const & v);
+    bool try_rem(LuaKey const & k);
+    bool try_insert(LuaVal const & v, LuaVal const & pos = nil);
+    bool try_insert(LuaVal && v, LuaVal const & pos = nil);
+    bool try_remove(LuaVal const & pos = nil);
 
     // get a number value
     double num() const
     {
         if (!isnumber())
-            throw smallfolk_exception("using num on non number object");
+            SMALLFOLK_THROW("using num on non number object");
         return d;
     }
     // get a boolean value
     bool boolean() const
     {
         if (!isbool())
-            throw smallfolk_exception("using boolean on non bool object");
+            SMALLFOLK_THROW("using boolean on non bool object");
         return b;
     }
     // get a string value
     std::string const & str() const
     {
         if (!isstring())
-            throw smallfolk_exception("using str on non string object");
+            SMALLFOLK_THROW("using str on non string object");
         return s;
     }
     // get a table value
     LuaTable const & tbl() const
     {
         if (!istable())
-            throw smallfolk_exception("using tbl on non table object");
+            SMALLFOLK_THROW("using tbl on non table object");
         return *tbl_ptr;
     }
 
+    // value getters that do not throw
+    // return false and leave out unchanged if the value has another type
+    bool try_num(double & out) const
+    {
+        if (!isnumber())
+            return false;
+        out = d;
+        return true;
+    }
+    bool try_boolean(bool & out) const
+    {
+        if (!isbool())
+            return false;
+        out = b;
+        return true;
+    }
+    bool try_str(std::string & out) const
+    {
+        if (!isstring())
+            return false;
+        out = s;
+        return true;
+    }
+    bool try_tbl(LuaTable const *& out) const
+    {
+        if (!istable())
+            return false;
+        out = tbl_ptr.get();
+        return true;
+    }
+
     // Returns a typetag, the internal identifier for each type
     LuaTypeTag typetag() const { return tag; }
     // Returns the LuaVal's type as a string
@@ -229,38 +486,146 @@ public:
     // Returns the type tag's type as a string
     static std::string type(LuaTypeTag tag);
 
+    // options for dumps
+    struct DumpOptions
+    {
+        // STANDARD is the output of the reference Smallfolk
+        // MINIMAL has the shortest numbers that read back exactly and picks ' or " for each string, whichever needs fewer doubled quotes
+        // PRETTY puts each table entry on its own indented line, loads accepts it as well
+        enum Style
+        {
+            STANDARD,
+            MINIMAL,
+            PRETTY,
+        };
+
+        DumpOptions() : cache(false), compress(false), style(STANDARD), indent(2) {}
+
+        // reuse the serialization of tables that have not changed since a previous dumps
+        // and store the serialization of the other tables for the next dumps.
+        // Only the largest tables of at most LuaTable::cache_size bytes are stored,
+        // so the stored serializations take at most as much memory as the output.
+        // dumps modifies the stored serializations, so with cache enabled
+        // the same value must not be serialized from multiple threads at the same time.
+        bool cache;
+        // compress the output with SmallfolkLZ, see smallfolk_lz.h
+        // loads recognizes compressed input automatically
+        bool compress;
+        // output style, the serialization cache is only used with STANDARD
+        Style style;
+        // spaces per nesting level with PRETTY
+        unsigned int indent;
+    };
+
     // serializes the value into string
-    // errmsg is optional value to output error message to on failure
-    // returns empty string on error
+    // every valid value can be serialized, errmsg is only kept for compatibility
     std::string dumps(std::string* errmsg = nullptr) const;
+    std::string dumps(DumpOptions const & options, std::string* errmsg = nullptr) const;
 
     // deserialize a string into a LuaVal
-    // string param is deserialized string
+    // string param is deserialized string, it can be plain or compressed
     // errmsg is optional value to output error message to on failure
     static LuaVal loads(std::string const & string, std::string* errmsg = nullptr);
+    static LuaVal loads(const char * data, size_t size, std::string* errmsg = nullptr);
+
+    // options for loads
+    struct LoadOptions
+    {
+        LoadOptions() : max_memory(0) {}
+
+        // loads fails with LoadResult::MEMORY_LIMIT before the loaded value would use more than
+        // this many bytes as counted by memory_usage, 0 is no limit.
+        // Each string, table and table entry is counted before it is created, so a small
+        // message can not make the parser allocate much more than the limit.
+        // Compressed input is rejected before decompressing if the text is longer than the limit.
+        size_t max_memory;
+    };
+    static LuaVal loads(std::string const & string, LoadOptions const & options, std::string* errmsg = nullptr);
+    static LuaVal loads(const char * data, size_t size, LoadOptions const & options, std::string* errmsg = nullptr);
+
+    // result of try_loads, converts to true on success
+    struct LoadResult
+    {
+        enum Code
+        {
+            OK,
+            UNEXPECTED_CHARACTER, // no value starts with the character
+            UNEXPECTED_TABLE_CHARACTER, // table value not followed by , or }
+            EOF_IN_STRING,
+            INVALID_NUMBER,
+            NO_DECIMALS,
+            INVALID_EXPONENT,
+            NIL_KEY,
+            INVALID_COMPRESSION,
+            TOO_DEEP, // tables nested deeper than max_load_depth
+            MEMORY_LIMIT, // the value would use more than LoadOptions::max_memory
+        };
+
+        LoadResult() : code(OK), offset(0), found('\0') {}
+
+        explicit operator bool() const { return code == OK; }
+        // formats the error message that loads would output
+        std::string message() const;
+
+        Code code;
+        // byte offset of the error, in the decompressed text for compressed input
+        size_t offset;
+        // character at offset, '\0' at the end of input
+        char found;
+    };
+
+    // loads rejects tables nested deeper than this instead of running out of stack
+    static unsigned int const max_load_depth = 512;
+
+    // deserializes like loads, but does not throw or format error messages
+    // which makes rejecting malformed input cheap
+    // out is set to the deserialized value, or nil on failure
+    static LoadResult try_loads(std::string const & string, LuaVal & out);
+    static LoadResult try_loads(const char * data, size_t size, LuaVal & out);
+    static LoadResult try_loads(std::string const & string, LuaVal & out, LoadOptions const & options);
+    static LoadResult try_loads(const char * data, size_t size, LuaVal & out, LoadOptions const & options);
+
+    // deserializes a file into a LuaVal
+    // the file is memory mapped and parsed without copying it to memory first
+    // errmsg is optional value to output error message to on failure
+    // returns nil on error
+    static LuaVal load_file(std::string const & path, std::string* errmsg = nullptr);
+    static LuaVal load_file(std::string const & path, LoadOptions const & options, std::string* errmsg = nullptr);
+    // serializes the value into a file
+    // the output is written in pieces without creating the whole serialization in memory,
+    // except when compressing. Table caches are used but not filled.
+    // errmsg is optional value to output error message to on failure
+    // returns false on error
+    bool save_file(std::string const & path, std::string* errmsg = nullptr) const;
+    bool save_file(std::string const & path, DumpOptions const & options, std::string* errmsg = nullptr) const;
+
+    // creates an immutable deep snapshot of the value, see LuaFrozen
+    LuaFrozen freeze() const;
 
     bool operator==(LuaVal const& rhs) const;
     bool operator!=(LuaVal const& rhs) const { return !(*this == rhs); }
+    // compares tables by their pairs instead of identity, other values compare like ==
+    // pairs with nil values are ignored, table keys are compared by content as well and nan equals nan
+    bool deep_equals(LuaVal const & v) const;
+    // hash of the value that is equal for deep_equals values, the order of the pairs does not matter
+    // the hash of each table is stored in the table until it or a table inside it changes,
+    // so hashing a large tree again only visits the changed tables.
+    // Like dumps with the cache, the same value must not be hashed from multiple threads at the same time.
+    size_t content_hash() const;
+    // bytes of memory the value uses: the LuaVal itself and the strings, tables, table entries,
+    // hash indexes and serialization caches it owns, without the overhead of the allocator
+    size_t memory_usage() const;
 
     // You can use !val to check for nil or false
     explicit operator bool() const;
 
     LuaVal& operator=(LuaVal const& val);
-    LuaVal& operator=(LuaVal && val)
-    {
-        tag = std::move(val.tag);
-        tbl_ptr = std::move(val.tbl_ptr);
-        s = std::move(val.s);
-        d = std::move(val.d);
-        b = std::move(val.b);
-        return *this;
-    }
+    LuaVal& operator=(LuaVal && val);
 
 private:
 
     template<typename T> void InitializeSequence(T const & l)
     {
-        LuaTable & tbl = *tbl_ptr;
         unsigned int i = 0;
         for (auto const & v : l)
         {
@@ -268,23 +633,41 @@ private:
             if (vv.isnil())
                 ++i;
             else
-                tbl[++i] = std::move(vv);
+                slot(++i) = std::move(vv);
         }
     }
 
     template<typename T> void InitializeMap(T const & l)
     {
-        LuaTable & tbl = *tbl_ptr;
         for (auto const & e : l)
         {
             LuaVal k(e.first);
             LuaVal v(e.second);
             if (!k.isnil() && !v.isnil())
-                tbl[std::move(k)] = std::move(v);
+                slot(k) = std::move(v);
         }
     }
+
+    static LuaTable * newtable();
+    static LuaTable * newtable(std::unordered_map<LuaVal, LuaVal> const & l);
+    static LuaTable * copytable(LuaTable const & t);
+    // returns the value of key k in the table without marking the table changed
+    LuaVal & slot(LuaVal const & k);
+    LuaVal & index(LuaVal && k);
+    // updates the parent of the table after it was moved to this value
+    void reparent();
+    // makes this value nil after its contents were moved out
+    void moved();
+    // memory_usage without the LuaVal itself
+    size_t heap_usage() const;
+    template<typename K, typename V> LuaVal & set_pair(K && k, V && v);
+    template<typename K, typename V> LuaVal & setignore_pair(K && k, V && v);
+    // return nullptr on success or the error message
+    template<typename V> const char * insert_checked(V && v, LuaVal const & pos);
+    const char * remove_checked(LuaVal const & pos);
     
     friend size_t LuaValHash(LuaVal const & v);
+    friend class LuaKey;
 
     LuaTypeTag tag;
     TblPtr tbl_ptr;
@@ -292,6 +675,698 @@ private:
     // int64_t i; // lua 5.3 support?
     double d;
     bool b;
+    // the table this value is stored in, if any
+    LuaTable * owner = nullptr;
+};
+
+// LuaTable is the table storage of a LuaVal, a map from LuaVal keys to LuaVal values.
+// Each entry is allocated separately, so references to values stay valid until the entry is removed.
+// The policy decides how the entries are indexed. Entries are iterated in insertion order,
+// except with TABLE_ORDERED where they are iterated in key order.
+// Lookups take a LuaKey, so looking up a string literal or a number does not create a LuaVal.
+// In addition to the key-value pairs it keeps a version that LuaVal increments
+// on each change to the table or to any table inside it.
+// The version is used to reuse the serialization of unchanged tables with DumpOptions::cache.
+class LuaVal::LuaTable
+{
+    struct Node;
+
+public:
+    typedef std::pair<const LuaVal, LuaVal> value_type;
+
+    template<typename T, typename N> class basic_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef LuaTable::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef T * pointer;
+        typedef T & reference;
+
+        basic_iterator() : node(nullptr) {}
+        explicit basic_iterator(N * node) : node(node) {}
+        // iterator converts to const_iterator
+        template<typename U, typename M> basic_iterator(basic_iterator<U, M> const & it) : node(it.node) {}
+
+        reference operator*() const { return node->kv; }
+        pointer operator->() const { return &node->kv; }
+        basic_iterator & operator++()
+        {
+            node = node->next;
+            return *this;
+        }
+        basic_iterator operator++(int)
+        {
+            basic_iterator it = *this;
+            node = node->next;
+            return it;
+        }
+        bool operator==(basic_iterator const & it) const { return node == it.node; }
+        bool operator!=(basic_iterator const & it) const { return node != it.node; }
+
+    private:
+        friend class LuaTable;
+        template<typename U, typename M> friend class basic_iterator;
+        N * node;
+    };
+    typedef basic_iterator<value_type, Node> iterator;
+    typedef basic_iterator<value_type const, Node const> const_iterator;
+
+    LuaTable() : shift(64), table_policy(TABLE_AUTO), kind(SCAN), head(nullptr), tail(nullptr), entries(0), parent(nullptr), version(1), cache_version(0), hash_version(0), hash(0) {}
+    LuaTable(std::unordered_map<LuaVal, LuaVal> const & m);
+    LuaTable(std::initializer_list<value_type> l);
+    LuaTable(LuaTable const & t);
+    LuaTable& operator=(LuaTable const & t) = delete;
+    ~LuaTable() { clear(); }
+
+    iterator begin() { return iterator(head); }
+    iterator end() { return iterator(); }
+    const_iterator begin() const { return const_iterator(head); }
+    const_iterator end() const { return const_iterator(); }
+    size_t size() const { return entries; }
+    bool empty() const { return entries == 0; }
+
+    iterator find(LuaKey const & k) { return iterator(lookup(k)); }
+    const_iterator find(LuaKey const & k) const { return const_iterator(lookup(k)); }
+    size_t count(LuaKey const & k) const { return lookup(k) ? 1 : 0; }
+    // removes the key, returns the number of removed entries
+    size_t erase(LuaKey const & k);
+    // removes the entry, returns the next entry
+    iterator erase(const_iterator it);
+    void clear();
+    // makes room for n entries without rehashing
+    void reserve(size_t n);
+
+    LuaTablePolicy policy() const { return table_policy; }
+    // rebuilds the index for the policy, TABLE_ORDERED sorts the entries
+    void set_policy(LuaTablePolicy policy);
+    // tables with TABLE_AUTO have no index up to this many entries
+    static size_t const small_size = 8;
+    // bytes the next new key allocates for its entry and for growing the index, see LuaVal::memory_usage
+    size_t insert_bytes() const;
+
+    // returns the value of key k, adds key-table pair if not existing
+    LuaVal & operator[](LuaKey const & k)
+    {
+        if (Node * n = lookup(k))
+            return n->kv.second;
+        return insert(k.hash(), k.value(), LuaVal())->kv.second;
+    }
+    template<typename T, typename std::enable_if<std::is_same<T, LuaVal>::value, int>::type = 0>
+    LuaVal & operator[](T && k)
+    {
+        if (Node * n = lookup(k))
+            return n->kv.second;
+        size_t hash = LuaKey(k).hash();
+        return insert(hash, std::move(k), LuaVal())->kv.second;
+    }
+    // returns the value of key k, adds key-nil pair if not existing
+    // use when the value is assigned right away, it does not allocate a table like operator[]
+    template<typename K> LuaVal & slot(K && k)
+    {
+        LuaKey key(k);
+        if (Node * n = lookup(key))
+            return n->kv.second;
+        return insert(key.hash(), std::forward<K>(k), LuaVal(TNIL))->kv.second;
+    }
+    // adds the key-value pair if the key does not exist yet
+    template<typename K, typename V> std::pair<iterator, bool> emplace(K && k, V && v)
+    {
+        LuaKey key(k);
+        if (Node * n = lookup(key))
+            return std::make_pair(iterator(n), false);
+        return std::make_pair(iterator(insert(key.hash(), std::forward<K>(k), std::forward<V>(v))), true);
+    }
+
+    // tables with a longer serialization are not stored by the serialization cache
+    static size_t const cache_size = 4096;
+
+private:
+    friend class LuaVal;
+    friend class LuaDumper;
+    friend struct Serializer::ACC;
+
+    // increments the version of this table and all tables it is in
+    void touch()
+    {
+        for (LuaTable * t = this; t; t = t->parent)
+            ++t->version;
+    }
+
+    // returns the stored serialization of the table or nullptr if the table has changed since
+    std::string const * cached() const { return cache_version == version ? &cache : nullptr; }
+    // stores out[start..end), the serialization of the table, unless it is stored already
+    void store(std::string const & out, size_t start, size_t end) const;
+    // frees the stored serialization
+    void drop() const;
+
+    struct Node
+    {
+        template<typename K, typename V> Node(size_t hash, K && k, V && v) : kv(std::forward<K>(k), std::forward<V>(v)), hash(hash), chain(nullptr), prev(nullptr), next(nullptr) {}
+
+        value_type kv;
+        size_t hash;
+        Node * chain; // next node in the same bucket
+        Node * prev; // previous and next node in insertion order
+        Node * next;
+    };
+
+    // the index in use, tables with TABLE_AUTO start with SCAN and switch to OPEN when they grow
+    enum Kind
+    {
+        SCAN, // no index, the entries are compared one by one
+        CHAINED, // buckets holds the bucket chains
+        OPEN, // slots holds the open addressing slots
+        SORTED, // buckets holds the entries sorted by key
+    };
+    // open addressing slot, the hash is kept next to the node so probing does not visit other nodes
+    struct Slot
+    {
+        size_t hash;
+        Node * node;
+    };
+
+    Node * lookup(LuaKey const & k) const;
+    template<typename K, typename V> Node * insert(size_t hash, K && k, V && v)
+    {
+        Node * n = new (node_memory()) Node(hash, std::forward<K>(k), std::forward<V>(v));
+        link(n);
+        return n;
+    }
+    // memory for a node from the LuaPool of the thread or the heap
+    static void * node_memory();
+    // destroys the node and returns its memory to the LuaPool of the thread or the heap
+    static void free_node(Node * n);
+    // adds the node to the index and the end of the entries, or its place in key order when SORTED
+    void link(Node * n);
+    // removes the node from the index
+    void unindex(Node * n);
+    // empties the table for reuse from a LuaPool
+    void recycle();
+    size_t bucket(size_t hash) const;
+    // number of open addressing slots rehash creates for n entries
+    static size_t open_size(size_t n);
+    // rebuilds the index with room for n entries
+    void rehash(size_t n);
+    // position of the first sorted entry that is not less than k
+    size_t lower_bound(LuaKey const & k) const;
+    // sorts the entries by key
+    void sort();
+
+    // buckets.size() or slots.size() is 2^(64 - shift)
+    std::vector<Node *> buckets;
+    std::vector<Slot> slots;
+    unsigned int shift;
+    LuaTablePolicy table_policy;
+    Kind kind;
+    Node * head;
+    Node * tail;
+    size_t entries;
+    // the table this table is stored in as a value, if any
+    LuaTable * parent;
+    uint64_t version;
+    mutable uint64_t cache_version;
+    mutable std::string cache;
+    // content_hash of the table at hash_version
+    mutable uint64_t hash_version;
+    mutable size_t hash;
+};
+
+inline void LuaVal::reparent()
+{
+    if (tbl_ptr)
+        tbl_ptr->parent = owner;
+}
+
+inline LuaKey::LuaKey(LuaVal const & v) : tag(v.tag), str(v.s.data()), len(v.s.size()), d(v.d), b(v.b), val(&v)
+{
+}
+
+inline bool LuaKey::operator==(LuaVal const & v) const
+{
+    if (tag != v.tag)
+        return false;
+    switch (tag)
+    {
+    case TBOOL:
+        return b == v.b;
+    case TNIL:
+        return true;
+    case TSTRING:
+        return len == v.s.size() && std::memcmp(str, v.s.data(), len) == 0;
+    case TNUMBER:
+        return d == v.d;
+    case TTABLE:
+        return val->tbl_ptr == v.tbl_ptr;
+    }
+    return false;
+}
+
+inline int LuaKey::compare(LuaKey const & k) const
+{
+    // bool, number, string, table
+    static int const rank[] = { 0, 3, 2, 4, 1 };
+    if (tag != k.tag)
+        return rank[tag] - rank[k.tag];
+    switch (tag)
+    {
+    case TBOOL:
+        return int(b) - int(k.b);
+    case TNIL:
+        return 0;
+    case TSTRING:
+    {
+        int c = std::memcmp(str, k.str, len < k.len ? len : k.len);
+        if (c)
+            return c;
+        return len < k.len ? -1 : len > k.len ? 1 : 0;
+    }
+    case TNUMBER:
+        // nan is greater than the other numbers
+        if (d < k.d || (d == d && k.d != k.d))
+            return -1;
+        if (k.d < d || (d != d && k.d == k.d))
+            return 1;
+        return 0;
+    case TTABLE:
+        return std::less<LuaVal::LuaTable const *>()(val->tbl_ptr.get(), k.val->tbl_ptr.get()) ? -1 : val->tbl_ptr == k.val->tbl_ptr ? 0 : 1;
+    }
+    return 0;
+}
+
+inline void LuaVal::moved()
+{
+    tag = TNIL;
+    if (owner)
+        owner->touch();
+}
+
+// PairIterator walks a table in lua order without creating any containers.
+// The sequence 1..n is looked up key by key and then the rest of the pairs
+// are walked in insertion order, skipping the keys of the sequence.
+class LuaVal::PairIterator
+{
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef LuaTable::value_type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef value_type const * pointer;
+    typedef value_type const & reference;
+
+    // constructs the end iterator
+    PairIterator() : tbl(nullptr), n(0), sequence(false), rest(false) {}
+    // rest is false for ipairs
+    PairIterator(LuaTable const & tbl, bool rest) : tbl(&tbl), n(0), sequence(true), rest(rest) { ++*this; }
+
+    reference operator*() const { return *it; }
+    pointer operator->() const { return &*it; }
+    PairIterator & operator++()
+    {
+        if (sequence)
+        {
+            it = tbl->find(n + 1);
+            if (it != tbl->end() && !it->second.isnil())
+            {
+                ++n;
+                return *this;
+            }
+            sequence = false;
+            if (!rest)
+            {
+                it = tbl->end();
+                return *this;
+            }
+            it = tbl->begin();
+        }
+        else
+            ++it;
+        while (it != tbl->end() && (it->second.isnil() || in_sequence(it->first)))
+            ++it;
+        return *this;
+    }
+    PairIterator operator++(int)
+    {
+        PairIterator copy = *this;
+        ++*this;
+        return copy;
+    }
+    bool operator==(PairIterator const & o) const { return it == o.it; }
+    bool operator!=(PairIterator const & o) const { return it != o.it; }
+
+private:
+    // returns true if k is a key of the already iterated sequence
+    bool in_sequence(LuaVal const & k) const
+    {
+        return k.tag == TNUMBER && k.d >= 1 && k.d <= n && static_cast<double>(static_cast<unsigned int>(k.d)) == k.d;
+    }
+
+    LuaTable const * tbl;
+    LuaTable::const_iterator it;
+    unsigned int n; // length of the sequence iterated so far
+    bool sequence;
+    bool rest;
+};
+
+// PairRange is the range returned by LuaVal::ipairs and LuaVal::pairs for range based for loops.
+class LuaVal::PairRange
+{
+public:
+    PairRange(PairIterator first) : first(first) {}
+    PairIterator begin() const { return first; }
+    PairIterator end() const { return PairIterator(); }
+
+private:
+    PairIterator first;
+};
+
+inline LuaVal::PairRange LuaVal::ipairs() const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using ipairs on non table object");
+    return PairRange(PairIterator(*tbl_ptr, false));
+}
+
+inline LuaVal::PairRange LuaVal::pairs() const
+{
+    if (!istable())
+        SMALLFOLK_THROW("using pairs on non table object");
+    return PairRange(PairIterator(*tbl_ptr, true));
+}
+
+template<typename It> LuaVal & LuaVal::append_range(It first, It last)
+{
+    if (!istable())
+        SMALLFOLK_THROW("using append_range on non table object");
+    unsigned int i = len();
+    for (; first != last; ++first)
+    {
+        LuaVal v(*first);
+        if (v.isnil())
+            ++i;
+        else
+            slot(++i) = std::move(v);
+    }
+    tbl_ptr->touch();
+    return *this;
+}
+
+template<typename T> LuaVal & LuaVal::append_range(T && range)
+{
+    if (std::is_rvalue_reference<T&&>::value)
+        return append_range(std::make_move_iterator(std::begin(range)), std::make_move_iterator(std::end(range)));
+    return append_range(std::begin(range), std::end(range));
+}
+
+// LuaFrozen is an immutable deep snapshot of a LuaVal created with LuaVal::freeze.
+// The whole tree is stored in flat arrays, table entries are sorted by key
+// and the integer sequence 1..n is indexed directly.
+// Snapshots are reference counted with std::shared_ptr, so copies of a LuaFrozen
+// are cheap and can be handed to and read from any number of threads without locks.
+// Values returned by get keep the whole snapshot alive.
+class LuaFrozen
+{
+public:
+    // constructs a nil value
+    LuaFrozen();
+
+    bool isstring() const { return typetag() == TSTRING; }
+    bool isnumber() const { return typetag() == TNUMBER; }
+    bool istable() const { return typetag() == TTABLE; }
+    bool isbool() const { return typetag() == TBOOL; }
+    bool isnil() const { return typetag() == TNIL; }
+
+    LuaTypeTag typetag() const;
+    std::string type() const { return LuaVal::type(typetag()); }
+    std::string tostring() const;
+
+    // get a number value
+    double num() const;
+    // get a boolean value
+    bool boolean() const;
+    // get a string value
+    std::string const & str() const;
+
+    // gettable, returns nil if the key is not found
+    // table keys are never found as tables are compared by identity
+    LuaFrozen get(LuaKey const & k) const;
+    LuaFrozen operator[](LuaKey const & k) const { return get(k); }
+    // returns true if value was found with key
+    bool has(LuaKey const & k) const;
+    // table array size, not actual element count
+    unsigned int len() const;
+    // number of key-value pairs in the table
+    size_t size() const;
+    // key and value of the ith pair in the table, 0 <= i < size()
+    // the sequence 1..len() comes first, the rest are in sorted key order
+    LuaFrozen key(size_t i) const;
+    LuaFrozen value(size_t i) const;
+
+    // there is no tbl(), the pairs are not stored as a LuaTable, iterate them with key and value
+
+    // serialized form of the value, created by the first call and then reused
+    // the sequence part of tables is written first and the rest in sorted key order
+    std::string const & dumps() const;
+
+    // creates a mutable deep copy of the value
+    LuaVal thaw() const;
+
+    // You can use !val to check for nil or false
+    explicit operator bool() const { return !isnil() && (!isbool() || boolean()); }
+
+private:
+    friend class LuaVal;
+    struct Snapshot;
+
+    LuaFrozen(std::shared_ptr<const Snapshot> const & snap, unsigned int index) : snap(snap), index(index) {}
+
+    int find(LuaKey const & k) const;
+
+    std::shared_ptr<const Snapshot> snap;
+    unsigned int index;
+};
+
+// LuaDumper serializes a value in steps, so a big value can be serialized a bit at a time,
+// for example once per frame, without blocking the thread for the whole dumps.
+// The tables being serialized are kept on an explicit stack between the steps.
+// The output is the same as the output of dumps with the same options.
+// The value is not copied. It must stay alive and must not be changed until the dumper is done,
+// a step throws if the value was changed since the first step.
+class LuaDumper
+{
+public:
+    explicit LuaDumper(LuaVal const & value, LuaVal::DumpOptions const & options = LuaVal::DumpOptions());
+    // the dumper would refer to a destroyed temporary
+    LuaDumper(LuaVal && value, LuaVal::DumpOptions const & options = LuaVal::DumpOptions()) = delete;
+    LuaDumper(LuaDumper && other);
+    LuaDumper & operator=(LuaDumper && other);
+    ~LuaDumper();
+
+    // serializes until the output has grown by at least max_bytes, returns true when done
+    bool step(size_t max_bytes);
+    // serializes until max_time has passed, returns true when done
+    // the time is checked every few values, a long string or a cached table is written as a whole
+    bool step_for(std::chrono::nanoseconds max_time);
+    // returns true when the whole value has been serialized
+    bool done() const;
+    // the output so far, with compress the output is compressed in the last step
+    std::string const & output() const;
+    // moves the output out of the dumper
+    std::string take();
+
+private:
+    LuaDumper(LuaDumper const &) = delete;
+    LuaDumper & operator=(LuaDumper const &) = delete;
+
+    struct State;
+
+    bool run(size_t max_bytes, std::chrono::steady_clock::time_point const * deadline);
+
+    std::unique_ptr<State> state;
+};
+
+// LuaTemplate is a serialization prepared once for messages that are mostly the same every time.
+// The parts that change are marked with LuaTemplate::hole(n) in the value, dumps formats only
+// the values given for the holes and copies the prepared text between them.
+// A template without holes is a constant serialization.
+class LuaTemplate
+{
+public:
+    // a value given for a hole, formatted like dumps formats it
+    class Value
+    {
+    public:
+        template<typename T, typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+        Value(T n) : kind(NUMBER), d(static_cast<double>(n)), s(nullptr), len(0), v(nullptr) {}
+        Value(bool b) : kind(BOOL), d(b ? 1 : 0), s(nullptr), len(0), v(nullptr) {}
+        Value(const char * s) : kind(STRING), d(0), s(s), len(std::strlen(s)), v(nullptr) {}
+        Value(std::string const & s) : kind(STRING), d(0), s(s.data()), len(s.size()), v(nullptr) {}
+        Value(LuaVal const & v) : kind(VALUE), d(0), s(nullptr), len(0), v(&v) {}
+
+    private:
+        friend class LuaTemplate;
+
+        enum Kind
+        {
+            NUMBER,
+            BOOL,
+            STRING,
+            VALUE,
+        };
+
+        Kind kind;
+        double d;
+        const char * s;
+        size_t len;
+        LuaVal const * v;
+    };
+
+    // position of a hole in the prepared text
+    struct Hole
+    {
+        size_t offset;
+        unsigned int index;
+        // table nesting level for PRETTY
+        unsigned int level;
+    };
+
+    // prepares the serialization of value, with compress the output of each dumps is compressed
+    explicit LuaTemplate(LuaVal const & value, LuaVal::DumpOptions const & options = LuaVal::DumpOptions());
+
+    // placeholder for the nth value given to dumps, can be used as a value or a key
+    // it is a string that starts with an escape character, such strings are reserved in templates
+    static LuaVal hole(unsigned int n);
+    // number of values dumps expects
+    unsigned int holes() const { return nholes; }
+
+    // serializes the template with the values for the holes, values[n] is used for hole(n)
+    std::string dumps(std::initializer_list<Value> values = {}) const;
+    // appends the serialization to out, so a buffer can be reused
+    void dumps(std::string & out, std::initializer_list<Value> values) const;
+
+private:
+    std::string text;
+    std::vector<Hole> positions;
+    unsigned int nholes;
+    LuaVal::DumpOptions options;
+};
+
+// LuaQuery reads the values at a few key paths from a serialization without loading all of it.
+// The paths are compiled into a tree once, find then scans the text in one pass.
+// Only the tables on the paths are walked, the rest is checked and skipped without allocating
+// and only the values at the paths are created.
+// The values and errors are the same as loads followed by get would give, a key that appears
+// more than once in a table gets its last value like in loads.
+class LuaQuery
+{
+public:
+    // keys from the outermost table inwards, { "args", 2 } is the value at ["args"][2]
+    // an empty path is the whole value
+    typedef std::vector<LuaVal> Path;
+
+    // the keys must be numbers, strings or bools, nan is not allowed
+    explicit LuaQuery(std::vector<Path> const & paths);
+
+    // number of paths
+    size_t size() const { return npaths; }
+
+    // sets out[n] to the value at the nth path or nil if it does not exist
+    // on failure all values are nil and the result is the error loads would return
+    LuaVal::LoadResult find(std::string const & string, std::vector<LuaVal> & out) const;
+    LuaVal::LoadResult find(const char * data, size_t size, std::vector<LuaVal> & out) const;
+
+private:
+    struct Scanner;
+
+    struct Node
+    {
+        explicit Node(LuaVal const & key) : key(key) {}
+
+        LuaVal key;
+        std::vector<unsigned int> children;
+        // the paths that end at this node
+        std::vector<unsigned int> paths;
+    };
+
+    // nodes[0] is the root
+    std::vector<Node> nodes;
+    size_t npaths;
+};
+
+// LuaTranscode converts serialized values between smallfolk text and JSON or MessagePack without loading them.
+// The input is read once and each value is written as soon as it is read, no LuaVals are created.
+// Besides the output only small scratch vectors are used: the offsets of the values of a table
+// that is rewritten with its keys and, for JSON, the keys of the open objects.
+//
+// Tables are told apart like dumps does it: a table whose keys are 1, 2, 3... in order is written
+// as an array and other tables as objects or maps. The pairs keep the order of the input, a key that
+// appears twice is written twice and readers keep the last one like loads does.
+// When a table turns out not to be a sequence after some values, the values written so far are
+// moved in place once to add their keys. An empty table is an empty object or map.
+//
+// Values are mapped as follows:
+// - nil is null, also in tables, so {1,n,3} is [1,null,3]
+// - numbers are copied as text between smallfolk and JSON, both use the same number syntax.
+//   MessagePack gets the smallest integer format for whole numbers and float64 for the rest.
+//   MessagePack integers are written exactly, loads reads the ones above 2^53 as the nearest double.
+// - I and i are 1e999 and -1e999 in JSON, which read as infinities in JavaScript and most JSON readers,
+//   N and Q are null. In MessagePack all four are float64 infinities and nans.
+// - JSON object keys are strings: whole number keys are written like integers and other number keys
+//   in the shortest form that reads back, so 1, 1.0 and 1e0 are all "1". I, i, N and Q keys are
+//   "Infinity", "-Infinity" and "NaN" like in JavaScript and bools are "true" and "false".
+//   A string key with the same text as a number or bool key of the table, like 1 and "1", is UNSUPPORTED
+//   with the offset of the table. Keys read from JSON stay strings.
+// - strings must be UTF-8 for JSON, \u escapes of JSON are read into UTF-8.
+//   MessagePack str and bin are both read as strings, strings are written as str.
+// Table keys, strings that are not UTF-8 for JSON, MessagePack ext values and nil keys are not supported.
+class LuaTranscode
+{
+public:
+    // result of a conversion, converts to true on success
+    struct Result
+    {
+        enum Code
+        {
+            OK,
+            INVALID_SMALLFOLK, // load has the error loads would return for the input
+            INVALID_JSON,
+            INVALID_MSGPACK, // invalid or cut short
+            TOO_DEEP, // JSON or MessagePack nested deeper than LuaVal::max_load_depth
+            UNSUPPORTED, // the value at offset can not be written in the output format
+        };
+
+        Result() : code(OK), offset(0) {}
+
+        explicit operator bool() const { return code == OK; }
+        // formats an error message like loads does
+        std::string message() const;
+
+        Code code;
+        // byte offset of the error in the input, in the decompressed text for compressed smallfolk
+        size_t offset;
+        LuaVal::LoadResult load;
+    };
+
+    // the conversions append their output to out, so a buffer can be reused
+    // on failure out is left as it was
+    // smallfolk input can be plain or compressed, trailing data after the value is ignored like loads does
+    static Result to_json(std::string const & string, std::string & out);
+    static Result to_json(const char * data, size_t size, std::string & out);
+    static Result to_msgpack(std::string const & string, std::string & out);
+    static Result to_msgpack(const char * data, size_t size, std::string & out);
+    // the smallfolk output is like dumps with the STANDARD style, the input must be a single value
+    static Result from_json(std::string const & string, std::string & out);
+    static Result from_json(const char * data, size_t size, std::string & out);
+    static Result from_msgpack(std::string const & string, std::string & out);
+    static Result from_msgpack(const char * data, size_t size, std::string & out);
+
+private:
+    struct Table;
+    struct JsonWriter;
+    struct MsgpackWriter;
+    template<typename Writer> struct Reader;
+    template<typename Writer> static Result transcode(const char * data, size_t size, std::string & out);
+    struct JsonReader;
+    struct MsgpackReader;
 };
 
 #endif
@@ -0,0 +1,458 @@
+#include "smallfolk_log.h"
+#include "smallfolk_lz.h"
+#include <algorithm> // std::max
+#include <limits> // std::numeric_limits
+
+#ifdef _WIN32
+#include <io.h> // _chsize_s
+#else
+#include <unistd.h> // ftruncate
+#endif
+
+namespace SmallfolkLog
+{
+    static char const magic[] = { '\x1b', 'S', 'F', 'L' };
+    static char const index_magic[] = { '\x1b', 'S', 'F', 'I' };
+    static char const version = 1;
+    static uint64_t const header_size = sizeof(magic) + 1;
+    static uint64_t const index_header_size = 16;
+    // bytes read from the log at a time when scanning it and when reading a record
+    static size_t const scan_window = 1 << 16;
+    static size_t const read_window = 1 << 12;
+    // longest LEB128 varint of a size_t
+    static size_t const max_varint = (sizeof(size_t) * 8 + 6) / 7;
+
+    bool fail(std::string * errmsg, std::string const & msg, std::string const & path)
+    {
+        if (errmsg)
+            *errmsg += "Smallfolk: " + msg + " " + path;
+        return false;
+    }
+
+    void write64(std::string & out, uint64_t v)
+    {
+        for (unsigned int i = 0; i < 8; ++i)
+            out += static_cast<char>((v >> (i * 8)) & 0xFF);
+    }
+
+    uint64_t read64(const char * p)
+    {
+        uint64_t v = 0;
+        for (unsigned int i = 0; i < 8; ++i)
+            v |= static_cast<uint64_t>(static_cast<unsigned char>(p[i])) << (i * 8);
+        return v;
+    }
+
+    // the log can be larger than long, so fseek and ftell are not enough
+    bool seek(FILE * file, uint64_t pos)
+    {
+#ifdef _WIN32
+        return _fseeki64(file, static_cast<__int64>(pos), SEEK_SET) == 0;
+#else
+        return fseeko(file, static_cast<off_t>(pos), SEEK_SET) == 0;
+#endif
+    }
+
+    bool file_size(FILE * file, uint64_t & size)
+    {
+#ifdef _WIN32
+        if (_fseeki64(file, 0, SEEK_END) != 0)
+            return false;
+        __int64 pos = _ftelli64(file);
+#else
+        if (fseeko(file, 0, SEEK_END) != 0)
+            return false;
+        off_t pos = ftello(file);
+#endif
+        if (pos < 0)
+            return false;
+        size = static_cast<uint64_t>(pos);
+        return true;
+    }
+
+    bool truncate(FILE * file, uint64_t size)
+    {
+        if (fflush(file) != 0)
+            return false;
+#ifdef _WIN32
+        return _chsize_s(_fileno(file), static_cast<__int64>(size)) == 0;
+#else
+        return ftruncate(fileno(file), static_cast<off_t>(size)) == 0;
+#endif
+    }
+
+    // both files are only accessed through larger reads and writes, stdio buffering is not needed
+    FILE * open_file(std::string const & path, const char * mode)
+    {
+        FILE * file = fopen(path.c_str(), mode);
+        if (file)
+            setvbuf(file, nullptr, _IONBF, 0);
+        return file;
+    }
+
+    void close_file(FILE *& file)
+    {
+        if (file)
+            fclose(file);
+        file = nullptr;
+    }
+
+    // returns a pointer to the n bytes at pos of the file, reading at least window_size bytes into window if needed
+    // returns nullptr if they are past size or can not be read
+    const char * fetch(FILE * file, uint64_t size, std::string & window, uint64_t & window_pos, size_t window_size, uint64_t pos, size_t n)
+    {
+        if (pos > size || n > size - pos)
+            return nullptr;
+        if (pos >= window_pos && pos - window_pos + n <= window.size())
+            return window.data() + (pos - window_pos);
+        size_t len = static_cast<size_t>(std::min<uint64_t>(std::max(n, window_size), size - pos));
+        window.resize(len);
+        window_pos = pos;
+        if (!seek(file, pos) || fread(&window[0], 1, len, file) != len)
+        {
+            window.clear();
+            return nullptr;
+        }
+        return window.data();
+    }
+
+    enum Frame
+    {
+        FRAME_OK,
+        FRAME_PARTIAL, // the file ends inside the frame
+        FRAME_INVALID,
+    };
+
+    // reads the header of the frame at pos, sets the record length and the offset of the record data
+    Frame read_frame(FILE * file, uint64_t size, std::string & window, uint64_t & window_pos, size_t window_size, uint64_t pos, size_t & len, uint64_t & data)
+    {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(max_varint, size - pos));
+        const char * p = fetch(file, size, window, window_pos, window_size, pos, n);
+        if (!p)
+            return n ? FRAME_INVALID : FRAME_PARTIAL;
+        int varint = SmallfolkLZ::read_varint(p, n, len);
+        if (varint < 0)
+            return FRAME_INVALID;
+        if (varint == 0)
+            return FRAME_PARTIAL;
+        data = pos + varint;
+        return len <= size - data ? FRAME_OK : FRAME_PARTIAL;
+    }
+
+    // reads the index file contents, keeps only the entries that point inside a log of size bytes
+    // returns false if the index header is missing or invalid
+    bool read_index(std::string const & contents, uint64_t size, size_t & interval, std::vector<uint64_t> & offsets)
+    {
+        offsets.clear();
+        if (contents.size() < index_header_size || contents.compare(0, sizeof(index_magic), index_magic, sizeof(index_magic)) != 0 || contents[sizeof(index_magic)] != version)
+            return false;
+        uint64_t n = read64(contents.data() + 8);
+        if (n == 0 || n > (std::numeric_limits<size_t>::max)())
+            return false;
+        interval = static_cast<size_t>(n);
+        for (size_t i = static_cast<size_t>(index_header_size); i + 8 <= contents.size(); i += 8)
+        {
+            uint64_t offset = read64(contents.data() + i);
+            // the first record follows the header and the offsets increase
+            if (offsets.empty() ? offset != header_size : offset <= offsets.back())
+                break;
+            if (offset >= size)
+                break;
+            offsets.push_back(offset);
+        }
+        return true;
+    }
+
+    bool read_all(FILE * file, std::string & contents)
+    {
+        uint64_t size;
+        if (!file_size(file, size) || !seek(file, 0))
+            return false;
+        contents.resize(static_cast<size_t>(size));
+        return contents.empty() || fread(&contents[0], 1, contents.size(), file) == contents.size();
+    }
+
+    // drops the index entries of records that were cut short
+    void trim(size_t interval, size_t records, std::vector<uint64_t> & offsets)
+    {
+        while (!offsets.empty() && (offsets.size() - 1) * interval >= records)
+            offsets.pop_back();
+    }
+
+    // counts the records after the last index entry and adds the missing index entries
+    // sets end to the end of the last complete record
+    Frame scan(FILE * file, uint64_t size, size_t interval, std::vector<uint64_t> & offsets, size_t & records, uint64_t & end)
+    {
+        std::string window;
+        uint64_t window_pos = 0;
+        uint64_t pos = offsets.empty() ? header_size : offsets.back();
+        records = offsets.empty() ? 0 : (offsets.size() - 1) * interval;
+        while (pos < size)
+        {
+            size_t len;
+            uint64_t data;
+            Frame frame = read_frame(file, size, window, window_pos, scan_window, pos, len, data);
+            if (frame != FRAME_OK)
+            {
+                end = pos;
+                trim(interval, records, offsets);
+                return frame;
+            }
+            if (records % interval == 0 && records / interval == offsets.size())
+                offsets.push_back(pos);
+            ++records;
+            pos = data + len;
+        }
+        end = pos;
+        return FRAME_OK;
+    }
+}
+
+SmallfolkLog::Writer::Writer(size_t interval) : data(nullptr), index(nullptr), interval(interval ? interval : 1), records(0), end(0), failed(false)
+{
+}
+
+SmallfolkLog::Writer::~Writer()
+{
+    close();
+}
+
+bool SmallfolkLog::Writer::fail(std::string * errmsg, std::string const & msg)
+{
+    failed = true;
+    if (errmsg)
+        *errmsg += msg;
+    return false;
+}
+
+bool SmallfolkLog::Writer::open(std::string const & path, std::string * errmsg)
+{
+    close();
+    failed = false;
+    records = 0;
+    std::string index_path = path + ".idx";
+
+    data = open_file(path, "r+b");
+    if (!data)
+    {
+        // only create the log if it does not exist, w+b would empty it
+        FILE * existing = fopen(path.c_str(), "rb");
+        if (existing)
+            fclose(existing);
+        else
+            data = open_file(path, "w+b");
+    }
+    if (!data)
+        return SmallfolkLog::fail(errmsg, "log could not open", path);
+    uint64_t size;
+    if (!file_size(data, size))
+    {
+        close_file(data);
+        return SmallfolkLog::fail(errmsg, "log could not read", path);
+    }
+    if (size == 0)
+    {
+        std::string header(magic, sizeof(magic));
+        header += version;
+        if (fwrite(header.data(), 1, header.size(), data) != header.size())
+        {
+            close_file(data);
+            return SmallfolkLog::fail(errmsg, "log could not write", path);
+        }
+        size = header.size();
+    }
+    else
+    {
+        char header[header_size];
+        if (size < header_size || !seek(data, 0) || fread(header, 1, sizeof(header), data) != sizeof(header) ||
+            std::string(header, sizeof(magic)) != std::string(magic, sizeof(magic)) || header[sizeof(magic)] != version)
+        {
+            close_file(data);
+            return SmallfolkLog::fail(errmsg, "log invalid header in", path);
+        }
+    }
+
+    std::vector<uint64_t> offsets;
+    index = open_file(index_path, "r+b");
+    std::string contents;
+    if (!index || !read_all(index, contents) || !read_index(contents, size, interval, offsets))
+    {
+        // rebuild the whole index
+        close_file(index);
+        index = open_file(index_path, "w+b");
+        contents.clear();
+    }
+    if (!index)
+    {
+        close_file(data);
+        return SmallfolkLog::fail(errmsg, "log could not open", index_path);
+    }
+
+    size_t indexed = offsets.size();
+    if (scan(data, size, interval, offsets, records, end) == FRAME_INVALID)
+    {
+        close();
+        return SmallfolkLog::fail(errmsg, "log invalid record in", path);
+    }
+    indexed = std::min(indexed, offsets.size());
+    // remove a record cut short and index entries that were not valid
+    if ((end < size && !truncate(data, end)) || !seek(data, end))
+    {
+        close();
+        return SmallfolkLog::fail(errmsg, "log could not write", path);
+    }
+    uint64_t index_end = contents.empty() ? 0 : index_header_size + indexed * 8;
+    if ((index_end < contents.size() && !truncate(index, index_end)) || !seek(index, index_end))
+    {
+        close();
+        return SmallfolkLog::fail(errmsg, "log could not write", index_path);
+    }
+    if (contents.empty())
+    {
+        pending_index.assign(index_magic, sizeof(index_magic));
+        pending_index += version;
+        pending_index.append(3, '\0');
+        write64(pending_index, interval);
+    }
+    for (size_t i = indexed; i < offsets.size(); ++i)
+        write64(pending_index, offsets[i]);
+    return flush(errmsg);
+}
+
+bool SmallfolkLog::Writer::append(const char * serialized, size_t size)
+{
+    if (!data || failed)
+        return false;
+    if (records % interval == 0)
+        write64(pending_index, end);
+    size_t before = pending.size();
+    SmallfolkLZ::write_varint(pending, size);
+    pending.append(serialized, size);
+    end += pending.size() - before;
+    ++records;
+    return pending.size() < buffer_size || flush();
+}
+
+bool SmallfolkLog::Writer::append(LuaVal const & value, LuaVal::DumpOptions const & options)
+{
+    return append(value.dumps(options));
+}
+
+bool SmallfolkLog::Writer::flush(std::string * errmsg)
+{
+    if (!data)
+        return false;
+    if (failed)
+        return fail(errmsg, "Smallfolk: log flush after a failed write");
+    // the records go first, an index entry must not point past the end of the log
+    if (!pending.empty() && fwrite(pending.data(), 1, pending.size(), data) != pending.size())
+        return fail(errmsg, "Smallfolk: log could not write records");
+    pending.clear();
+    if (!pending_index.empty() && fwrite(pending_index.data(), 1, pending_index.size(), index) != pending_index.size())
+        return fail(errmsg, "Smallfolk: log could not write index");
+    pending_index.clear();
+    return true;
+}
+
+bool SmallfolkLog::Writer::close(std::string * errmsg)
+{
+    bool ok = !data || flush(errmsg);
+    if (data && fclose(data) != 0 && ok)
+        ok = fail(errmsg, "Smallfolk: log could not write records");
+    if (index && fclose(index) != 0 && ok)
+        ok = fail(errmsg, "Smallfolk: log could not write index");
+    data = nullptr;
+    index = nullptr;
+    pending.clear();
+    pending_index.clear();
+    return ok;
+}
+
+SmallfolkLog::Reader::Reader() : data(nullptr), file_size(0), interval(default_interval), records(0), window_pos(0)
+{
+}
+
+SmallfolkLog::Reader::~Reader()
+{
+    close();
+}
+
+bool SmallfolkLog::Reader::open(std::string const & path, std::string * errmsg)
+{
+    close();
+    data = open_file(path, "rb");
+    if (!data)
+        return SmallfolkLog::fail(errmsg, "log could not open", path);
+    char header[header_size];
+    if (!SmallfolkLog::file_size(data, file_size) || !seek(data, 0) || fread(header, 1, sizeof(header), data) != sizeof(header) ||
+        std::string(header, sizeof(magic)) != std::string(magic, sizeof(magic)) || header[sizeof(magic)] != version)
+    {
+        close();
+        return SmallfolkLog::fail(errmsg, "log invalid header in", path);
+    }
+
+    FILE * index = open_file(path + ".idx", "rb");
+    std::string contents;
+    if (!index || !read_all(index, contents) || !read_index(contents, file_size, interval, offsets))
+        interval = default_interval;
+    close_file(index);
+
+    uint64_t end;
+    // a record cut short is being written or was left by a crash, the records before it are readable
+    if (scan(data, file_size, interval, offsets, records, end) == FRAME_INVALID)
+    {
+        close();
+        return SmallfolkLog::fail(errmsg, "log invalid record in", path);
+    }
+    file_size = end;
+    return true;
+}
+
+void SmallfolkLog::Reader::close()
+{
+    close_file(data);
+    file_size = 0;
+    interval = default_interval;
+    records = 0;
+    offsets.clear();
+    window.clear();
+    window_pos = 0;
+}
+
+bool SmallfolkLog::Reader::read(size_t n, std::string & out, std::string * errmsg)
+{
+    if (n >= records)
+    {
+        if (errmsg)
+            *errmsg += "Smallfolk: log record " + std::to_string(n) + " out of range";
+        return false;
+    }
+    uint64_t pos = offsets[n / interval];
+    for (size_t i = n % interval + 1; i > 0; --i)
+    {
+        size_t len;
+        uint64_t start;
+        if (read_frame(data, file_size, window, window_pos, read_window, pos, len, start) != FRAME_OK)
+            break;
+        if (i == 1)
+        {
+            const char * p = fetch(data, file_size, window, window_pos, read_window, start, len);
+            if (!p)
+                break;
+            out.assign(p, len);
+            return true;
+        }
+        pos = start + len;
+    }
+    if (errmsg)
+        *errmsg += "Smallfolk: log could not read record " + std::to_string(n);
+    return false;
+}
+
+LuaVal SmallfolkLog::Reader::get(size_t n, std::string * errmsg)
+{
+    std::string serialized;
+    if (!read(n, serialized, errmsg))
+        return LuaVal::nil;
+    return LuaVal::loads(serialized, errmsg);
+}
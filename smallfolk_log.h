@@ -0,0 +1,114 @@
+#ifndef SMALLFOLK_LOG_H
+#define SMALLFOLK_LOG_H
+
+#include "smallfolk.h"
+#include <string>
+#include <vector>
+#include <cstdio> // FILE
+#include <cstdint> // uint64_t
+
+// SmallfolkLog is an append-only log of serialized values with random access to each record.
+// Records are dumps outputs, plain or compressed, and are read back with loads.
+//
+// File format, lengths are LEB128 varints like in smallfolk_lz.h:
+//   "\x1bSFL" version(1 byte)
+//   records: length data
+// The offset of every interval-th record is stored in path + ".idx":
+//   "\x1bSFI" version(1 byte) 3 zero bytes interval(8 bytes)
+//   offsets: 8 bytes each
+// The numbers in the index file are little endian.
+// The index is written after the records it points to, so a crash can only leave it behind.
+// A record cut short by a crash is ignored by Reader and removed by Writer::open,
+// an index file that is behind or missing is completed from the records.
+namespace SmallfolkLog
+{
+    // default number of records between index entries
+    static size_t const default_interval = 64;
+
+    // Writer appends records to a log.
+    // Appended records are kept in memory until flush, which writes them with one write call
+    // and the new index entries with another, so a batch of records costs two system calls.
+    // The records are flushed automatically when more than buffer_size bytes are waiting.
+    class Writer
+    {
+    public:
+        // interval is only used for new logs, existing logs keep theirs
+        explicit Writer(size_t interval = default_interval);
+        // flushes and closes the log, errors are lost, call close to see them
+        ~Writer();
+
+        // opens or creates the log at path for appending
+        // errmsg is optional value to output error message to on failure
+        bool open(std::string const & path, std::string * errmsg = nullptr);
+        // appends a serialized value, a dumps output
+        bool append(const char * data, size_t size);
+        bool append(std::string const & serialized) { return append(serialized.data(), serialized.size()); }
+        // serializes and appends the value, compressed if options.compress is set
+        bool append(LuaVal const & value, LuaVal::DumpOptions const & options = LuaVal::DumpOptions());
+        // writes the appended records to the files
+        bool flush(std::string * errmsg = nullptr);
+        // flushes and closes the log
+        bool close(std::string * errmsg = nullptr);
+
+        bool is_open() const { return data != nullptr; }
+        // number of records in the log, including the ones not flushed yet
+        size_t size() const { return records; }
+
+        static size_t const buffer_size = 1 << 20;
+
+    private:
+        Writer(Writer const &) = delete;
+        Writer & operator=(Writer const &) = delete;
+
+        bool fail(std::string * errmsg, std::string const & msg);
+
+        FILE * data;
+        FILE * index;
+        size_t interval;
+        size_t records;
+        // size of the log with the appended records
+        uint64_t end;
+        std::string pending;
+        std::string pending_index;
+        // set when a write failed, the files may be incomplete after it
+        bool failed;
+    };
+
+    // Reader reads records of a log by their number.
+    // A record is found by its index entry and skipping at most interval - 1 records after it,
+    // only the record itself is parsed. A Reader must not be used from multiple threads at the same time.
+    class Reader
+    {
+    public:
+        Reader();
+        ~Reader();
+
+        // opens the log at path, records appended later are not seen until it is opened again
+        // errmsg is optional value to output error message to on failure
+        bool open(std::string const & path, std::string * errmsg = nullptr);
+        void close();
+
+        // number of records in the log
+        size_t size() const { return records; }
+        // reads the serialized text of record n
+        bool read(size_t n, std::string & out, std::string * errmsg = nullptr);
+        // loads record n, returns nil on failure like loads
+        LuaVal get(size_t n, std::string * errmsg = nullptr);
+
+    private:
+        Reader(Reader const &) = delete;
+        Reader & operator=(Reader const &) = delete;
+
+        FILE * data;
+        uint64_t file_size;
+        size_t interval;
+        size_t records;
+        // offsets of every interval-th record
+        std::vector<uint64_t> offsets;
+        // the last bytes read from the file
+        std::string window;
+        uint64_t window_pos;
+    };
+}
+
+#endif
@@ -0,0 +1,309 @@
+#include "smallfolk_lz.h"
+#include <vector>
+#include <cstring> // std::memcpy
+#include <cstdint> // uint32_t
+#include <algorithm> // std::min
+
+namespace SmallfolkLZ
+{
+    static char const magic[] = { '\x1b', 'S', 'F', 'Z' };
+    static char const version = 1;
+    static size_t const min_match = 4;
+    static size_t const max_offset = 65535;
+    static unsigned int const hash_bits = 14;
+
+    void write_length(std::string & out, size_t len);
+    void write_sequence(std::string & out, const char * literals, size_t nliterals, size_t offset, size_t match);
+    void compress_block(const char * data, size_t start, size_t end, std::vector<uint32_t> & table, std::string & out);
+    bool decompress_block(const char * data, size_t size, size_t raw, std::string & out);
+
+    inline uint32_t read32(const char * p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+}
+
+void SmallfolkLZ::write_varint(std::string & out, size_t v)
+{
+    while (v >= 0x80)
+    {
+        out += static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+int SmallfolkLZ::read_varint(const char * data, size_t size, size_t & v)
+{
+    v = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (i * 7 >= sizeof(size_t) * 8)
+            return -1;
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        v |= static_cast<size_t>(c & 0x7F) << (i * 7);
+        if (!(c & 0x80))
+            return static_cast<int>(i + 1);
+    }
+    return 0;
+}
+
+void SmallfolkLZ::write_length(std::string & out, size_t len)
+{
+    while (len >= 255)
+    {
+        out += static_cast<char>(255);
+        len -= 255;
+    }
+    out += static_cast<char>(len);
+}
+
+void SmallfolkLZ::write_sequence(std::string & out, const char * literals, size_t nliterals, size_t offset, size_t match)
+{
+    size_t extra = match ? match - min_match : 0;
+    unsigned char token = static_cast<unsigned char>((std::min<size_t>(nliterals, 15) << 4) | std::min<size_t>(extra, 15));
+    out += static_cast<char>(token);
+    if (nliterals >= 15)
+        write_length(out, nliterals - 15);
+    out.append(literals, nliterals);
+    if (!match)
+        return;
+    out += static_cast<char>(offset & 0xFF);
+    out += static_cast<char>(offset >> 8);
+    if (extra >= 15)
+        write_length(out, extra - 15);
+}
+
+void SmallfolkLZ::compress_block(const char * data, size_t start, size_t end, std::vector<uint32_t> & table, std::string & out)
+{
+    // table holds the position + 1 of the last occurrence of each hashed 4 byte sequence
+    size_t anchor = start;
+    size_t i = start;
+    while (i + min_match <= end)
+    {
+        uint32_t seq = read32(data + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - hash_bits);
+        size_t candidate = table[h];
+        table[h] = static_cast<uint32_t>(i + 1);
+        if (candidate && i - (candidate - 1) <= max_offset && read32(data + candidate - 1) == seq)
+        {
+            size_t from = candidate - 1;
+            size_t len = min_match;
+            while (i + len < end && data[from + len] == data[i + len])
+                ++len;
+            write_sequence(out, data + anchor, i - anchor, i - from, len);
+            i += len;
+            anchor = i;
+        }
+        else
+            ++i;
+    }
+    if (anchor < end)
+        write_sequence(out, data + anchor, end - anchor, 0, 0);
+}
+
+bool SmallfolkLZ::decompress_block(const char * data, size_t size, size_t raw, std::string & out)
+{
+    // the block must not write more than its declared raw length
+    size_t const limit = out.size() + raw;
+    size_t i = 0;
+    while (i < size)
+    {
+        unsigned char token = static_cast<unsigned char>(data[i++]);
+        size_t nliterals = token >> 4;
+        if (nliterals == 15)
+        {
+            unsigned char c;
+            do
+            {
+                if (i >= size)
+                    return false;
+                c = static_cast<unsigned char>(data[i++]);
+                nliterals += c;
+            } while (c == 255);
+        }
+        if (nliterals > size - i || nliterals > limit - out.size())
+            return false;
+        out.append(data + i, nliterals);
+        i += nliterals;
+        if (i == size)
+            break; // last sequence has no match
+        if (size - i < 2)
+            return false;
+        size_t offset = static_cast<unsigned char>(data[i]) | (static_cast<size_t>(static_cast<unsigned char>(data[i + 1])) << 8);
+        i += 2;
+        size_t match = (token & 0x0F) + min_match;
+        if ((token & 0x0F) == 15)
+        {
+            unsigned char c;
+            do
+            {
+                if (i >= size)
+                    return false;
+                c = static_cast<unsigned char>(data[i++]);
+                match += c;
+            } while (c == 255);
+        }
+        if (offset == 0 || offset > out.size() || match > limit - out.size())
+            return false;
+        size_t from = out.size() - offset;
+        size_t to = out.size();
+        out.resize(to + match);
+        char * p = &out[0];
+        if (offset >= match)
+            std::memcpy(p + to, p + from, match);
+        else
+            for (size_t j = 0; j < match; ++j)
+                p[to + j] = p[from + j]; // overlapping copy repeats the pattern
+    }
+    return true;
+}
+
+bool SmallfolkLZ::is_compressed(const char * data, size_t size)
+{
+    return size >= sizeof(magic) && std::memcmp(data, magic, sizeof(magic)) == 0;
+}
+
+bool SmallfolkLZ::decompressed_size(const char * data, size_t size, size_t & len)
+{
+    if (!is_compressed(data, size) || size <= sizeof(magic) || data[sizeof(magic)] != version)
+        return false;
+    return read_varint(data + sizeof(magic) + 1, size - sizeof(magic) - 1, len) > 0;
+}
+
+std::string SmallfolkLZ::compress(const char * data, size_t size)
+{
+    std::string out;
+    out.reserve(size / 2 + 16);
+    out.append(magic, sizeof(magic));
+    out += version;
+    write_varint(out, size);
+    std::vector<uint32_t> table(1 << hash_bits, 0);
+    std::string block;
+    for (size_t start = 0; start < size; start += block_size)
+    {
+        size_t end = std::min(size, start + block_size);
+        block.clear();
+        compress_block(data, start, end, table, block);
+        write_varint(out, end - start);
+        if (block.size() >= end - start)
+        {
+            // store blocks that do not compress as is
+            write_varint(out, end - start);
+            out.append(data + start, end - start);
+        }
+        else
+        {
+            write_varint(out, block.size());
+            out += block;
+        }
+    }
+    write_varint(out, 0);
+    return out;
+}
+
+bool SmallfolkLZ::decompress(const char * data, size_t size, std::string & out, std::string * errmsg)
+{
+    Decompressor d;
+    if (d.feed(data, size) && d.done())
+    {
+        out.swap(d.output());
+        return true;
+    }
+    if (errmsg)
+        *errmsg += d.error().empty() ? "Smallfolk: decompress eof before frame ends" : d.error();
+    return false;
+}
+
+SmallfolkLZ::Decompressor::Decompressor() : state(HEADER), pos(0), total(0)
+{
+}
+
+bool SmallfolkLZ::Decompressor::fail(const char * msg)
+{
+    state = FAILED;
+    err = std::string("Smallfolk: decompress ") + msg;
+    return false;
+}
+
+bool SmallfolkLZ::Decompressor::feed(const char * data, size_t size)
+{
+    if (state == FAILED)
+        return false;
+    if (state == DONE)
+        return size == 0 || fail("data after frame end");
+    in.append(data, size);
+    while (true)
+    {
+        const char * p = in.data() + pos;
+        size_t n = in.size() - pos;
+        if (state == HEADER)
+        {
+            if (n < sizeof(magic) + 1)
+                break;
+            if (!is_compressed(p, n))
+                return fail("invalid header");
+            if (p[sizeof(magic)] != version)
+                return fail("unsupported version");
+            int len = read_varint(p + sizeof(magic) + 1, n - sizeof(magic) - 1, total);
+            if (len < 0)
+                return fail("invalid length");
+            if (len == 0)
+                break;
+            // the header is not trusted for more than a block, the output grows as blocks arrive
+            out.reserve(out.size() + std::min(total, block_size));
+            pos += sizeof(magic) + 1 + len;
+            state = BLOCK;
+        }
+        else if (state == BLOCK)
+        {
+            size_t raw, compressed;
+            int len1 = read_varint(p, n, raw);
+            if (len1 < 0)
+                return fail("invalid block length");
+            if (len1 == 0)
+                break;
+            if (raw == 0)
+            {
+                pos += len1;
+                if (out.size() != total)
+                    return fail("length does not match header");
+                state = DONE;
+                if (pos != in.size())
+                    return fail("data after frame end");
+                break;
+            }
+            int len2 = read_varint(p + len1, n - len1, compressed);
+            if (len2 < 0)
+                return fail("invalid block length");
+            if (len2 == 0)
+                break;
+            if (raw > block_size || compressed > raw)
+                return fail("invalid block length");
+            size_t header = static_cast<size_t>(len1 + len2);
+            if (n - header < compressed)
+                break; // wait for the rest of the block
+            size_t before = out.size();
+            if (compressed == raw)
+                out.append(p + header, raw);
+            else if (!decompress_block(p + header, compressed, raw, out))
+                return fail("invalid block");
+            if (out.size() - before != raw)
+                return fail("block length does not match");
+            if (out.size() > total)
+                return fail("length does not match header");
+            pos += header + compressed;
+        }
+        else
+            break;
+    }
+    // drop consumed input once it makes up most of the buffer
+    if (pos > in.size() / 2)
+    {
+        in.erase(0, pos);
+        pos = 0;
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+#ifndef SMALLFOLK_LZ_H
+#define SMALLFOLK_LZ_H
+
+#include <string>
+#include <cstddef> // size_t
+
+// SmallfolkLZ is a small LZ77 compressor used for compressed dumps and loads.
+// A compressed frame starts with a header that can never start a serialized value,
+// so compressed and plain serializations can be told apart.
+//
+// Frame format, all lengths are LEB128 varints:
+//   "\x1bSFZ" version(1 byte) uncompressed_length
+//   blocks: raw_length compressed_length data
+//   end: raw_length 0
+// Block data is stored as is when compressed_length equals raw_length, otherwise it is
+// a sequence of LZ4 style (token, literals, offset, match length) sequences.
+// Matches can refer up to 65535 bytes back, also to previous blocks.
+namespace SmallfolkLZ
+{
+    // uncompressed size of one block
+    static size_t const block_size = 1 << 16;
+
+    // appends v as a LEB128 varint
+    void write_varint(std::string & out, size_t v);
+    // reads a LEB128 varint into v
+    // returns 0 if the varint is incomplete and -1 if it is malformed, otherwise the varint length
+    int read_varint(const char * data, size_t size, size_t & v);
+
+    // returns true if data starts with a compressed frame header
+    bool is_compressed(const char * data, size_t size);
+
+    // reads the uncompressed length from the frame header without decompressing
+    // returns false if data does not start with a valid header
+    bool decompressed_size(const char * data, size_t size, size_t & len);
+
+    // compresses data into a frame
+    std::string compress(const char * data, size_t size);
+
+    // decompresses a whole frame into out
+    // errmsg is optional value to output error message to on failure
+    // returns false on malformed input
+    bool decompress(const char * data, size_t size, std::string & out, std::string * errmsg = nullptr);
+
+    // Decompressor decompresses a frame that arrives in pieces.
+    // Each complete block is decompressed as soon as it has been fed,
+    // so the output grows while the input is still being read.
+    class Decompressor
+    {
+    public:
+        Decompressor();
+
+        // adds the next piece of compressed input and decompresses all complete blocks
+        // returns false if the input is malformed, see error()
+        bool feed(const char * data, size_t size);
+        // returns true when the end of the frame has been reached
+        bool done() const { return state == DONE; }
+        // the decompressed output so far
+        std::string & output() { return out; }
+        // error message of the failed feed
+        std::string const & error() const { return err; }
+
+    private:
+        enum State
+        {
+            HEADER,
+            BLOCK,
+            DONE,
+            FAILED,
+        };
+
+        bool fail(const char * msg);
+
+        State state;
+        std::string in; // input not yet consumed
+        size_t pos; // consumed bytes of in
+        size_t total; // uncompressed size from the header
+        std::string out;
+        std::string err;
+    };
+}
+
+#endif
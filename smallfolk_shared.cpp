@@ -0,0 +1,264 @@
+#include "smallfolk_shared.h"
+#include <algorithm> // std::sort, std::lower_bound, std::find
+#include <atomic> // std::atomic_load
+#include <cstdint> // uint64_t
+
+namespace
+{
+    void check_key(LuaKey const & k)
+    {
+        if (k.isnil())
+            SMALLFOLK_THROW("using LuaSharedTable with nil key");
+        if (k.typetag() == TTABLE)
+            SMALLFOLK_THROW("using LuaSharedTable with table key");
+        // nan is the only number that is not == to itself, creating a number LuaVal does not allocate
+        if (k.typetag() == TNUMBER && !(k == k.value()))
+            SMALLFOLK_THROW("using LuaSharedTable with nan key");
+    }
+
+    // the key order of LuaFrozen and TABLE_ORDERED
+    bool key_less(LuaVal const & a, LuaVal const & b)
+    {
+        return LuaKey(a).compare(b) < 0;
+    }
+}
+
+LuaSharedTable::Snapshot::Entry const * LuaSharedTable::Snapshot::find(LuaKey const & k) const
+{
+    size_t hash = k.hash();
+    size_t i = LuaSharedTable::index(hash, mask);
+    Map const & map = *maps[i];
+    size_t at = LuaSharedTable::find(map, k, hash);
+    if (at == map.size())
+        return nullptr;
+    return &entries[first[i] + at];
+}
+
+LuaFrozen LuaSharedTable::Snapshot::get(LuaKey const & k) const
+{
+    Entry const * e = find(k);
+    return e ? e->value : LuaFrozen();
+}
+
+bool LuaSharedTable::Snapshot::has(LuaKey const & k) const
+{
+    return find(k) != nullptr;
+}
+
+std::string LuaSharedTable::Snapshot::dumps() const
+{
+    // a sequence 1..n has at most as many keys as the snapshot
+    std::vector<Entry const *> seq(entries.size() + 1);
+    for (Entry const & e : entries)
+    {
+        double d = e.key->isnumber() ? e.key->num() : 0;
+        if (d >= 1 && d <= entries.size() && d == static_cast<double>(static_cast<size_t>(d)))
+            seq[static_cast<size_t>(d) - 1] = &e;
+    }
+    seq.resize(std::find(seq.begin(), seq.end(), nullptr) - seq.begin());
+    std::vector<Entry const *> rest;
+    rest.reserve(entries.size() - seq.size());
+    for (Entry const & e : entries)
+    {
+        // the sequence keys are whole numbers in 1..seq.size(), other keys are not
+        double d = e.key->isnumber() ? e.key->num() : 0;
+        if (d < 1 || d > seq.size() || d != static_cast<double>(static_cast<size_t>(d)))
+            rest.push_back(&e);
+    }
+    std::sort(rest.begin(), rest.end(), [](Entry const * l, Entry const * r) { return key_less(*l->key, *r->key); });
+
+    std::string out = "{";
+    for (Entry const * e : seq)
+    {
+        if (out.size() > 1)
+            out += ',';
+        out += e->value.dumps();
+    }
+    for (Entry const * e : rest)
+    {
+        if (out.size() > 1)
+            out += ',';
+        out += e->key->dumps();
+        out += ':';
+        out += e->value.dumps();
+    }
+    out += '}';
+    return out;
+}
+
+LuaVal LuaSharedTable::Snapshot::thaw() const
+{
+    LuaVal t(TTABLE);
+    for (Entry const & e : entries)
+        t.set(*e.key, e.value.thaw());
+    return t;
+}
+
+LuaSharedTable::LuaSharedTable(size_t nshards) : mask(1)
+{
+    while (mask < nshards)
+        mask <<= 1;
+    shards.reset(new Shard[mask]);
+    for (size_t i = 0; i < mask; ++i)
+        shards[i].map = std::make_shared<const Map>();
+    --mask;
+}
+
+size_t LuaSharedTable::index(size_t hash, size_t mask)
+{
+    // the high bits of the hash times the golden ratio, the low bits of a number hash can be all the same
+    uint64_t h = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull;
+    return static_cast<size_t>(h >> 32) & mask;
+}
+
+size_t LuaSharedTable::find(Map const & map, LuaKey const & k, size_t hash)
+{
+    auto it = std::lower_bound(map.begin(), map.end(), hash, [](std::shared_ptr<Cell> const & c, size_t h) { return c->hash < h; });
+    for (; it != map.end() && (*it)->hash == hash; ++it)
+    {
+        if (k == (*it)->key)
+            return it - map.begin();
+    }
+    return map.size();
+}
+
+LuaFrozen LuaSharedTable::get(LuaKey const & k) const
+{
+    size_t hash = k.hash();
+    std::shared_ptr<const Map> map = std::atomic_load(&shard(hash).map);
+    size_t at = find(*map, k, hash);
+    if (at == map->size())
+        return LuaFrozen();
+    return *std::atomic_load(&(*map)[at]->value);
+}
+
+bool LuaSharedTable::has(LuaKey const & k) const
+{
+    size_t hash = k.hash();
+    std::shared_ptr<const Map> map = std::atomic_load(&shard(hash).map);
+    return find(*map, k, hash) != map->size();
+}
+
+void LuaSharedTable::publish(Shard & s, LuaKey const & k, size_t hash, LuaFrozen const & v)
+{
+    Map const & map = *s.map;
+    size_t at = find(map, k, hash);
+    if (v.isnil())
+    {
+        if (at == map.size())
+            return;
+        // the new map shares the cells, only the pointers are copied
+        std::shared_ptr<Map> next = std::make_shared<Map>();
+        next->reserve(map.size() - 1);
+        next->insert(next->end(), map.begin(), map.begin() + at);
+        next->insert(next->end(), map.begin() + at + 1, map.end());
+        std::atomic_store(&s.map, std::shared_ptr<const Map>(std::move(next)));
+        return;
+    }
+    std::shared_ptr<const LuaFrozen> value = std::make_shared<const LuaFrozen>(v);
+    if (at != map.size())
+    {
+        // an existing key only gets a new value, the map stays the same
+        std::atomic_store(&map[at]->value, std::move(value));
+        return;
+    }
+    std::shared_ptr<Cell> cell = std::make_shared<Cell>(k.value(), hash);
+    cell->value = std::move(value);
+    auto pos = std::lower_bound(map.begin(), map.end(), hash, [](std::shared_ptr<Cell> const & c, size_t h) { return c->hash < h; });
+    std::shared_ptr<Map> next = std::make_shared<Map>();
+    next->reserve(map.size() + 1);
+    next->insert(next->end(), map.begin(), pos);
+    next->push_back(std::move(cell));
+    next->insert(next->end(), pos, map.end());
+    std::atomic_store(&s.map, std::shared_ptr<const Map>(std::move(next)));
+}
+
+void LuaSharedTable::set(LuaKey const & k, LuaVal const & v)
+{
+    set(k, v.freeze());
+}
+
+void LuaSharedTable::set(LuaKey const & k, LuaFrozen const & v)
+{
+    check_key(k);
+    size_t hash = k.hash();
+    Shard & s = shard(hash);
+    std::lock_guard<std::mutex> lock(s.write);
+    publish(s, k, hash, v);
+}
+
+bool LuaSharedTable::rem(LuaKey const & k)
+{
+    size_t hash = k.hash();
+    Shard & s = shard(hash);
+    std::lock_guard<std::mutex> lock(s.write);
+    if (find(*s.map, k, hash) == s.map->size())
+        return false;
+    publish(s, k, hash, LuaFrozen());
+    return true;
+}
+
+LuaFrozen LuaSharedTable::update(LuaKey const & k, std::function<LuaVal(LuaFrozen const &)> const & f)
+{
+    check_key(k);
+    size_t hash = k.hash();
+    Shard & s = shard(hash);
+    while (true)
+    {
+        // f runs without the lock on the value read like get does
+        std::shared_ptr<const Map> map = std::atomic_load(&s.map);
+        size_t at = find(*map, k, hash);
+        std::shared_ptr<const LuaFrozen> current;
+        if (at != map->size())
+            current = std::atomic_load(&(*map)[at]->value);
+        LuaFrozen v = f(current ? *current : LuaFrozen()).freeze();
+
+        std::lock_guard<std::mutex> lock(s.write);
+        // publish only if the value is still the one f got, current keeps it alive so its address is not reused
+        at = find(*s.map, k, hash);
+        if ((at == s.map->size() ? nullptr : (*s.map)[at]->value.get()) == current.get())
+        {
+            publish(s, k, hash, v);
+            return v;
+        }
+    }
+}
+
+size_t LuaSharedTable::size() const
+{
+    size_t n = 0;
+    for (size_t i = 0; i <= mask; ++i)
+        n += std::atomic_load(&shards[i].map)->size();
+    return n;
+}
+
+LuaSharedTable::Snapshot LuaSharedTable::snapshot() const
+{
+    Snapshot snap;
+    snap.mask = mask;
+    snap.maps.reserve(mask + 1);
+    snap.first.reserve(mask + 2);
+    // the writers of all shards are stopped at the same time, so the values are from one point in time
+    // the values can be read without atomic_load while the writers are stopped
+    for (size_t i = 0; i <= mask; ++i)
+        shards[i].write.lock();
+    for (size_t i = 0; i <= mask; ++i)
+        snap.maps.push_back(shards[i].map);
+    size_t n = 0;
+    for (auto const & map : snap.maps)
+        n += map->size();
+    snap.entries.reserve(n);
+    for (auto const & map : snap.maps)
+    {
+        snap.first.push_back(snap.entries.size());
+        for (auto const & cell : *map)
+        {
+            Snapshot::Entry entry = { &cell->key, *cell->value };
+            snap.entries.push_back(entry);
+        }
+    }
+    snap.first.push_back(snap.entries.size());
+    for (size_t i = 0; i <= mask; ++i)
+        shards[i].write.unlock();
+    return snap;
+}
@@ -0,0 +1,143 @@
+#ifndef SMALLFOLK_SHARED_H
+#define SMALLFOLK_SHARED_H
+
+#include "smallfolk.h"
+#include <string>
+#include <vector>
+#include <memory> // std::shared_ptr
+#include <mutex> // std::mutex
+#include <functional> // std::function
+
+// LuaSharedTable is a table that many threads can read and write at the same time.
+// The keys are split into shards by their hash. Each shard is an immutable map, an array of pointers
+// to cells holding a key and its value sorted by the hash of the key. A write replaces the value in the cell
+// of the key, so reads do not take the mutex of the shard: a read loads the current map of the shard
+// and the value of the cell. Lookups take a LuaKey, so reading with a string literal or a number does not allocate.
+// Writes to the same shard are serialized by a mutex of the shard, writes to different shards run in parallel.
+// Adding or removing a key copies the pointers of its shard into a new map, one allocation and
+// O(size / shards) pointer copies, the keys and values are shared. Replacing the value of a key copies nothing.
+//
+// Values are stored frozen, see LuaFrozen, so a value read from the table can be used
+// and serialized on any thread while other threads replace it.
+// Keys are strings, numbers and bools, nil, nan and table keys throw.
+//
+// The maps and values are loaded and stored with std::atomic_load and std::atomic_store of a std::shared_ptr.
+// libstdc++ and other standard libraries implement those with a small global pool of mutexes picked
+// by the address of the pointer, so a read can wait behind a writer storing the same pointer
+// and behind unrelated shared_ptr atomics that pick the same mutex. Each of those waits lasts
+// one pointer copy, a read never waits for a writer copying a map or freezing a value.
+class LuaSharedTable
+{
+    struct Cell;
+    // the cells of a shard sorted by the hash of their keys, copies share the cells
+    typedef std::vector<std::shared_ptr<Cell>> Map;
+
+public:
+    // Snapshot is a consistent view of the whole table at one point in time.
+    // It shares the keys and values with the table, taking it copies only pointers to them.
+    class Snapshot
+    {
+    public:
+        // returns nil if the key is not found
+        LuaFrozen get(LuaKey const & k) const;
+        LuaFrozen operator[](LuaKey const & k) const { return get(k); }
+        bool has(LuaKey const & k) const;
+        // number of key-value pairs
+        size_t size() const { return entries.size(); }
+        // key and value of the ith pair, 0 <= i < size(), the pairs are in no particular order
+        LuaVal const & key(size_t i) const { return *entries[i].key; }
+        LuaFrozen const & value(size_t i) const { return entries[i].value; }
+
+        // serialized form of the snapshot as a table, the same as the dumps of a LuaFrozen with the same content:
+        // the sequence 1..n first and the rest in sorted key order
+        std::string dumps() const;
+        // creates a mutable deep copy of the snapshot as a table
+        LuaVal thaw() const;
+
+    private:
+        friend class LuaSharedTable;
+
+        struct Entry
+        {
+            LuaVal const * key;
+            LuaFrozen value;
+        };
+
+        Snapshot() : mask(0) {}
+        Entry const * find(LuaKey const & k) const;
+
+        // the maps keep the keys alive
+        std::vector<std::shared_ptr<const Map>> maps;
+        // the entries of shard i are entries[first[i]..first[i + 1]), in the order of the cells in maps[i]
+        std::vector<Entry> entries;
+        std::vector<size_t> first;
+        // LuaSharedTable::mask of the table
+        size_t mask;
+    };
+
+    // nshards is rounded up to a power of two
+    explicit LuaSharedTable(size_t nshards = 16);
+
+    // returns nil if the key is not found, does not take the mutex of the shard
+    LuaFrozen get(LuaKey const & k) const;
+    LuaFrozen operator[](LuaKey const & k) const { return get(k); }
+    // returns true if value was found with key
+    bool has(LuaKey const & k) const;
+    // sets the key to a frozen copy of the value, nil removes the key
+    // the value is frozen before the shard is locked, a new key is copied into the table as a LuaVal
+    void set(LuaKey const & k, LuaVal const & v);
+    void set(LuaKey const & k, LuaFrozen const & v);
+    // removes the key, returns true if it was found
+    bool rem(LuaKey const & k);
+    // replaces the value of the key with f(current value), returns the new value
+    // f runs without holding a lock, so it can read and write the table. The result is stored
+    // only if the value of the key is still the one f got, otherwise f is called again with the new one,
+    // so no other write to the key is lost. f can be called more than once, it must not write the key itself.
+    // f gets nil for a missing key and can return nil to remove the key
+    LuaFrozen update(LuaKey const & k, std::function<LuaVal(LuaFrozen const &)> const & f);
+
+    // number of key-value pairs, the shards are counted one by one, so while other
+    // threads write it can be a count the table never had, use a snapshot for an exact count
+    size_t size() const;
+    size_t shard_count() const { return mask + 1; }
+
+    // takes a consistent snapshot, writers wait while the pointers to the keys and values are copied, readers do not wait for it
+    Snapshot snapshot() const;
+    // serializes a consistent snapshot, see Snapshot::dumps
+    std::string dumps() const { return snapshot().dumps(); }
+
+private:
+    LuaSharedTable(LuaSharedTable const &) = delete;
+    LuaSharedTable & operator=(LuaSharedTable const &) = delete;
+
+    struct Cell
+    {
+        Cell(LuaVal && key, size_t hash) : key(std::move(key)), hash(hash) {}
+
+        LuaVal const key;
+        // LuaKey::hash of the key
+        size_t const hash;
+        // replaced by writers holding the lock of the shard
+        std::shared_ptr<const LuaFrozen> value;
+    };
+
+    struct Shard
+    {
+        // held by writers while they replace map or a value in it
+        std::mutex write;
+        std::shared_ptr<const Map> map;
+    };
+
+    // shard of the key with the hash
+    static size_t index(size_t hash, size_t mask);
+    Shard & shard(size_t hash) const { return shards[index(hash, mask)]; }
+    // position of the cell of the key in the map, map.size() if the key is not found
+    static size_t find(Map const & map, LuaKey const & k, size_t hash);
+    // replaces the value of the key, nil removes it, the caller holds the lock of the shard
+    static void publish(Shard & s, LuaKey const & k, size_t hash, LuaFrozen const & v);
+
+    std::unique_ptr<Shard[]> shards;
+    size_t mask;
+};
+
+#endif